@@ -0,0 +1,200 @@
+// Microbenchmark for the runtime `dump` formatter.
+//
+// dump_per_digit is the routine add_boilerplate_asm() used to emit (a -O0
+// C function: one digit per iteration, everything spilled to the stack),
+// dump_pairs is the current one. Both are the emitted instruction sequences
+// with the write syscall replaced: they format rdi into the buffer at rsi
+// and return the number of bytes, so only formatting is measured.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+
+extern "C" uint64_t dump_per_digit(uint64_t value, char *out);
+extern "C" uint64_t dump_pairs(uint64_t value, char *out);
+
+
+asm(R"(
+    .intel_syntax noprefix
+    .text
+dump_per_digit:
+    push    rbp
+    mov     rbp, rsp
+    sub     rsp, 64
+    mov     QWORD PTR [rbp-64], rsi
+    mov     QWORD PTR [rbp-56], rdi
+    mov     DWORD PTR [rbp-4], 1
+    mov     edx, DWORD PTR [rbp-4]
+    mov     eax, 32
+    sub     rax, rdx
+    mov     BYTE PTR [rbp-48+rax], 10
+1:
+    mov     rcx, QWORD PTR [rbp-56]
+    mov     rdx, -3689348814741910323
+    mov     rax, rcx
+    mul     rdx
+    shr     rdx, 3
+    mov     rax, rdx
+    sal     rax, 2
+    add     rax, rdx
+    add     rax, rax
+    sub     rcx, rax
+    mov     rdx, rcx
+    mov     eax, edx
+    lea     ecx, [rax+48]
+    mov     edx, DWORD PTR [rbp-4]
+    mov     eax, 31
+    sub     rax, rdx
+    mov     edx, ecx
+    mov     BYTE PTR [rbp-48+rax], dl
+    add     DWORD PTR [rbp-4], 1
+    mov     rax, QWORD PTR [rbp-56]
+    mov     rdx, -3689348814741910323
+    mul     rdx
+    mov     rax, rdx
+    shr     rax, 3
+    mov     QWORD PTR [rbp-56], rax
+    cmp     QWORD PTR [rbp-56], 0
+    jne     1b
+    mov     eax, DWORD PTR [rbp-4]
+    mov     edx, DWORD PTR [rbp-4]
+    mov     ecx, 32
+    sub     rcx, rdx
+    lea     rdx, [rbp-48]
+    add     rcx, rdx
+    mov     rdx, rax
+    mov     rsi, rcx
+    mov     rdi, QWORD PTR [rbp-64]
+    mov     rcx, rdx
+    rep movsb
+    leave
+    ret
+
+dump_pairs:
+    mov     rcx, rdi
+    or      rcx, 1
+    bsr     rax, rcx
+    inc     eax
+    imul    eax, eax, 1233
+    shr     eax, 12
+    lea     rdx, [rip+bench_pow10]
+    cmp     rcx, QWORD PTR [rdx+rax*8]
+    sbb     rax, -1
+    lea     rcx, [rsi+rax]
+    lea     r9, [rax+1]
+    mov     BYTE PTR [rcx], 10
+    lea     r10, [rip+bench_digit_pairs]
+    movabs  r8, 0x28f5c28f5c28f5c3
+    cmp     rdi, 100
+    jb      3f
+2:
+    mov     rax, rdi
+    shr     rax, 2
+    mul     r8
+    shr     rdx, 2
+    imul    rax, rdx, 100
+    sub     rdi, rax
+    movzx   eax, WORD PTR [r10+rdi*2]
+    sub     rcx, 2
+    mov     WORD PTR [rcx], ax
+    mov     rdi, rdx
+    cmp     rdi, 100
+    jae     2b
+3:
+    cmp     edi, 10
+    jb      4f
+    movzx   eax, WORD PTR [r10+rdi*2]
+    mov     WORD PTR [rcx-2], ax
+    mov     rax, r9
+    ret
+4:
+    add     edi, 48
+    mov     BYTE PTR [rcx-1], dil
+    mov     rax, r9
+    ret
+    .att_syntax
+)");
+
+
+extern "C" {
+    char bench_digit_pairs[200];
+    uint64_t bench_pow10[20];
+}
+
+
+static double run(uint64_t (*format)(uint64_t, char *),
+        const std::vector<uint64_t> &values, std::vector<char> &out,
+        uint64_t &checksum) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t len = 0;
+    for (uint64_t v : values) {
+        len += format(v, out.data() + len);
+        if (len > out.size() - 32) {
+            checksum += static_cast<unsigned char>(out[len / 2]);
+            len = 0;
+        }
+    }
+    checksum += len;
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count()
+        / static_cast<double>(values.size());
+}
+
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 10'000'000;
+
+    for (int i = 0; i < 100; ++i) {
+        bench_digit_pairs[i * 2] = static_cast<char>('0' + i / 10);
+        bench_digit_pairs[i * 2 + 1] = static_cast<char>('0' + i % 10);
+    }
+    bench_pow10[0] = 1;
+    for (int i = 1; i < 20; ++i) {
+        bench_pow10[i] = bench_pow10[i - 1] * 10;
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> uniform(count);
+    for (auto &v : uniform) {
+        v = rng();
+    }
+    // Skewed: digit count uniform in 1..20, so small numbers dominate the
+    // way loop counters and sums do in real programs.
+    std::vector<uint64_t> skewed(count);
+    for (auto &v : skewed) {
+        uint64_t digits = rng() % 20;
+        v = digits == 19 ? rng() : rng() % bench_pow10[digits + 1];
+    }
+
+    // Both formatters must agree before timing them
+    std::vector<uint64_t> check(skewed.begin(),
+            skewed.begin() + static_cast<long>(std::min<size_t>(count, 100000)));
+    for (uint64_t p : bench_pow10) {
+        check.insert(check.end(), {p - 1, p, p + 1});
+    }
+    check.push_back(UINT64_MAX);
+    char a[32], b[32];
+    for (uint64_t v : check) {
+        uint64_t la = dump_per_digit(v, a);
+        uint64_t lb = dump_pairs(v, b);
+        if (la != lb || memcmp(a, b, la) != 0) {
+            std::cerr << "ERROR: Formatters disagree on " << v << '\n';
+            return 1;
+        }
+    }
+
+    std::vector<char> out(1 << 16);
+    uint64_t checksum = 0;
+    std::cout << "values: " << count << '\n';
+    std::cout << "uniform  per_digit: " << run(dump_per_digit, uniform, out, checksum)
+        << " ns/value, pairs: " << run(dump_pairs, uniform, out, checksum) << " ns/value\n";
+    std::cout << "skewed   per_digit: " << run(dump_per_digit, skewed, out, checksum)
+        << " ns/value, pairs: " << run(dump_pairs, skewed, out, checksum) << " ns/value\n";
+    std::cout << "checksum: " << checksum << '\n';
+    return 0;
+}
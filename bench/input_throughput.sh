@@ -0,0 +1,67 @@
+#!/bin/sh
+# Throughput of readint/readbyte on piped input, in MB/s.
+#
+# usage: bench/input_throughput.sh path/to/cl [size_mb] [sim_size_mb]
+#
+# Compiles two stream filters with cl, pipes size_mb of whitespace separated
+# numbers into the executables, and sim_size_mb into `cl s` (the simulator
+# is much slower, keep it small). Use a size of a few thousand MB to
+# measure multi-gigabyte streams; the input is generated once as a 16 MB
+# chunk and repeated through the pipe, so nothing large touches the disk.
+set -e
+
+cl=$(realpath "$1")
+size_mb=${2:-1024}
+sim_size_mb=${3:-64}
+chunk_mb=16
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+awk -v bytes=$((chunk_mb * 1024 * 1024)) 'BEGIN {
+    srand(42)
+    while (n < bytes) {
+        line = ""
+        for (i = 0; i < 16; ++i) {
+            line = line int(rand() * 4294967296) " "
+        }
+        print line
+        n += length(line) + 1
+    }
+}' | head -c $((chunk_mb * 1024 * 1024)) > chunk.txt
+
+echo '0 while readint do + end + .' > readint.cl
+echo '0 while readbyte do + end + .' > readbyte.cl
+
+stream() {
+    i=0
+    while [ $i -lt $(( ($1 + chunk_mb - 1) / chunk_mb )) ]; do
+        cat chunk.txt
+        i=$((i + 1))
+    done
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# run name size_mb command...
+run() {
+    name=$1
+    mb=$2
+    shift 2
+    start=$(now_ns)
+    result=$(stream "$mb" | "$@" | tail -n 1)
+    end=$(now_ns)
+    mb=$(( ($mb + chunk_mb - 1) / chunk_mb * chunk_mb ))
+    awk -v name="$name" -v mb="$mb" -v ns=$((end - start)) -v result="$result" \
+        'BEGIN { printf "%-24s %6d MB %8.1f MB/s  (%s)\n", name, mb, mb / (ns / 1e9), result }'
+}
+
+for program in readint readbyte; do
+    "$cl" c --buffered-output $program.cl > /dev/null
+    mv a.out $program
+    run "compiled $program" "$size_mb" "./$program"
+    run "simulated $program" "$sim_size_mb" "$cl" s $program.cl
+done
@@ -0,0 +1,566 @@
+// Runtime benchmark for generated executables and the simulator.
+//
+// Compiles every program of the corpus (examples/*.cl and the kernels
+// below) with `cl c` and `cl c --backend=c`, then runs both a.out files,
+// `cl s` and `cl s --ssa` several times each and
+// records the median of cycles, instructions, branch misses and cache
+// misses from perf_event_open, plus wall clock time. Counters that cannot be
+// opened (no PMU, perf_event_paranoid) are left out and only the wall clock
+// is kept. Compiled and simulated output must match. The C backend runs
+// give a reference point for the native code generator, the --ssa runs one
+// for the plain simulator.
+//
+// usage: runtime_bench path/to/cl [--runs=N] [--baseline=file.json]
+//                      [--update] [--threshold=percent] [--examples=dir]
+//
+// Results are compared against the baseline file and the run fails when a
+// metric got worse by more than its threshold. A missing baseline (or
+// --update) records the current results instead.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef CL_EXAMPLES_DIR
+#define CL_EXAMPLES_DIR "examples"
+#endif
+
+
+namespace fs = std::filesystem;
+
+using Metrics = std::map<std::string, uint64_t>;
+
+
+struct Counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const Counter counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+// Allowed slowdown in percent, and the baseline value below which a metric
+// is dominated by noise and never fails the comparison. Instruction counts
+// are nearly deterministic, misses and timings are noisy.
+struct Threshold {
+    double percent;
+    uint64_t min_value;
+};
+
+static const std::map<std::string, Threshold> default_thresholds = {
+    {"cycles", {10, 1000000}},
+    {"instructions", {2, 10000}},
+    {"branch_misses", {25, 10000}},
+    {"cache_misses", {50, 10000}},
+    {"wall_ns", {15, 5000000}},
+};
+
+
+// Kernels exercising the code generator beyond the small examples
+static const std::pair<const char *, const char *> kernels[] = {
+    {"count_loop",
+        "0 while dup 300000 < do 1 + end .\n"},
+    {"mem_accumulate",
+        "0 while dup 100000 < do\n"
+        "    dup mem @64 + mem !64\n"
+        "    1 +\n"
+        "end .\n"
+        "mem @64 .\n"},
+    {"branches",
+        "0 while dup 100000 < do dup dup mem + !8 1 + end\n"
+        "0 while dup 100000 < do\n"
+        "    dup mem + @8 128 < if\n"
+        "        mem 200000 + @64 1 + mem 200000 + !64\n"
+        "    else\n"
+        "        mem 200000 + @64 3 + mem 200000 + !64\n"
+        "    end\n"
+        "    1 +\n"
+        "end\n"
+        "mem 200000 + @64 .\n"},
+    {"dump_heavy",
+        "0 while dup 20000 < do dup . 1 + end .\n"},
+    {"mem_kernels",
+        "mem 65536 1 memfill\n"
+        "0 while dup 1000 < do\n"
+        "    mem 8192 memsum .\n"
+        "    mem mem 65536 + 32768 memcopy\n"
+        "    1 +\n"
+        "end .\n"},
+    {"proc_calls",
+        "proc inc 1 + end\n"
+        "proc down dup 0 > if 1 - down end end\n"
+        "0 while dup 50000 < do inc end .\n"
+        "100000 down .\n"},
+    // recursion 900000 calls deep that returns through every call
+    {"deep_recursion",
+        "proc f dup 0 > if 1 - f 1 + end end\n"
+        "900000 f .\n"},
+    // i * 10 / 7 and i % 12 summed over i, with the arithmetic ops and
+    // with the repeated addition/subtraction loops they replace (quadratic,
+    // hence the small range)
+    {"muldiv_ops",
+        "0 while dup 1000 < do\n"
+        "    dup 10 * 7 / mem @64 + mem !64\n"
+        "    dup 12 % mem 8 + @64 + mem 8 + !64\n"
+        "    1 +\n"
+        "end .\n"
+        "mem @64 . mem 8 + @64 .\n"},
+    {"muldiv_loops",
+        "0 while dup 1000 < do\n"
+        "    dup mem 24 + !64\n"
+        "    0 mem 16 + !64 0 mem 40 + !64\n"
+        "    while mem 40 + @64 10 < do\n"
+        "        mem 16 + @64 mem 24 + @64 + mem 16 + !64\n"
+        "        mem 40 + @64 1 + mem 40 + !64\n"
+        "    end\n"
+        "    0 mem 32 + !64\n"
+        "    while mem 16 + @64 7 >= do\n"
+        "        mem 16 + @64 7 - mem 16 + !64\n"
+        "        mem 32 + @64 1 + mem 32 + !64\n"
+        "    end\n"
+        "    mem 32 + @64 mem @64 + mem !64\n"
+        "    mem 24 + @64 mem 48 + !64\n"
+        "    while mem 48 + @64 12 >= do\n"
+        "        mem 48 + @64 12 - mem 48 + !64\n"
+        "    end\n"
+        "    mem 48 + @64 mem 8 + @64 + mem 8 + !64\n"
+        "    1 +\n"
+        "end .\n"
+        "mem @64 . mem 8 + @64 .\n"},
+    {"shuffle_fib",
+        "0 1 0 while dup 200000 < do\n"
+        "    rot rot swap over + rot 1 +\n"
+        "end drop . .\n"},
+    {"shuffle_squares",
+        "0 0 while dup 200000 < do\n"
+        "    dup dup * rot + swap 1 +\n"
+        "end drop .\n"},
+    {"shuffle_gcd",
+        "0 1 while dup 20000 < do\n"
+        "    dup 7919 * 65535 & over 1 +\n"
+        "    while dup do swap over % end drop\n"
+        "    rot + swap 1 +\n"
+        "end drop .\n"},
+    // shuffle_squares and shuffle_gcd as parallel loops
+    {"parallel_squares",
+        "0 200000 parallel dup * reduce + .\n"},
+    {"parallel_gcd",
+        "0 20000 parallel\n"
+        "    dup 7919 * 65535 & swap 1 +\n"
+        "    while dup do swap over % end drop\n"
+        "reduce + .\n"},
+};
+
+
+static long perf_event_open(perf_event_attr *attr, pid_t pid) {
+    return syscall(SYS_perf_event_open, attr, pid, -1, -1, 0);
+}
+
+
+static uint64_t now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+
+// Runs argv in cwd with stdout redirected to out_path, counting the child
+// from its exec. Returns false when it fails to start or exits non zero.
+static bool run_measured(const std::vector<std::string> &args, const fs::path &cwd,
+        const fs::path &out_path, Metrics &metrics) {
+    int sync[2];
+    if (pipe(sync) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        close(sync[1]);
+        char ready;
+        if (read(sync[0], &ready, 1) != 1) {
+            _exit(127);
+        }
+        int out = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int in = open("/dev/null", O_RDONLY);
+        if (out < 0 || in < 0 || chdir(cwd.c_str()) != 0) {
+            _exit(127);
+        }
+        dup2(out, STDOUT_FILENO);
+        dup2(in, STDIN_FILENO);
+        std::vector<char *> argv;
+        for (const auto &arg : args) {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(sync[0]);
+    // counters start disabled and switch on at exec, so the fork and the
+    // wait on the pipe above are not counted
+    std::vector<std::pair<const char *, int>> fds;
+    for (const auto &counter : counters) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter.type;
+        attr.config = counter.config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        long fd = perf_event_open(&attr, pid);
+        if (fd >= 0) {
+            fds.emplace_back(counter.name, static_cast<int>(fd));
+        }
+    }
+
+    uint64_t start = now_ns();
+    bool started = write(sync[1], "x", 1) == 1;
+    close(sync[1]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    metrics["wall_ns"] = now_ns() - start;
+
+    for (const auto &[name, fd] : fds) {
+        uint64_t value;
+        if (read(fd, &value, sizeof(value)) == sizeof(value)) {
+            metrics[name] = value;
+        }
+        close(fd);
+    }
+    return started && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+static std::string read_file(const fs::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+
+// Median of every metric over the runs
+static Metrics median(const std::vector<Metrics> &runs) {
+    Metrics result;
+    for (const auto &[name, value] : runs.front()) {
+        std::vector<uint64_t> values;
+        for (const auto &run : runs) {
+            auto it = run.find(name);
+            if (it != run.end()) {
+                values.push_back(it->second);
+            }
+        }
+        std::sort(values.begin(), values.end());
+        result[name] = values[values.size() / 2];
+        (void) value;
+    }
+    return result;
+}
+
+
+static void write_json(const fs::path &path, int runs,
+        const std::map<std::string, Metrics> &results) {
+    std::ofstream out(path);
+    out << "{\n    \"runs\": " << runs << ",\n    \"results\": {";
+    const char *separator = "\n";
+    for (const auto &[name, metrics] : results) {
+        out << separator << "        \"" << name << "\": {";
+        const char *inner = "";
+        for (const auto &[metric, value] : metrics) {
+            out << inner << "\"" << metric << "\": " << value;
+            inner = ", ";
+        }
+        out << "}";
+        separator = ",\n";
+    }
+    out << "\n    }\n}\n";
+}
+
+
+// Reads the files written by write_json: "results" maps names to objects of
+// integer metrics, everything else is skipped.
+static bool read_json(const fs::path &path, std::map<std::string, Metrics> &results) {
+    std::string text = read_file(path);
+    size_t pos = text.find("\"results\"");
+    if (pos == std::string::npos || (pos = text.find('{', pos)) == std::string::npos) {
+        return false;
+    }
+
+    auto read_string = [&](std::string &s) {
+        size_t begin = text.find('"', pos);
+        if (begin == std::string::npos) {
+            return false;
+        }
+        size_t end = text.find('"', begin + 1);
+        if (end == std::string::npos) {
+            return false;
+        }
+        s = text.substr(begin + 1, end - begin - 1);
+        pos = end + 1;
+        return true;
+    };
+    auto skip_to = [&](char c) {
+        pos = text.find(c, pos);
+        return pos != std::string::npos;
+    };
+
+    ++pos;
+    for (;;) {
+        size_t next_key = text.find('"', pos);
+        size_t close = text.find('}', pos);
+        if (close == std::string::npos) {
+            return false;
+        }
+        if (next_key == std::string::npos || close < next_key) {
+            return true;
+        }
+        std::string name;
+        if (!read_string(name) || !skip_to('{')) {
+            return false;
+        }
+        size_t object_end = text.find('}', pos);
+        if (object_end == std::string::npos) {
+            return false;
+        }
+        Metrics &metrics = results[name];
+        for (;;) {
+            next_key = text.find('"', pos);
+            if (next_key == std::string::npos || next_key > object_end) {
+                break;
+            }
+            std::string metric;
+            if (!read_string(metric) || !skip_to(':')) {
+                return false;
+            }
+            metrics[metric] = std::strtoull(text.c_str() + pos + 1, nullptr, 10);
+        }
+        pos = object_end + 1;
+    }
+}
+
+
+// Simulator output starts with a "Simulating" line that a.out lacks
+static std::string strip_simulating(const std::string &output) {
+    const std::string prefix = "Simulating\n";
+    return output.compare(0, prefix.size(), prefix) == 0 ? output.substr(prefix.size()) : output;
+}
+
+
+static void print_usage() {
+    std::cerr << "usage: runtime_bench path/to/cl [--runs=N] [--baseline=file.json]\n"
+        << "                     [--update] [--threshold=percent] [--examples=dir]\n";
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+    fs::path cl = fs::absolute(argv[1]);
+    int runs = 5;
+    fs::path baseline;
+    fs::path examples = CL_EXAMPLES_DIR;
+    bool update = false;
+    double threshold_override = -1;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.starts_with("--runs=")) {
+            runs = std::max(1, std::atoi(arg.c_str() + 7));
+        }
+        else if (arg.starts_with("--baseline=")) {
+            baseline = fs::absolute(arg.substr(11));
+        }
+        else if (arg.starts_with("--threshold=")) {
+            threshold_override = std::atof(arg.c_str() + 12);
+        }
+        else if (arg.starts_with("--examples=")) {
+            examples = arg.substr(11);
+        }
+        else if (arg == "--update") {
+            update = true;
+        }
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    fs::path work = fs::temp_directory_path() / ("cl_runtime_bench." + std::to_string(getpid()));
+    fs::create_directories(work);
+
+    std::vector<std::pair<std::string, fs::path>> corpus;
+    std::vector<fs::path> example_files;
+    for (const auto &entry : fs::directory_iterator(examples)) {
+        if (entry.path().extension() == ".cl") {
+            example_files.push_back(fs::absolute(entry.path()));
+        }
+    }
+    std::sort(example_files.begin(), example_files.end());
+    for (const auto &path : example_files) {
+        corpus.emplace_back(path.stem().string(), path);
+    }
+    for (const auto &[name, source] : kernels) {
+        fs::path path = work / (std::string(name) + ".cl");
+        std::ofstream(path) << source;
+        corpus.emplace_back(name, path);
+    }
+
+    bool failed = false;
+    bool counters_missing = false;
+    std::map<std::string, Metrics> results;
+    for (const auto &[name, source] : corpus) {
+        fs::path program_dir = work / name;
+        fs::create_directories(program_dir);
+        Metrics ignored;
+        if (!run_measured({cl.string(), "c", source.string()}, program_dir,
+                    program_dir / "compile.txt", ignored)) {
+            std::cerr << name << ": compilation failed\n" << read_file(program_dir / "compile.txt");
+            failed = true;
+            continue;
+        }
+
+        fs::path c_dir = program_dir / "c_backend";
+        fs::create_directories(c_dir);
+        if (!run_measured({cl.string(), "c", "--backend=c", source.string()}, c_dir,
+                    c_dir / "compile.txt", ignored)) {
+            std::cerr << name << ": compilation with --backend=c failed\n"
+                << read_file(c_dir / "compile.txt");
+            failed = true;
+            continue;
+        }
+
+        std::vector<Metrics> compiled_runs, c_backend_runs, simulated_runs, ssa_runs;
+        std::string compiled_output, simulated_output;
+        bool ok = true;
+        for (int i = 0; i < runs && ok; ++i) {
+            Metrics metrics;
+            ok = run_measured({(program_dir / "a.out").string()}, program_dir,
+                    program_dir / "compiled.txt", metrics);
+            compiled_runs.push_back(metrics);
+        }
+        for (int i = 0; i < runs && ok; ++i) {
+            Metrics metrics;
+            ok = run_measured({(c_dir / "a.out").string()}, c_dir,
+                    c_dir / "compiled.txt", metrics);
+            c_backend_runs.push_back(metrics);
+        }
+        for (int i = 0; i < runs && ok; ++i) {
+            Metrics metrics;
+            ok = run_measured({cl.string(), "s", source.string()}, program_dir,
+                    program_dir / "simulated.txt", metrics);
+            simulated_runs.push_back(metrics);
+        }
+        for (int i = 0; i < runs && ok; ++i) {
+            Metrics metrics;
+            ok = run_measured({cl.string(), "s", "--ssa", source.string()}, program_dir,
+                    program_dir / "ssa.txt", metrics);
+            ssa_runs.push_back(metrics);
+        }
+        if (!ok) {
+            std::cerr << name << ": run failed\n";
+            failed = true;
+            continue;
+        }
+
+        compiled_output = read_file(program_dir / "compiled.txt");
+        simulated_output = strip_simulating(read_file(program_dir / "simulated.txt"));
+        if (compiled_output != simulated_output) {
+            std::cerr << name << ": compiled and simulated output differ\n";
+            failed = true;
+        }
+        if (read_file(c_dir / "compiled.txt") != simulated_output) {
+            std::cerr << name << ": C backend and simulated output differ\n";
+            failed = true;
+        }
+        if (strip_simulating(read_file(program_dir / "ssa.txt")) != simulated_output) {
+            std::cerr << name << ": --ssa and simulated output differ\n";
+            failed = true;
+        }
+
+        results[name + "/compiled"] = median(compiled_runs);
+        results[name + "/c_backend"] = median(c_backend_runs);
+        results[name + "/simulated"] = median(simulated_runs);
+        results[name + "/ssa"] = median(ssa_runs);
+        counters_missing |= results[name + "/compiled"].count("instructions") == 0;
+    }
+    fs::remove_all(work);
+
+    if (counters_missing) {
+        std::cerr << "warning: hardware counters unavailable, only wall clock is measured\n";
+    }
+    for (const auto &[name, metrics] : results) {
+        std::cout << name;
+        for (const auto &[metric, value] : metrics) {
+            std::cout << "  " << metric << "=" << value;
+        }
+        std::cout << '\n';
+    }
+
+    if (baseline.empty() || failed) {
+        return failed ? 1 : 0;
+    }
+    std::map<std::string, Metrics> previous;
+    if (update || !fs::exists(baseline)) {
+        write_json(baseline, runs, results);
+        std::cout << "baseline written to " << baseline.string() << '\n';
+        return failed ? 1 : 0;
+    }
+    if (!read_json(baseline, previous)) {
+        std::cerr << "ERROR: Cannot parse baseline " << baseline.string() << '\n';
+        return 1;
+    }
+
+    int regressions = 0;
+    for (const auto &[name, metrics] : results) {
+        auto old = previous.find(name);
+        if (old == previous.end()) {
+            continue;
+        }
+        for (const auto &[metric, value] : metrics) {
+            auto old_value = old->second.find(metric);
+            auto threshold = default_thresholds.find(metric);
+            if (old_value == old->second.end() || threshold == default_thresholds.end() ||
+                    old_value->second < threshold->second.min_value) {
+                continue;
+            }
+            double allowed = threshold_override >= 0 ? threshold_override : threshold->second.percent;
+            double change = (static_cast<double>(value) / static_cast<double>(old_value->second) - 1) * 100;
+            if (change > allowed) {
+                std::cerr << "REGRESSION: " << name << " " << metric << " " << old_value->second
+                    << " -> " << value << " (+" << change << "%, allowed " << allowed << "%)\n";
+                ++regressions;
+            }
+        }
+    }
+    std::cout << regressions << " regression(s) against " << baseline.string() << '\n';
+    return failed || regressions > 0 ? 1 : 0;
+}
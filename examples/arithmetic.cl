@@ -1,2 +1,10 @@
 3 4 + .
 4 2 - .
+6 7 * .
+100 7 / .
+100 7 % .
+12 10 & .
+12 10 | .
+12 10 ^ .
+1 10 << .
+1024 3 >> .
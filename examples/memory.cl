@@ -0,0 +1,14 @@
+# five words at the start of mem
+7 mem !64
+9 mem 8 + !64
+11 mem 16 + !64
+13 mem 24 + !64
+15 mem 32 + !64
+mem 8 + @64 .
+mem 5 memsum .
+
+# bytes
+mem 100 + 64 42 memfill
+mem 100 + mem 200 + 64 memcopy
+mem 263 + @8 .
+mem 100 + mem 200 + 64 memeq .
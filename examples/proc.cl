@@ -0,0 +1,7 @@
+proc inc 1 + end
+proc countdown
+    dup . dup 0 > if 1 - countdown end
+end
+
+5 inc inc .
+3 countdown .
@@ -0,0 +1,7 @@
+# labels come from string literals, `.` ends each line with a number
+"Report\n------\n" puts
+1 while dup 5 <= do
+    "item " puts dup .
+    1 +
+end
+"items: " puts 1 - .
@@ -0,0 +1,994 @@
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+
+#include "cbackend.h"
+#include "main.h"
+#include "ops.h"
+
+
+// Depth of ops that no path reaches yet, while the shape of a called
+// procedure is still unknown
+static const int64_t UNREACHED = INT64_MIN;
+
+
+// Walks the body of the procedure at proc_ip (program.size() for the top
+// level, skipping procedure definitions) and records the depth before
+// every op relative to the entry in depths. Calls use the shapes found so
+// far: with unknown_calls_end_path a call to a procedure without one ends
+// the path, so a recursive procedure gets its shape from the paths that
+// return, otherwise such a call fails. Fails when a depth depends on the
+// branch taken. Ops reading below the entry are errors at the top level.
+bool compute_function_shape(const std::string &program_file_name,
+        const std::vector<Operation> &program, uint64_t proc_ip,
+        const std::map<uint64_t, StackShape> &shapes, bool unknown_calls_end_path,
+        StackShape &shape, std::vector<int64_t> &depths) {
+    bool top_level = proc_ip == program.size();
+    uint64_t begin = top_level ? 0 : proc_ip + 1;
+    uint64_t end = top_level ? program.size() : program[proc_ip].jump_loc() - 1;
+    depths.assign(program.size(), UNREACHED);
+    shape = StackShape();
+
+    // opening op, depth entering the block and for if/else the depth at
+    // the end of the then branch, for while the depth leaving the loop
+    struct OpenBlock {
+        uint64_t ip;
+        int64_t entry;
+        int64_t other;
+    };
+    std::vector<OpenBlock> open;
+    int64_t depth = 0;
+    // entry depth of the parallel loop being walked, its body has only
+    // the index and what it pushes
+    int64_t parallel_entry = UNREACHED;
+
+    auto need = [&](const Operation &op, int64_t count, const std::string &what) {
+        if (depth != UNREACHED && parallel_entry != UNREACHED &&
+                depth - count < parallel_entry) {
+            print_error(program_file_name, op.line(), op.col(),
+                    "Not enough elements in stack for " + what);
+            exit(EXIT_FAILURE);
+        }
+        if (depth == UNREACHED || depth - count >= -shape.consumed) {
+            return;
+        }
+        if (top_level) {
+            print_error(program_file_name, op.line(), op.col(),
+                    "Not enough elements in stack for " + what);
+            exit(EXIT_FAILURE);
+        }
+        shape.consumed = count - depth;
+    };
+    // depth where two paths meet, false when both are reached and differ
+    auto join = [](int64_t a, int64_t b, int64_t &joined) {
+        if (a != UNREACHED && b != UNREACHED && a != b) {
+            return false;
+        }
+        joined = a == UNREACHED ? b : a;
+        return true;
+    };
+
+    for (uint64_t ip = begin; ip < end; ++ip) {
+        const Operation &op = program[ip];
+        if (op.op_type() == Operations::OP_PROC) {
+            ip = op.jump_loc() - 1;
+            continue;
+        }
+        depths[ip] = depth;
+        switch (op.op_type()) {
+            case Operations::OP_IF:
+                need(op, 1, "OP_IF operation");
+                if (depth != UNREACHED) {
+                    --depth;
+                }
+                open.push_back({ip, depth, UNREACHED});
+                break;
+
+            case Operations::OP_ELSE:
+                open.back().ip = ip;
+                open.back().other = depth;
+                depth = open.back().entry;
+                break;
+
+            case Operations::OP_WHILE:
+                open.push_back({ip, depth, UNREACHED});
+                break;
+
+            case Operations::OP_DO:
+                need(op, 1, "OP_DO operation");
+                if (depth != UNREACHED) {
+                    --depth;
+                }
+                open.back().other = depth;
+                break;
+
+            case Operations::OP_END:
+                {
+                    OpenBlock block = open.back();
+                    open.pop_back();
+                    bool ok = true;
+                    switch (program[block.ip].op_type()) {
+                        case Operations::OP_IF:
+                            ok = join(depth, block.entry, depth);
+                            break;
+                        case Operations::OP_ELSE:
+                            ok = join(depth, block.other, depth);
+                            break;
+                        default:
+                            // the body must come back to the loop head
+                            // as deep as it entered it
+                            ok = join(depth, block.entry, depth);
+                            depth = block.other;
+                    }
+                    if (!ok) {
+                        return false;
+                    }
+                }
+                break;
+
+            case Operations::OP_PARALLEL:
+                need(op, 2, "OP_PARALLEL operation");
+                if (depth != UNREACHED) {
+                    depth -= 2;
+                }
+                open.push_back({ip, depth, UNREACHED});
+                parallel_entry = depth;
+                if (depth != UNREACHED) {
+                    ++depth;
+                }
+                break;
+
+            case Operations::OP_REDUCE:
+                {
+                    OpenBlock block = open.back();
+                    open.pop_back();
+                    parallel_entry = UNREACHED;
+                    if (depth == UNREACHED || block.entry == UNREACHED) {
+                        depth = UNREACHED;
+                    }
+                    else if (depth != block.entry + 1) {
+                        print_error(program_file_name, op.line(), op.col(),
+                                "The parallel body must leave exactly one value");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+
+            case Operations::OP_CALL:
+                {
+                    auto callee = shapes.find(op.jump_loc());
+                    if (callee == shapes.end()) {
+                        if (!unknown_calls_end_path) {
+                            return false;
+                        }
+                        depth = UNREACHED;
+                        break;
+                    }
+                    need(op, callee->second.consumed, "call to " + op.name());
+                    if (depth != UNREACHED) {
+                        depth += callee->second.net;
+                    }
+                }
+                break;
+
+            default:
+                {
+                    StackEffect effect = stack_effect(op.op_type());
+                    need(op, effect.pops, std::string(op_info(op.op_type()).name) + " operation");
+                    if (depth != UNREACHED) {
+                        depth += effect.pushes - effect.pops;
+                    }
+                }
+        }
+        shape.max = std::max(shape.max, depth);
+    }
+    if (depth == UNREACHED) {
+        return false;
+    }
+    shape.net = depth;
+    return true;
+}
+
+
+static bool same_shape(const StackShape &a, const StackShape &b) {
+    return a.consumed == b.consumed && a.net == b.net && a.max == b.max;
+}
+
+
+// Shapes of every procedure whose depths are static, keyed by the ip of
+// its OP_PROC. Recursive procedures are first given the shape of their
+// returning paths and repeated until the shapes settle. A shape is kept
+// only if the body reproduces it with every call resolved, so every
+// procedure left out (and every caller of one) uses the memory stack.
+std::map<uint64_t, StackShape> compute_procedure_shapes(
+        const std::string &program_file_name, const std::vector<Operation> &program) {
+    std::vector<uint64_t> procs;
+    for (uint64_t ip = 0; ip < program.size(); ++ip) {
+        if (program[ip].op_type() == Operations::OP_PROC) {
+            procs.push_back(ip);
+        }
+    }
+
+    std::map<uint64_t, StackShape> shapes;
+    std::vector<int64_t> depths;
+    for (size_t round = 0; round < 2 * procs.size() + 2; ++round) {
+        bool changed = false;
+        for (uint64_t proc : procs) {
+            StackShape shape;
+            if (!compute_function_shape(program_file_name, program, proc, shapes, true,
+                        shape, depths)) {
+                continue;
+            }
+            auto known = shapes.find(proc);
+            if (known == shapes.end() || !same_shape(known->second, shape)) {
+                shapes[proc] = shape;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+    }
+
+    for (bool removed = true; removed;) {
+        removed = false;
+        for (uint64_t proc : procs) {
+            auto known = shapes.find(proc);
+            if (known == shapes.end()) {
+                continue;
+            }
+            StackShape shape;
+            if (!compute_function_shape(program_file_name, program, proc, shapes, false,
+                        shape, depths) || !same_shape(known->second, shape)) {
+                shapes.erase(known);
+                removed = true;
+            }
+        }
+    }
+    return shapes;
+}
+
+
+// Runtime of the generated programs. Output is formatted into
+// output_buffer and written per dump, or in OUTPUT_BUFFER_SIZE blocks with
+// --buffered-output, stdin is read in INPUT_BUFFER_SIZE blocks. Errors
+// print the same messages as the native runtime and exit with 1. Calls
+// other than tail calls count against the stack size like the simulator's
+// return stack, and program() runs on a stack with room for CALL_FRAME_SIZE
+// bytes per call.
+static const char *c_runtime = R"(#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+typedef uint64_t cell;
+
+struct input {
+    cell value;
+    cell ok;
+};
+
+static cell *stack_base;
+static cell *stack_top;
+static cell call_depth;
+static cell call_limit;
+static ucontext_t main_context;
+static ucontext_t program_context;
+static unsigned char mem[MEM_SIZE] __attribute__((aligned(32)));
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static size_t output_len;
+static unsigned char input_buffer[INPUT_BUFFER_SIZE];
+static size_t input_pos;
+static size_t input_len;
+
+static void write_all(const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(1, data, len);
+        if (written <= 0) {
+            return;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+}
+
+static void flush_output(void)
+{
+    write_all(output_buffer, output_len);
+    output_len = 0;
+}
+
+__attribute__((noreturn, cold)) static void runtime_error(const char *msg)
+{
+    flush_output();
+    ssize_t written = write(2, msg, strlen(msg));
+    (void)written;
+    _exit(1);
+}
+
+__attribute__((noreturn, cold)) static void stack_overflow(void)
+{
+    runtime_error("ERROR: Data stack overflow\n");
+}
+
+__attribute__((noreturn, cold)) static void stack_underflow(void)
+{
+    runtime_error("ERROR: Data stack underflow\n");
+}
+
+__attribute__((noreturn, cold)) static void division_by_zero(void)
+{
+    runtime_error("ERROR: Division by zero\n");
+}
+
+__attribute__((noreturn, cold)) static void return_stack_overflow(void)
+{
+    runtime_error("ERROR: Return stack overflow\n");
+}
+
+#define NEED(n) if (__builtin_expect(sp - stack_base < (n), 0)) stack_underflow()
+#define ROOM(n) if (__builtin_expect(stack_top - sp < (n), 0)) stack_overflow()
+#define ENTER() if (__builtin_expect(++call_depth > call_limit, 0)) return_stack_overflow()
+#define LEAVE() --call_depth
+
+static void init_data_stack(void)
+{
+    cell size = STACK_SIZE;
+    const char *env = getenv(ENV_STACK_SIZE);
+    if (env != NULL) {
+        cell value = 0;
+        for (; *env >= '0' && *env <= '9'; ++env) {
+            value = value * 10 + (cell)(*env - '0');
+        }
+        if (value != 0) {
+            size = (value + STACK_SIZE_GRANULE - 1) / STACK_SIZE_GRANULE * STACK_SIZE_GRANULE;
+        }
+    }
+    stack_base = malloc(size * sizeof(cell));
+    if (stack_base == NULL) {
+        runtime_error("ERROR: Could not map data stack\n");
+    }
+    stack_top = stack_base + size;
+    call_limit = size;
+}
+
+// Runs entry on a stack deep enough for call_limit calls, only the pages
+// touched are backed by memory
+static void run_on_call_stack(void (*entry)(void))
+{
+    size_t size = (size_t)(call_limit + 1) * CALL_FRAME_SIZE + (1u << 20);
+    void *stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED || getcontext(&program_context) != 0) {
+        runtime_error("ERROR: Could not map call stack\n");
+    }
+    program_context.uc_stack.ss_sp = stack;
+    program_context.uc_stack.ss_size = size;
+    program_context.uc_link = &main_context;
+    makecontext(&program_context, entry, 0);
+    swapcontext(&main_context, &program_context);
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void dump(cell value)
+{
+    char digits[20];
+    char *p = digits + sizeof(digits);
+    while (value >= 100) {
+        cell rest = value / 100;
+        p -= 2;
+        memcpy(p, digit_pairs + (value - rest * 100) * 2, 2);
+        value = rest;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + value * 2, 2);
+    }
+    else {
+        *--p = (char)('0' + value);
+    }
+    size_t len = (size_t)(digits + sizeof(digits) - p);
+    memcpy(output_buffer + output_len, p, len);
+    output_len += len;
+    output_buffer[output_len++] = '\n';
+    if (!BUFFERED_OUTPUT || output_len >= OUTPUT_BUFFER_SIZE - 21) {
+        flush_output();
+    }
+}
+
+static void write_string(cell addr, cell len)
+{
+    const char *text = (const char *)(uintptr_t)addr;
+    if (BUFFERED_OUTPUT) {
+        if (output_len + len >= OUTPUT_BUFFER_SIZE - 21) {
+            flush_output();
+        }
+        if (len < OUTPUT_BUFFER_SIZE - 21) {
+            memcpy(output_buffer + output_len, text, len);
+            output_len += len;
+            return;
+        }
+    }
+    write_all(text, len);
+}
+
+static int refill_input(void)
+{
+    ssize_t len;
+    do {
+        len = read(0, input_buffer, INPUT_BUFFER_SIZE);
+    } while (len < 0 && errno == EINTR);
+    input_pos = 0;
+    input_len = len > 0 ? (size_t)len : 0;
+    return input_len > 0;
+}
+
+static struct input read_int(void)
+{
+    struct input result = {0, 0};
+    for (;;) {
+        if (input_pos == input_len && !refill_input()) {
+            return result;
+        }
+        if ((unsigned)(input_buffer[input_pos] - '0') <= 9) {
+            break;
+        }
+        ++input_pos;
+    }
+    result.ok = 1;
+    while (input_pos < input_len || refill_input()) {
+        unsigned digit = (unsigned)(input_buffer[input_pos] - '0');
+        if (digit > 9) {
+            break;
+        }
+        result.value = result.value * 10 + digit;
+        ++input_pos;
+    }
+    return result;
+}
+
+static struct input read_byte(void)
+{
+    struct input result = {0, 0};
+    if (input_pos == input_len && !refill_input()) {
+        return result;
+    }
+    result.value = input_buffer[input_pos++];
+    result.ok = 1;
+    return result;
+}
+
+static inline cell load8(cell addr)
+{
+    return *(const unsigned char *)(uintptr_t)addr;
+}
+
+static inline cell load64(cell addr)
+{
+    cell value;
+    memcpy(&value, (const void *)(uintptr_t)addr, sizeof(value));
+    return value;
+}
+
+static inline void store8(cell addr, cell value)
+{
+    *(unsigned char *)(uintptr_t)addr = (unsigned char)value;
+}
+
+static inline void store64(cell addr, cell value)
+{
+    memcpy((void *)(uintptr_t)addr, &value, sizeof(value));
+}
+
+static void mem_fill(cell addr, cell count, cell value)
+{
+    memset((void *)(uintptr_t)addr, (unsigned char)value, count);
+}
+
+static void mem_copy(cell src, cell dst, cell count)
+{
+    memmove((void *)(uintptr_t)dst, (const void *)(uintptr_t)src, count);
+}
+
+static cell mem_sum(cell addr, cell words)
+{
+    const unsigned char *src = (const unsigned char *)(uintptr_t)addr;
+    cell sum = 0;
+    for (cell i = 0; i < words; ++i) {
+        cell word;
+        memcpy(&word, src + i * 8, sizeof(word));
+        sum += word;
+    }
+    return sum;
+}
+
+static cell mem_eq(cell a, cell b, cell count)
+{
+    return memcmp((const void *)(uintptr_t)a, (const void *)(uintptr_t)b, count) == 0;
+}
+)";
+
+
+// C expression for `b a op` of the binary ops and comparisons, filled in
+// from the c_expr template of the op
+static std::string binary_expr_c(Operations op, const std::string &b, const std::string &a) {
+    std::string expr;
+    for (const char *c = op_info(op).c_expr; *c != '\0'; ++c) {
+        if (c[0] == '{' && (c[1] == 'a' || c[1] == 'b') && c[2] == '}') {
+            expr += c[1] == 'a' ? a : b;
+            c += 2;
+        }
+        else {
+            expr.push_back(*c);
+        }
+    }
+    return expr;
+}
+
+
+// Emits a statement for every op that neither branches nor calls. top(1)
+// names the value on top of the stack before the op, top(2) the one below
+// it, top(0) and top(-1) the free slots above it.
+static void generate_op_c(std::ofstream &out_file, const std::string &indent,
+        const Operation &op, const std::function<std::string(int64_t)> &top,
+        const std::map<std::string, uint64_t> &strings) {
+    const OpInfo &info = op_info(op.op_type());
+    if (info.c_expr != nullptr) {
+        if (info.divides) {
+            out_file << indent << "if (" << top(1) << " == 0) division_by_zero();\n";
+        }
+        out_file << indent << top(2) << " = "
+            << binary_expr_c(op.op_type(), top(2), top(1)) << ";\n";
+        return;
+    }
+    switch (op.op_type()) {
+        case Operations::OP_PUSH:
+            out_file << indent << top(0) << " = " << op.operand() << "u;\n";
+            break;
+
+        case Operations::OP_DUMP:
+            out_file << indent << "dump(" << top(1) << ");\n";
+            break;
+
+        case Operations::OP_DUP:
+            out_file << indent << top(0) << " = " << top(1) << ";\n";
+            break;
+
+        case Operations::OP_SWAP:
+            out_file << indent << "{ cell t = " << top(2) << "; " << top(2) << " = "
+                << top(1) << "; " << top(1) << " = t; }\n";
+            break;
+
+        case Operations::OP_OVER:
+            out_file << indent << top(0) << " = " << top(2) << ";\n";
+            break;
+
+        case Operations::OP_ROT:
+            out_file << indent << "{ cell t = " << top(3) << "; " << top(3) << " = "
+                << top(2) << "; " << top(2) << " = " << top(1) << "; "
+                << top(1) << " = t; }\n";
+            break;
+
+        case Operations::OP_DROP:
+            break;
+
+        case Operations::OP_MEM:
+            out_file << indent << top(0) << " = (cell)(uintptr_t)mem;\n";
+            break;
+
+        case Operations::OP_LOAD8:
+            out_file << indent << top(1) << " = load8(" << top(1) << ");\n";
+            break;
+
+        case Operations::OP_LOAD64:
+            out_file << indent << top(1) << " = load64(" << top(1) << ");\n";
+            break;
+
+        case Operations::OP_STORE8:
+            out_file << indent << "store8(" << top(1) << ", " << top(2) << ");\n";
+            break;
+
+        case Operations::OP_STORE64:
+            out_file << indent << "store64(" << top(1) << ", " << top(2) << ");\n";
+            break;
+
+        case Operations::OP_MEM_FILL:
+            out_file << indent << "mem_fill(" << top(3) << ", " << top(2) << ", "
+                << top(1) << ");\n";
+            break;
+
+        case Operations::OP_MEM_COPY:
+            out_file << indent << "mem_copy(" << top(3) << ", " << top(2) << ", "
+                << top(1) << ");\n";
+            break;
+
+        case Operations::OP_MEM_SUM:
+            out_file << indent << top(2) << " = mem_sum(" << top(2) << ", "
+                << top(1) << ");\n";
+            break;
+
+        case Operations::OP_MEM_EQ:
+            out_file << indent << top(3) << " = mem_eq(" << top(3) << ", " << top(2)
+                << ", " << top(1) << ");\n";
+            break;
+
+        case Operations::OP_READ_INT:
+        case Operations::OP_READ_BYTE:
+            out_file << indent << "{ struct input r = "
+                << (op.op_type() == Operations::OP_READ_INT ? "read_int" : "read_byte")
+                << "(); " << top(0) << " = r.value; " << top(-1) << " = r.ok; }\n";
+            break;
+
+        case Operations::OP_PUSH_STR:
+            out_file << indent << top(0) << " = (cell)(uintptr_t)(string_table + "
+                << strings.at(op.name()) << "); " << top(-1) << " = "
+                << op.name().size() << "u;\n";
+            break;
+
+        case Operations::OP_PUTS:
+            out_file << indent << "write_string(" << top(2) << ", " << top(1) << ");\n";
+            break;
+
+        default:
+            std::cerr << "Compilation failed!\n";
+            std::cerr << "ERROR: Operation unknown\n";
+            exit(EXIT_FAILURE);
+    }
+}
+
+
+static std::string function_name_c(const std::vector<Operation> &program, uint64_t proc_ip) {
+    return proc_ip == program.size() ? "program" : "proc_" + program[proc_ip].name();
+}
+
+
+// Emits the procedure at proc_ip (program.size() for the top level) as a C
+// function taking the data stack pointer and returning it after the call.
+// With a shape every stack slot is a local variable s<N>, counted from the
+// deepest value the function reads: the values it consumes are loaded on
+// entry, the values it leaves are stored on return, and a call stores only
+// the values the callee consumes. Without one every op works on memory.
+static void generate_function_c(std::ofstream &out_file, const std::string &program_file_name,
+        const std::vector<Operation> &program, uint64_t proc_ip,
+        const std::map<uint64_t, StackShape> &shapes,
+        const std::map<std::string, uint64_t> &strings) {
+    bool top_level = proc_ip == program.size();
+    uint64_t begin = top_level ? 0 : proc_ip + 1;
+    uint64_t end = top_level ? program.size() : program[proc_ip].jump_loc() - 1;
+
+    StackShape shape;
+    std::vector<int64_t> depths;
+    bool is_static = compute_function_shape(program_file_name, program, proc_ip, shapes,
+            false, shape, depths);
+    auto slot = [&](int64_t depth) {
+        return "s" + std::to_string(depth + shape.consumed);
+    };
+    auto store_slots = [&](const std::string &indent, int64_t from, int64_t to) {
+        for (int64_t depth = from; depth < to; ++depth) {
+            out_file << indent << "sp[" << depth + shape.consumed << "] = "
+                << slot(depth) << ";\n";
+        }
+    };
+
+    out_file << "\nstatic cell *" << function_name_c(program, proc_ip) << "(cell *sp)\n{\n";
+    if (is_static) {
+        int64_t slots = shape.consumed + shape.max;
+        if (slots > 0) {
+            out_file << "    cell";
+            for (int64_t i = 0; i < slots; ++i) {
+                out_file << (i == 0 ? " s" : ", s") << i;
+            }
+            out_file << ";\n";
+        }
+        if (shape.consumed > 0) {
+            out_file << "    NEED(" << shape.consumed << ");\n";
+            out_file << "    sp -= " << shape.consumed << ";\n";
+        }
+        // the slots live in locals, but the stack limit is checked like in
+        // the native runtime
+        if (slots > 0) {
+            out_file << "    ROOM(" << slots << ");\n";
+        }
+        if (shape.consumed > 0) {
+            for (int64_t depth = -shape.consumed; depth < 0; ++depth) {
+                out_file << "    " << slot(depth) << " = sp[" << depth + shape.consumed
+                    << "];\n";
+            }
+        }
+    }
+
+    std::string indent = "    ";
+    for (uint64_t ip = begin; ip < end; ++ip) {
+        const Operation &op = program[ip];
+        if (op.op_type() == Operations::OP_PROC) {
+            ip = op.jump_loc() - 1;
+            continue;
+        }
+        int64_t depth = depths[ip];
+        // absolute index of the slot above the top
+        int64_t above = depth + shape.consumed;
+        switch (op.op_type()) {
+            case Operations::OP_IF:
+                if (is_static) {
+                    out_file << indent << "if (" << slot(depth - 1) << ") {\n";
+                }
+                else {
+                    out_file << indent << "NEED(1);\n";
+                    out_file << indent << "if (*--sp) {\n";
+                }
+                indent += "    ";
+                break;
+
+            case Operations::OP_ELSE:
+                indent.resize(indent.size() - 4);
+                out_file << indent << "}\n" << indent << "else {\n";
+                indent += "    ";
+                break;
+
+            case Operations::OP_WHILE:
+                out_file << indent << "for (;;) {\n";
+                indent += "    ";
+                break;
+
+            case Operations::OP_DO:
+                if (is_static) {
+                    out_file << indent << "if (!" << slot(depth - 1) << ") break;\n";
+                }
+                else {
+                    out_file << indent << "NEED(1);\n";
+                    out_file << indent << "if (!*--sp) break;\n";
+                }
+                break;
+
+            case Operations::OP_END:
+                indent.resize(indent.size() - 4);
+                out_file << indent << "}\n";
+                break;
+
+            // Runs the iterations one after another, the body can't tell
+            // as it only computes a value from its index
+            case Operations::OP_PARALLEL:
+                {
+                    const Operation &reduce = program[op.jump_loc() - 1];
+                    std::string name = "p" + std::to_string(ip) + "_";
+                    out_file << indent << "{\n";
+                    indent += "    ";
+                    out_file << indent << "cell " << name << "acc = "
+                        << op_info(static_cast<Operations>(reduce.operand())).identity << "u;\n";
+                    if (is_static) {
+                        out_file << indent << "cell " << name << "end = " << slot(depth - 1)
+                            << ";\n";
+                        out_file << indent << "for (cell " << name << "i = " << slot(depth - 2)
+                            << "; " << name << "i < " << name << "end; ++" << name << "i) {\n";
+                        out_file << indent << "    " << slot(depth - 2) << " = " << name
+                            << "i;\n";
+                    }
+                    else {
+                        out_file << indent << "NEED(2);\n";
+                        out_file << indent << "cell " << name << "end = sp[-1];\n";
+                        out_file << indent << "cell " << name << "i = sp[-2];\n";
+                        out_file << indent << "sp -= 2;\n";
+                        out_file << indent << "for (; " << name << "i < " << name << "end; ++"
+                            << name << "i) {\n";
+                        out_file << indent << "    cell *" << name << "sp = sp;\n";
+                        out_file << indent << "    ROOM(1);\n";
+                        out_file << indent << "    *sp++ = " << name << "i;\n";
+                    }
+                    indent += "    ";
+                }
+                break;
+
+            case Operations::OP_REDUCE:
+                {
+                    std::string name = "p" + std::to_string(op.jump_loc()) + "_";
+                    Operations combine = static_cast<Operations>(op.operand());
+                    if (is_static) {
+                        out_file << indent << name << "acc = "
+                            << binary_expr_c(combine, name + "acc", slot(depth - 1)) << ";\n";
+                    }
+                    else {
+                        out_file << indent << "if (sp != " << name << "sp + 1) "
+                            << "runtime_error(\"ERROR: The parallel body must leave exactly "
+                            << "one value\\n\");\n";
+                        out_file << indent << name << "acc = "
+                            << binary_expr_c(combine, name + "acc", "*--sp") << ";\n";
+                    }
+                    indent.resize(indent.size() - 4);
+                    out_file << indent << "}\n";
+                    if (is_static) {
+                        out_file << indent << slot(depth - 1) << " = " << name << "acc;\n";
+                    }
+                    else {
+                        out_file << indent << "ROOM(1);\n";
+                        out_file << indent << "*sp++ = " << name << "acc;\n";
+                    }
+                    indent.resize(indent.size() - 4);
+                    out_file << indent << "}\n";
+                }
+                break;
+
+            case Operations::OP_CALL:
+                {
+                    std::string callee = "proc_" + op.name();
+                    bool tail = !top_level && is_tail_call(program, ip);
+                    if (!is_static) {
+                        if (tail) {
+                            out_file << indent << "return " << callee << "(sp);\n";
+                            break;
+                        }
+                        out_file << indent << "ENTER();\n";
+                        out_file << indent << "sp = " << callee << "(sp);\n";
+                        out_file << indent << "LEAVE();\n";
+                        break;
+                    }
+                    const StackShape &called = shapes.at(op.jump_loc());
+                    if (above > 0) {
+                        out_file << indent << "ROOM(" << above << ");\n";
+                    }
+                    if (tail) {
+                        store_slots(indent, -shape.consumed, depth);
+                        out_file << indent << "return " << callee << "(sp + " << above
+                            << ");\n";
+                        break;
+                    }
+                    store_slots(indent, depth - called.consumed, depth);
+                    out_file << indent << "ENTER();\n";
+                    out_file << indent << callee << "(sp + " << above << ");\n";
+                    out_file << indent << "LEAVE();\n";
+                    for (int64_t i = depth - called.consumed; i < depth + called.net; ++i) {
+                        out_file << indent << slot(i) << " = sp[" << i + shape.consumed
+                            << "];\n";
+                    }
+                }
+                break;
+
+            default:
+                if (is_static) {
+                    generate_op_c(out_file, indent, op, [&](int64_t n) {
+                        return slot(depth - n);
+                    }, strings);
+                    break;
+                }
+                {
+                    StackEffect effect = stack_effect(op.op_type());
+                    int effect_net = effect.pushes - effect.pops;
+                    if (effect.pops > 0) {
+                        out_file << indent << "NEED(" << effect.pops << ");\n";
+                    }
+                    if (effect_net > 0) {
+                        out_file << indent << "ROOM(" << effect_net << ");\n";
+                    }
+                    generate_op_c(out_file, indent, op, [](int64_t n) {
+                        return "sp[" + std::to_string(-n) + "]";
+                    }, strings);
+                    if (effect_net != 0) {
+                        out_file << indent << "sp += " << effect_net << ";\n";
+                    }
+                }
+        }
+    }
+
+    if (is_static && !top_level) {
+        int64_t left = shape.consumed + shape.net;
+        if (left > 0) {
+            out_file << "    ROOM(" << left << ");\n";
+        }
+        store_slots("    ", -shape.consumed, shape.net);
+        out_file << "    return sp + " << left << ";\n";
+    }
+    else {
+        out_file << "    return sp;\n";
+    }
+    out_file << "}\n";
+}
+
+
+// Writes table as a C string literal, escaping everything but printable
+// ASCII. Octal escapes always take three digits so a following digit is
+// never read as part of them.
+static void add_string_table_c(std::ofstream &out_file, const std::string &table) {
+    out_file << "static const char string_table[] =\n    \"";
+    for (size_t i = 0; i < table.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(table[i]);
+        if (i > 0 && i % 64 == 0) {
+            out_file << "\"\n    \"";
+        }
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') {
+            out_file << c;
+        }
+        else {
+            out_file << '\\' << static_cast<char>('0' + (c >> 6))
+                << static_cast<char>('0' + ((c >> 3) & 7))
+                << static_cast<char>('0' + (c & 7));
+        }
+    }
+    out_file << "\";\n";
+}
+
+
+// Creates %output_filename%.c and builds it into ./a.out with the system C
+// compiler. program_file_name is used for compile errors.
+void compile_program_c(std::string output_filename, const std::string &program_file_name,
+        std::list<Operation> &operations_list, const Options &options) {
+    if (options.profile_generate) {
+        std::cerr << "ERROR: " << STR_OPT_PROFILE_GENERATE << " is not supported by "
+            << STR_OPT_BACKEND << STR_BACKEND_C << '\n';
+        exit(EXIT_FAILURE);
+    }
+    if (is_metered(options)) {
+        std::cerr << "ERROR: " << STR_OPT_BUDGET << " and " << STR_OPT_DEADLINE
+            << " are not supported by " << STR_OPT_BACKEND << STR_BACKEND_C << '\n';
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "Compiling\n";
+
+    std::vector<Operation> program(operations_list.begin(), operations_list.end());
+    std::string string_table;
+    std::map<std::string, uint64_t> strings = intern_strings(program, string_table);
+    std::map<uint64_t, StackShape> shapes = compute_procedure_shapes(program_file_name, program);
+
+    // a frame may spill every local slot of its function
+    int64_t slots = 0;
+    for (const auto &[proc, shape] : shapes) {
+        slots = std::max(slots, shape.consumed + shape.max);
+    }
+
+    std::ofstream out_file;
+    out_file.open(output_filename + ".c");
+    out_file << "#define MEM_SIZE " << options.mem_size << "u\n";
+    out_file << "#define STACK_SIZE " << options.stack_size << "u\n";
+    out_file << "#define ENV_STACK_SIZE \"" << STR_ENV_STACK_SIZE << "\"\n";
+    out_file << "#define STACK_SIZE_GRANULE " << STACK_SIZE_GRANULE << "u\n";
+    out_file << "#define OUTPUT_BUFFER_SIZE " << OUTPUT_BUFFER_SIZE << "\n";
+    out_file << "#define INPUT_BUFFER_SIZE " << INPUT_BUFFER_SIZE << "\n";
+    out_file << "#define BUFFERED_OUTPUT " << (options.buffered_output ? 1 : 0) << "\n";
+    out_file << "#define CALL_FRAME_SIZE " << C_CALL_FRAME_SIZE + 16 * slots << "u\n";
+    out_file << c_runtime << '\n';
+    add_string_table_c(out_file, string_table);
+
+    out_file << '\n';
+    for (uint64_t ip = 0; ip < program.size(); ++ip) {
+        if (program[ip].op_type() == Operations::OP_PROC) {
+            out_file << "static cell *" << function_name_c(program, ip) << "(cell *sp);\n";
+        }
+    }
+    for (uint64_t ip = 0; ip < program.size(); ++ip) {
+        if (program[ip].op_type() == Operations::OP_PROC) {
+            generate_function_c(out_file, program_file_name, program, ip, shapes, strings);
+        }
+    }
+    generate_function_c(out_file, program_file_name, program, program.size(), shapes, strings);
+
+    out_file << "\nstatic void run_program(void)\n{\n";
+    out_file << "    program(stack_base);\n";
+    out_file << "}\n";
+    out_file << "\nint main(void)\n{\n";
+    out_file << "    init_data_stack();\n";
+    out_file << "    run_on_call_stack(run_program);\n";
+    out_file << "    flush_output();\n";
+    out_file << "    return 0;\n";
+    out_file << "}\n";
+    out_file.close();
+
+    std::string cc_cmd = C_COMPILER " " C_COMPILER_FLAGS " -o ./a.out ";
+    cc_cmd += output_filename;
+    cc_cmd += ".c";
+    exec(cc_cmd);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "main.h"
+
+
+// `cl c --backend=c` translates the program to C and builds it with the
+// system compiler. Procedures and the top level program become C functions
+// taking and returning the data stack pointer. Where every op of a function
+// runs at a stack depth known relative to its entry, the stack slots are
+// local variables and only the values a call consumes go through memory.
+#define C_COMPILER "cc"
+#define C_COMPILER_FLAGS "-O2"
+// Bytes of C stack a call takes besides its local slots
+#define C_CALL_FRAME_SIZE 128
+
+
+// Stack use of a function whose depths are static, relative to its entry
+struct StackShape {
+    // values below the entry depth the function reads
+    int64_t consumed = 0;
+    // depth at the end, relative to the entry
+    int64_t net = 0;
+    // highest depth reached, relative to the entry
+    int64_t max = 0;
+};
+
+
+bool compute_function_shape(const std::string &program_file_name,
+        const std::vector<Operation> &program, uint64_t proc_ip,
+        const std::map<uint64_t, StackShape> &shapes, bool unknown_calls_end_path,
+        StackShape &shape, std::vector<int64_t> &depths);
+std::map<uint64_t, StackShape> compute_procedure_shapes(
+        const std::string &program_file_name, const std::vector<Operation> &program);
+void compile_program_c(std::string output_filename, const std::string &program_file_name,
+        std::list<Operation> &operations_list, const Options &options);
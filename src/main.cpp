@@ -1,18 +1,38 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <list>
+#include <map>
+#include <mutex>
+#include <new>
 #include <source_location>
+#include <sstream>
 #include <stack>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <cassert>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
+#include <immintrin.h>
+
+#include "cbackend.h"
 #include "main.h"
+#include "ops.h"
+#include "regvm.h"
+#include "server.h"
+#include "ssa.h"
 
 
 int main(int argc, char **argv) {
@@ -35,6 +55,12 @@ int main(int argc, char **argv) {
         print_help();
         exit(EXIT_SUCCESS);
     }
+    if (opt_command == STR_OPT_SERVE) {
+        return serve(argc, argv);
+    }
+    if (opt_command == STR_OPT_CLIENT) {
+        return run_client(argc, argv);
+    }
 
     if (argc < 3) {
         std::cerr << "ERROR: Invalid number of arguments\n";
@@ -42,30 +68,184 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    // Two options: subcommand and file_path to compile
-    std::string program_file_name = argv[2];
+    // Subcommand, optional flags and file_path to compile
+    std::string program_file_name;
+    Options options = parse_options(argc, argv, program_file_name);
+    if (program_file_name.empty()) {
+        std::cerr << "ERROR: No input file\n";
+        print_usage(compiler_program_name);
+        exit(EXIT_FAILURE);
+    }
+    if (opt_command != STR_OPT_COMPILE && opt_command != STR_OPT_SIMULATE) {
+        std::cerr << "ERROR: Invalid command\n";
+        print_usage(compiler_program_name);
+        return 0;
+    }
     std::list<Operation> operations = parse_program(program_file_name);
-    crossreference_conditional(operations);
+    crossreference_conditional(program_file_name, operations);
 
     if (opt_command == STR_OPT_COMPILE) {
-        compile_program(OUTPUT_FILENAME, operations);
-    }
-    else if (opt_command == STR_OPT_SIMULATE) {
-        simulate_program(program_file_name, operations);
+        prepare_compilation(program_file_name, operations, options);
+        if (options.backend == Backend::C) {
+            compile_program_c(OUTPUT_FILENAME, program_file_name, operations, options);
+        }
+        else {
+            compile_program(OUTPUT_FILENAME, program_file_name, operations, options);
+        }
     }
     else {
-        std::cerr << "ERROR: Invalid command\n";
-        print_usage(compiler_program_name);
+        simulate(program_file_name, operations, options);
     }
 
     return 0;
 }
 
 
+// Inlines procedures, guided by --profile-use, and settles the profile path
+// of --profile-generate. The cross referenced program is ready to compile
+// afterwards.
+void prepare_compilation(const std::string &program_file_name,
+        std::list<Operation> &operations, Options &options) {
+    BlockProfile profile;
+    if (!options.profile_use.empty() && !read_block_profile(options.profile_use, profile)) {
+        std::cerr << "ERROR: Could not read profile: " << options.profile_use << '\n';
+        exit(EXIT_FAILURE);
+    }
+    inline_procedures(program_file_name, operations,
+            options.profile_use.empty() ? nullptr : &profile);
+    if (options.profile_generate) {
+        options.profile_path = std::filesystem::absolute(program_file_name).string()
+            + PROFILE_SUFFIX;
+    }
+}
+
+
+// Runs the cross referenced program in the simulator
+void simulate(const std::string &program_file_name,
+        std::list<Operation> &operations, Options &options) {
+    options.stack_size = stack_size_from_env(options.stack_size);
+    // only the stack interpreter keeps count
+    if (is_metered(options)) {
+        simulate_program(program_file_name, operations, options);
+        return;
+    }
+    if (options.ssa && simulate_ssa_program(program_file_name, operations, options)) {
+        return;
+    }
+    if (!options.register_vm ||
+            !simulate_register_program(program_file_name, operations, options)) {
+        simulate_program(program_file_name, operations, options);
+    }
+}
+
+
+// parse the flags following the subcommand; the first non flag argument
+// is the program file.
+Options parse_options(int argc, char **argv, std::string &program_file_name) {
+    Options options;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind(STR_OPT_STACK_SIZE, 0) == 0) {
+            options.stack_size = round_stack_size(parse_size_option(arg, STR_OPT_STACK_SIZE));
+        }
+        else if (arg.rfind(STR_OPT_MEM_SIZE, 0) == 0) {
+            options.mem_size = parse_size_option(arg, STR_OPT_MEM_SIZE);
+            if (options.mem_size > MAX_MEM_SIZE) {
+                std::cerr << "ERROR: Invalid value for " << STR_OPT_MEM_SIZE << ' '
+                    << options.mem_size << " (at most " << MAX_MEM_SIZE << ")\n";
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg == STR_OPT_BUFFERED_OUTPUT) {
+            options.buffered_output = true;
+        }
+        else if (arg == STR_OPT_REGISTER_VM) {
+            options.register_vm = true;
+        }
+        else if (arg == STR_OPT_SSA) {
+            options.ssa = true;
+        }
+        else if (arg == STR_OPT_VM_STATS) {
+            options.vm_stats = true;
+        }
+        else if (arg == STR_OPT_PROFILE_GENERATE) {
+            options.profile_generate = true;
+        }
+        else if (arg.rfind(STR_OPT_PROFILE_USE, 0) == 0) {
+            options.profile_use = arg.substr(strlen(STR_OPT_PROFILE_USE));
+        }
+        else if (arg.rfind(STR_OPT_BUDGET, 0) == 0) {
+            options.budget = parse_size_option(arg, STR_OPT_BUDGET);
+        }
+        else if (arg.rfind(STR_OPT_DEADLINE, 0) == 0) {
+            options.deadline_ms = parse_size_option(arg, STR_OPT_DEADLINE);
+        }
+        else if (arg.rfind(STR_OPT_BACKEND, 0) == 0) {
+            std::string backend = arg.substr(strlen(STR_OPT_BACKEND));
+            if (backend == STR_BACKEND_NASM) {
+                options.backend = Backend::NASM;
+            }
+            else if (backend == STR_BACKEND_C) {
+                options.backend = Backend::C;
+            }
+            else {
+                std::cerr << "ERROR: Unknown backend: " << backend << '\n';
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "ERROR: Unknown option: " << arg << '\n';
+            exit(EXIT_FAILURE);
+        }
+        else if (program_file_name.empty()) {
+            program_file_name = arg;
+        }
+        else {
+            std::cerr << "ERROR: Unexpected argument: " << arg << '\n';
+            exit(EXIT_FAILURE);
+        }
+    }
+    return options;
+}
+
+
+// parses the value of a --flag=N option, which must be a positive integer
+uint64_t parse_size_option(const std::string &arg, const char *option) {
+    std::string value = arg.substr(strlen(option));
+    char *end = nullptr;
+    uint64_t size = strtoull(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || size == 0) {
+        std::cerr << "ERROR: Invalid value for " << option << ' ' << value << '\n';
+        exit(EXIT_FAILURE);
+    }
+    return size;
+}
+
+
+// Stack sizes in whole pages, what the compiled runtime can guard
+uint64_t round_stack_size(uint64_t cells) {
+    return (cells + STACK_SIZE_GRANULE - 1) / STACK_SIZE_GRANULE * STACK_SIZE_GRANULE;
+}
+
+
+// CL_STACK_SIZE overrides the stack size at run time, the same way the
+// compiled runtime reads it on startup. Invalid or zero values are ignored.
+uint64_t stack_size_from_env(uint64_t default_size) {
+    const char *value = getenv(STR_ENV_STACK_SIZE);
+    if (value == nullptr) {
+        return default_size;
+    }
+    uint64_t size = 0;
+    for (; isdigit(*value); ++value) {
+        size = size * 10 + static_cast<uint64_t>(*value - '0');
+    }
+    return size == 0 ? default_size : round_stack_size(size);
+}
+
+
 // parse the program file into list<Operation>.
 [[nodiscard]] std::list<Operation> parse_program(std::string program_file_name) {
 
-    int exit_code = EXIT_SUCCESS;
     std::ifstream input_program_file;
     input_program_file.open(program_file_name);
 
@@ -81,29 +261,74 @@ int main(int argc, char **argv) {
     for (std::string line; std::getline(input_program_file, line);)
     {
         ++line_num;
-        // TODO: change this to lamda expressions for error reporting.
         std::list<Operation> ops_in_line = parse_op_from_line(line);
-        if (ops_in_line.empty()) {
-            continue;
-        }
-        for (auto op = ops_in_line.begin();
-                op != ops_in_line.end();
-                ++op) {
-            if (op->op_type() >= Operations::OP_CNT) {
-                exit_code = EXIT_FAILURE;
-                print_error(program_file_name, line_num, op->col(), "Invalid operation");
-            }
-            op->line(line_num);
+        for (auto &op : ops_in_line) {
+            op.line(line_num);
         }
         operations_list.splice(operations_list.end(), ops_in_line);
     }
     input_program_file.close();
 
-    if (exit_code != EXIT_SUCCESS) {
+    finish_parsing(program_file_name, operations_list);
+    return operations_list;
+}
+
+
+// Reports invalid operations and binds procedure names once every line of
+// the program is lexed.
+void finish_parsing(std::string program_file_name, std::list<Operation> &ops) {
+    // TODO: change this to lamda expressions for error reporting.
+    bool valid = true;
+    for (const auto &op : ops) {
+        if (op.op_type() >= Operations::OP_CNT) {
+            valid = false;
+            print_error(program_file_name, op.line(), op.col(), "Invalid operation");
+        }
+    }
+    if (!valid) {
         exit(EXIT_FAILURE);
     }
 
-    return operations_list;
+    bind_procedure_names(program_file_name, ops);
+    bind_reduce_operators(program_file_name, ops);
+}
+
+
+// The word following `proc` is parsed as a call, move it into the OP_PROC
+// as the name of the procedure.
+void bind_procedure_names(std::string program_file_name, std::list<Operation> &ops) {
+    for (auto it = ops.begin(); it != ops.end(); ++it) {
+        if (it->op_type() != Operations::OP_PROC) {
+            continue;
+        }
+        auto name_it = std::next(it);
+        if (name_it == ops.end() || name_it->op_type() != Operations::OP_CALL) {
+            print_error(program_file_name, it->line(), it->col(),
+                    "Expected procedure name after proc");
+            exit(EXIT_FAILURE);
+        }
+        it->name(name_it->name());
+        ops.erase(name_it);
+    }
+}
+
+
+// The op following `reduce` combines the values of a parallel loop, move
+// it into the OP_REDUCE as its operand.
+void bind_reduce_operators(std::string program_file_name, std::list<Operation> &ops) {
+    for (auto it = ops.begin(); it != ops.end(); ++it) {
+        if (it->op_type() != Operations::OP_REDUCE) {
+            continue;
+        }
+        auto op_it = std::next(it);
+        if (op_it == ops.end() || !op_info(op_it->op_type()).reduces) {
+            print_error(program_file_name, it->line(), it->col(),
+                    "Expected + * & | or ^ after reduce");
+            exit(EXIT_FAILURE);
+        }
+        it->operand(static_cast<uint64_t>(op_it->op_type()));
+        ops.erase(op_it);
+    }
 }
 
 
@@ -125,114 +350,85 @@ int main(int argc, char **argv) {
             int col_start = i + 1;
             int num_idx = 0;
             for (; i < line.size() && isdigit(line.at(i)); ++i) {
-                number_str[num_idx] = line.at(i);
-                ++num_idx;
+                if (num_idx < static_cast<int>(sizeof(number_str)) - 1) {
+                    number_str[num_idx] = line.at(i);
+                    ++num_idx;
+                }
             }
             number_str[num_idx] = '\0';
-            op.operand(atoi(number_str));
+            // the for loop increments past the last digit again
+            --i;
+            op.operand(strtoull(number_str, nullptr, 10));
             op.op_type(Operations::OP_PUSH);
             op.col(col_start);
             line_ops.push_back(op);
             continue;
         }
 
+        // keywords and procedure names
+        if (isalpha(line.at(i)) || line.at(i) == '_') {
+            int col_start = i + 1;
+            size_t word_start = i;
+            for (; i < line.size() && (isalnum(line.at(i)) || line.at(i) == '_'); ++i);
+            std::string word = line.substr(word_start, i - word_start);
+            --i;
+            op.op_type(keyword_operation(word));
+            if (op.op_type() == Operations::OP_CALL) {
+                op.name(word);
+            }
+            op.col(col_start);
+            line_ops.push_back(op);
+            continue;
+        }
+
         if (isspace(line.at(i))) {
             continue;
         }
 
-        // Check for whether implemented every operation in Operations
-        assert(static_cast<Operations>(15) == Operations::OP_CNT && "Implement every operation" &&
-                "parse_op_from_line()");
         int col_start = i + 1;
         switch (line.at(i)) {
-            case '+':
-                op.op_type(Operations::OP_PLUS);
-                break;
-            case '-':
-                op.op_type(Operations::OP_MINUS);
-                break;
-            case '.':
-                op.op_type(Operations::OP_DUMP);
-                break;
-            case '=':
-                op.op_type(Operations::OP_EQUALS);
-                break;
             case '#':
                 is_comment = true;
                 break;
-            case '<':
-                if (i + 1 < line.size() && line.at(i + 1) == '=') {
-                    op.op_type(Operations::OP_LESS_THAN_EQ);
-                    ++i;
-                }
-                else {
-                    op.op_type(Operations::OP_LESS_THAN);
-                }
-                break;
-            case '>':
-                if (i + 1 < line.size() && line.at(i + 1) == '=') {
-                    op.op_type(Operations::OP_GREATER_THAN_EQ);
-                    ++i;
-                }
-                else {
-                    op.op_type(Operations::OP_GREATER_THAN);
-                }
-                break;
-            case 'i':
-                if (line.at(i + 1) == 'f') {
-                    op.op_type(Operations::OP_IF);
-                }
-                else {
-                    op.op_type(Operations::OP_CNT);
-                }
-                ++i;
-                break;
-            case 'e':
-                if (line.compare(i, strlen(STR_KEYWORD_END),
-                            STR_KEYWORD_END) == 0) {
-                    op.op_type(Operations::OP_END);
-                    i += strlen(STR_KEYWORD_END);
-                }
-                else if (line.compare(i, strlen(STR_KEYWORD_ELSE),
-                            STR_KEYWORD_ELSE) == 0) {
-                    op.op_type(Operations::OP_ELSE);
-                    i += strlen(STR_KEYWORD_ELSE);
-                }
-                else {
-                    op.op_type(Operations::OP_CNT);
-                }
-                break;
-
-            case 'w':
-                if (line.compare(i, strlen(STR_KEYWORD_WHILE),
-                            STR_KEYWORD_WHILE) == 0) {
-                    op.op_type(Operations::OP_WHILE);
-                    i += strlen(STR_KEYWORD_WHILE);
-                }
-                else {
-                    op.op_type(Operations::OP_CNT);
-                }
-                break;
-
-            case 'd':
-                if (line.compare(i, strlen(STR_KEYWORD_DUP),
-                            STR_KEYWORD_DUP) == 0) {
-                    op.op_type(Operations::OP_DUP);
-                    i += strlen(STR_KEYWORD_DUP);
-                }
-                else if (line.compare(i, strlen(STR_KEYWORD_DO),
-                            STR_KEYWORD_DO) == 0) {
-                    op.op_type(Operations::OP_DO);
-                    i += strlen(STR_KEYWORD_DO);
-                }
-                else {
-                    op.op_type(Operations::OP_CNT);
+            case '"':
+                {
+                    // \n, \t, \" and \\ are the only escapes, an unterminated
+                    // literal is an invalid operation
+                    std::string text;
+                    bool closed = false;
+                    for (++i; i < line.size(); ++i) {
+                        char c = line.at(i);
+                        if (c == '"') {
+                            closed = true;
+                            break;
+                        }
+                        if (c == '\\' && i + 1 < line.size()) {
+                            c = line.at(++i);
+                            c = c == 'n' ? '\n' : c == 't' ? '\t' : c;
+                        }
+                        text.push_back(c);
+                    }
+                    op.op_type(closed ? Operations::OP_PUSH_STR : Operations::OP_CNT);
+                    op.name(std::move(text));
                 }
                 break;
-
             default:
-                std::cerr << line.at(i) << '\n';
-                op.op_type(Operations::OP_CNT);
+                {
+                    // longest symbol spelled here
+                    size_t len = std::min(MAX_SYMBOL_LEN, line.size() - i);
+                    for (; len > 0; --len) {
+                        op.op_type(lookup_spelling(std::string_view(line).substr(i, len)));
+                        if (op.op_type() != Operations::OP_CNT) {
+                            break;
+                        }
+                    }
+                    // an unknown character stays OP_CNT, reported as an
+                    // invalid operation with its position
+                    if (len == 0) {
+                        len = 1;
+                    }
+                    i += static_cast<uint32_t>(len - 1);
+                }
         }
 
         if (is_comment) {
@@ -246,6 +442,13 @@ int main(int argc, char **argv) {
 }
 
 
+// Maps a word to its keyword operation, any other word calls a procedure.
+Operations keyword_operation(const std::string &word) {
+    Operations op = lookup_spelling(word);
+    return op == Operations::OP_CNT ? Operations::OP_CALL : op;
+}
+
+
 // strips spaces only from left of the string in place
 // and return removed no of spaces
 [[maybe_unused]] size_t lstrip(std::string &str) {
@@ -268,672 +471,3326 @@ int main(int argc, char **argv) {
 }
 
 
-void simulate_program(std::string program_file_name,
-        std::list<Operation> &operations_list) {
-    std::cout << "Simulating\n";
-    std::stack<uint64_t> program_stack;
-    std::stack<Operations> conditional_type_stack;
-    uint64_t while_jump_loc = 0;
-
-    uint64_t ip = 0;
-    for (auto it = operations_list.begin();
-            it != operations_list.end();
-            ++it, ++ip)
-    {
-        assert(static_cast<Operations>(15) == Operations::OP_CNT && "Implement every operation"
-                && "simulate_program()");
+// Budget and deadline of a metered simulation, shared by the threads of
+// parallel loops
+struct SimMeter {
+    // block_costs() of the program
+    std::vector<uint32_t> costs;
+    // ops not yet handed out to a thread, unused without --budget
+    std::atomic<uint64_t> left;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+
+// Simulator state shared by the op handlers. Workers of a parallel loop get
+// a state of their own with fresh stacks, sharing the rest.
+struct SimState {
+    const std::string &program_file_name;
+    const Options &options;
+    // jump_loc is an index into the program, so run from a vector
+    const std::vector<Operation> &program;
+    std::stack<uint64_t, std::vector<uint64_t>> stack;
+    std::stack<uint64_t> return_stack;
+    const std::map<std::string, uint64_t> &strings;
+    std::vector<uint8_t> &memory;
+    SimInput &input;
+    uint64_t stack_size;
+    uint64_t executed = 0;
+    // nullptr unless running under --budget or --deadline
+    SimMeter *meter = nullptr;
+    // ops this thread took from meter->left and has not run yet
+    uint64_t credit = 0;
+    uint32_t clock_countdown = METER_CLOCK_BLOCKS;
+};
+
+
+// Runs program[ip] and returns the ip of the next op. The dispatch loop has
+// already checked that the stack holds the op's pops and has room for its
+// pushes.
+using SimHandler = uint64_t (*)(SimState &state, uint64_t ip);
+
+
+[[noreturn]] static void sim_error(SimState &state, uint64_t ip, const std::string &msg) {
+    print_error(state.program_file_name, state.program[ip].line(), state.program[ip].col(), msg);
+    exit(EXIT_FAILURE);
+}
 
-        switch (it->op_type()) {
-            case Operations::OP_PUSH:
-                if (program_stack.size() >= MAX_STACK_SIZE) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Stack size exceeded limit");
-                    exit(EXIT_FAILURE);
-                }
-                program_stack.push(it->operand());
-                break;
 
-            case Operations::OP_PLUS:
-                if (program_stack.size() >= 2) {
-                    uint64_t a = program_stack.top();
-                    program_stack.pop();
-                    uint64_t b = program_stack.top();
-                    program_stack.pop();
-                    program_stack.push(a + b);
-                }
-                else {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_PLUS(+) operation");
-                    exit(EXIT_FAILURE);
-                }
-                break;
+static uint64_t sim_pop(SimState &state) {
+    uint64_t value = state.stack.top();
+    state.stack.pop();
+    return value;
+}
 
-            case Operations::OP_MINUS:
-                if (program_stack.size() >= 2) {
-                    uint64_t a = program_stack.top();
-                    program_stack.pop();
-                    uint64_t b = program_stack.top();
-                    program_stack.pop();
-                    program_stack.push(b - a);
-                }
-                else {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_MINUS(-) operation");
-                    exit(EXIT_FAILURE);
-                }
-                break;
 
-            case Operations::OP_DUMP:
-                if (program_stack.size() < 1) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_DUMP operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    std::cout << program_stack.top() << '\n';
-                    program_stack.pop();
-                }
-                break;
+static void sim_check_range(SimState &state, uint64_t ip, uint64_t addr, uint64_t size,
+        uint64_t limit) {
+    if (!check_memory_range(state.program_file_name, state.program[ip], addr, size, limit)) {
+        exit(EXIT_FAILURE);
+    }
+}
 
-            case Operations::OP_EQUALS:
-                if (program_stack.size() < 2) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_EQUALS operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    uint64_t a = program_stack.top();
-                    program_stack.pop();
-                    uint64_t b = program_stack.top();
-                    program_stack.pop();
-                    program_stack.push(a == b);
-                }
-                break;
 
-            case Operations::OP_LESS_THAN:
-                if (program_stack.size() < 2) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_LESS_THAN operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    uint64_t a = program_stack.top();
-                    program_stack.pop();
-                    uint64_t b = program_stack.top();
-                    program_stack.pop();
-                    program_stack.push(b < a);
-                }
-                break;
+// Binary ops and comparisons come straight from their op_table entry,
+// every other op specializes this template below.
+template <Operations Op>
+static uint64_t simulate_op(SimState &state, uint64_t ip) {
+    constexpr const OpInfo &info = op_info(Op);
+    static_assert(info.fold != nullptr, "simulate_op() needs a specialization for this op");
+    uint64_t a = sim_pop(state);
+    uint64_t b = sim_pop(state);
+    if constexpr (info.divides) {
+        if (a == 0) {
+            sim_error(state, ip, "Division by zero");
+        }
+    }
+    state.stack.push(info.fold(b, a));
+    return ip + 1;
+}
 
-            case Operations::OP_LESS_THAN_EQ:
-                if (program_stack.size() < 2) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_LESS_THAN_EQ operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    uint64_t a = program_stack.top();
-                    program_stack.pop();
-                    uint64_t b = program_stack.top();
-                    program_stack.pop();
-                    program_stack.push(b <= a);
-                }
-                break;
 
-            case Operations::OP_GREATER_THAN:
-                if (program_stack.size() < 2) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_GREATER_THAN operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    uint64_t a = program_stack.top();
-                    program_stack.pop();
-                    uint64_t b = program_stack.top();
-                    program_stack.pop();
-                    program_stack.push(b > a);
-                }
-                break;
+template <>
+uint64_t simulate_op<Operations::OP_PUSH>(SimState &state, uint64_t ip) {
+    state.stack.push(state.program[ip].operand());
+    return ip + 1;
+}
 
-            case Operations::OP_GREATER_THAN_EQ:
-                if (program_stack.size() < 2) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_GREATER_THAN operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    uint64_t a = program_stack.top();
-                    program_stack.pop();
-                    uint64_t b = program_stack.top();
-                    program_stack.pop();
-                    program_stack.push(b >= a);
-                }
-                break;
 
-            case Operations::OP_DUP:
-                if (program_stack.size() < 1) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_EQUALS operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    program_stack.push(program_stack.top());
-                }
-                break;
+template <>
+uint64_t simulate_op<Operations::OP_DUMP>(SimState &state, uint64_t ip) {
+    std::cout << sim_pop(state) << '\n';
+    return ip + 1;
+}
 
-            case Operations::OP_IF:
-                if (program_stack.size() < 1) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_IF operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    conditional_type_stack.push(it->op_type());
-                    // if statement will consume the bool_result
-                    uint64_t bool_result = program_stack.top();
-                    program_stack.pop();
-
-                    if (bool_result == 0) {
-                        uint64_t last_inst_ptr = it->jump_loc();
-                        while (ip != last_inst_ptr) {
-                            ++ip;
-                            ++it;
-                        }
-                        if (it->op_type() == Operations::OP_ELSE) {
-                            conditional_type_stack.push(it->op_type());
-                        }
-                        conditional_type_stack.pop();
-                    }
-                }
-                break;
 
-            case Operations::OP_END:
-                {
-                    Operations current_condition = conditional_type_stack.top();
-
-                    if (current_condition == Operations::OP_WHILE &&
-                            while_jump_loc > 0) {
-                        while (it != operations_list.begin() &&
-                                it->op_type() != Operations::OP_WHILE) {
-                            --it;
-                            --ip;
-                        }
-                        // The for will increment these both values below decremented.
-                        --it;
-                        --ip;
-                    }
-                    if (conditional_type_stack.size() < 1) {
-                        std::cerr << "ERROR: Unclosed conditional\n";
-                    }
-                    else {
-                        conditional_type_stack.pop();
-                    }
-                }
-                break;
+template <>
+uint64_t simulate_op<Operations::OP_DUP>(SimState &state, uint64_t ip) {
+    state.stack.push(state.stack.top());
+    return ip + 1;
+}
 
-            case Operations::OP_ELSE:
-                while (it != operations_list.end() &&
-                        it->op_type() != Operations::OP_END) {
-                    ++it;
-                    ++ip;
-                }
-                break;
 
-            case Operations::OP_WHILE:
-                if (program_stack.size() < 1) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_WHILE operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    conditional_type_stack.push(it->op_type());
-                    while_jump_loc = it->jump_loc();
-                }
-                break;
+template <>
+uint64_t simulate_op<Operations::OP_SWAP>(SimState &state, uint64_t ip) {
+    uint64_t a = sim_pop(state);
+    uint64_t b = sim_pop(state);
+    state.stack.push(a);
+    state.stack.push(b);
+    return ip + 1;
+}
 
-            case Operations::OP_DO:
-                if (program_stack.size() < 1) {
-                    print_error(program_file_name, it->line(), it->col(),
-                            "Not enough elements in stack for OP_WHILE on OP_DO operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    if (program_stack.top() == 0) {
-                        while (while_jump_loc != ip) {
-                            ++it;
-                            ++ip;
-                        }
-                        while_jump_loc = 0;
-                    }
-                    program_stack.pop();
-                }
-                break;
 
-            default:
-                print_error(program_file_name, it->line(), it->col(),
-                        "Operation unknown");
-                exit(EXIT_FAILURE);
-        }
-    }
+template <>
+uint64_t simulate_op<Operations::OP_OVER>(SimState &state, uint64_t ip) {
+    uint64_t b = sim_pop(state);
+    uint64_t a = state.stack.top();
+    state.stack.push(b);
+    state.stack.push(a);
+    return ip + 1;
 }
 
 
-void print_help() {
-    print_usage("cl");
+// a b c -- b c a
+template <>
+uint64_t simulate_op<Operations::OP_ROT>(SimState &state, uint64_t ip) {
+    uint64_t c = sim_pop(state);
+    uint64_t b = sim_pop(state);
+    uint64_t a = sim_pop(state);
+    state.stack.push(b);
+    state.stack.push(c);
+    state.stack.push(a);
+    return ip + 1;
 }
 
 
-void print_usage(std::string program) {
-    std::cout << "Usage: " << program << " option file\n";
-    std::cout << "    options:\n";
-    std::cout << "        c - compile\n";
-    std::cout << "        s - simulate\n";
+template <>
+uint64_t simulate_op<Operations::OP_DROP>(SimState &state, uint64_t ip) {
+    state.stack.pop();
+    return ip + 1;
 }
 
 
-// Compiles the program and creates executable ./a.out and generated assembly
+template <>
+uint64_t simulate_op<Operations::OP_IF>(SimState &state, uint64_t ip) {
+    // if statement will consume the bool_result
+    return sim_pop(state) == 0 ? state.program[ip].jump_loc() : ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_ELSE>(SimState &state, uint64_t ip) {
+    return state.program[ip].jump_loc();
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_END>(SimState &state, uint64_t ip) {
+    uint64_t opener = state.program[ip].jump_loc();
+    switch (state.program[opener].op_type()) {
+        case Operations::OP_WHILE:
+            return opener;
+        case Operations::OP_PROC:
+            {
+                uint64_t ret = state.return_stack.top();
+                state.return_stack.pop();
+                return ret;
+            }
+        default:
+            return ip + 1;
+    }
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_WHILE>(SimState &, uint64_t ip) {
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_DO>(SimState &state, uint64_t ip) {
+    return sim_pop(state) == 0 ? state.program[ip].jump_loc() : ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_PROC>(SimState &state, uint64_t ip) {
+    // definitions are skipped, the body only runs when called
+    return state.program[ip].jump_loc();
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_CALL>(SimState &state, uint64_t ip) {
+    // a call right before the end of a procedure reuses its return address
+    if (!is_tail_call(state.program, ip)) {
+        if (state.return_stack.size() >= state.options.stack_size) {
+            sim_error(state, ip, "Return stack overflow");
+        }
+        state.return_stack.push(ip + 1);
+    }
+    return state.program[ip].jump_loc() + 1;
+}
+
+
+// The simulated region starts at address 0, compiled programs push the
+// address of their .bss region instead, see README
+template <>
+uint64_t simulate_op<Operations::OP_MEM>(SimState &state, uint64_t ip) {
+    state.stack.push(0);
+    return ip + 1;
+}
+
+
+template <uint64_t Size>
+static uint64_t simulate_load(SimState &state, uint64_t ip) {
+    uint64_t addr = sim_pop(state);
+    sim_check_range(state, ip, addr, Size, state.memory.size());
+    uint64_t value = 0;
+    memcpy(&value, state.memory.data() + addr, Size);
+    state.stack.push(value);
+    return ip + 1;
+}
+
+
+// string literals past options.mem_size are read only
+template <uint64_t Size>
+static uint64_t simulate_store(SimState &state, uint64_t ip) {
+    uint64_t addr = sim_pop(state);
+    uint64_t value = sim_pop(state);
+    sim_check_range(state, ip, addr, Size, state.options.mem_size);
+    memcpy(state.memory.data() + addr, &value, Size);
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_LOAD8>(SimState &state, uint64_t ip) {
+    return simulate_load<1>(state, ip);
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_STORE8>(SimState &state, uint64_t ip) {
+    return simulate_store<1>(state, ip);
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_LOAD64>(SimState &state, uint64_t ip) {
+    return simulate_load<8>(state, ip);
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_STORE64>(SimState &state, uint64_t ip) {
+    return simulate_store<8>(state, ip);
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_MEM_FILL>(SimState &state, uint64_t ip) {
+    uint64_t value = sim_pop(state);
+    uint64_t count = sim_pop(state);
+    uint64_t addr = sim_pop(state);
+    sim_check_range(state, ip, addr, count, state.options.mem_size);
+    sim_mem_fill(state.memory.data() + addr, count, static_cast<uint8_t>(value));
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_MEM_COPY>(SimState &state, uint64_t ip) {
+    uint64_t count = sim_pop(state);
+    uint64_t dst = sim_pop(state);
+    uint64_t src = sim_pop(state);
+    sim_check_range(state, ip, src, count, state.memory.size());
+    sim_check_range(state, ip, dst, count, state.options.mem_size);
+    sim_mem_copy(state.memory.data() + src, state.memory.data() + dst, count);
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_MEM_SUM>(SimState &state, uint64_t ip) {
+    uint64_t words = sim_pop(state);
+    uint64_t addr = sim_pop(state);
+    if (words > state.memory.size() / 8) {
+        sim_error(state, ip, "Memory access out of bounds");
+    }
+    sim_check_range(state, ip, addr, words * 8, state.memory.size());
+    state.stack.push(sim_mem_sum(state.memory.data() + addr, words));
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_MEM_EQ>(SimState &state, uint64_t ip) {
+    uint64_t count = sim_pop(state);
+    uint64_t b = sim_pop(state);
+    uint64_t a = sim_pop(state);
+    sim_check_range(state, ip, a, count, state.memory.size());
+    sim_check_range(state, ip, b, count, state.memory.size());
+    state.stack.push(sim_mem_eq(state.memory.data() + a, state.memory.data() + b, count));
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_READ_INT>(SimState &state, uint64_t ip) {
+    uint64_t value = 0;
+    bool ok = sim_read_int(state.input, value);
+    state.stack.push(value);
+    state.stack.push(ok);
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_READ_BYTE>(SimState &state, uint64_t ip) {
+    uint64_t value = 0;
+    bool ok = sim_read_byte(state.input, value);
+    state.stack.push(value);
+    state.stack.push(ok);
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_PUSH_STR>(SimState &state, uint64_t ip) {
+    const std::string &text = state.program[ip].name();
+    state.stack.push(state.options.mem_size + state.strings.at(text));
+    state.stack.push(text.size());
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_PUTS>(SimState &state, uint64_t ip) {
+    uint64_t len = sim_pop(state);
+    uint64_t addr = sim_pop(state);
+    sim_check_range(state, ip, addr, len, state.memory.size());
+    std::cout.write(reinterpret_cast<const char *>(state.memory.data() + addr),
+            static_cast<std::streamsize>(len));
+    return ip + 1;
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_PARALLEL>(SimState &state, uint64_t ip);
+
+
+template <>
+uint64_t simulate_op<Operations::OP_REDUCE>(SimState &state, uint64_t ip) {
+    // workers stop before it, OP_PARALLEL jumps past it
+    sim_error(state, ip, "reduce without parallel");
+}
+
+
+template <>
+uint64_t simulate_op<Operations::OP_CNT>(SimState &state, uint64_t ip) {
+    sim_error(state, ip, "Operation unknown");
+}
+
+
+template <size_t... Index>
+static constexpr std::array<SimHandler, sizeof...(Index)> make_sim_handlers(
+        std::index_sequence<Index...>) {
+    return {&simulate_op<static_cast<Operations>(Index)>...};
+}
+
+// one handler per op_table entry, indexed by Operations
+static constexpr std::array<SimHandler, OP_TABLE_SIZE> sim_handlers =
+    make_sim_handlers(std::make_index_sequence<OP_TABLE_SIZE>());
+
+
+// Charges the block starting at ip to the meter, the simulation stops once
+// the budget or the deadline ran out
+static void sim_charge(SimState &state, uint64_t ip, uint64_t cost) {
+    SimMeter &meter = *state.meter;
+    const Options &options = state.options;
+    if (options.budget != 0 && state.credit < cost) {
+        uint64_t left = meter.left.load(std::memory_order_relaxed);
+        uint64_t take;
+        do {
+            take = std::min(left, std::max<uint64_t>(cost - state.credit, METER_CREDIT));
+        } while (!meter.left.compare_exchange_weak(left, left - take, std::memory_order_relaxed));
+        state.credit += take;
+        if (state.credit < cost) {
+            sim_error(state, ip, "Budget of " + std::to_string(options.budget)
+                    + " operations exhausted, stack depth " + std::to_string(state.stack.size()));
+        }
+    }
+    state.credit -= cost;
+    if (options.deadline_ms != 0 && --state.clock_countdown == 0) {
+        state.clock_countdown = METER_CLOCK_BLOCKS;
+        if (std::chrono::steady_clock::now() >= meter.deadline) {
+            sim_error(state, ip, "Deadline of " + std::to_string(options.deadline_ms)
+                    + " ms exceeded, stack depth " + std::to_string(state.stack.size()));
+        }
+    }
+}
+
+
+// Runs the ops from ip until control reaches end or beyond, metered under
+// --budget and --deadline
+template <bool Metered>
+static void sim_loop(SimState &state, uint64_t ip, uint64_t end) {
+    while (ip < end)
+    {
+        if constexpr (Metered) {
+            uint32_t cost = state.meter->costs[ip];
+            if (cost != 0) {
+                sim_charge(state, ip, cost);
+            }
+        }
+        size_t index = static_cast<size_t>(state.program[ip].op_type());
+        const OpInfo &info = op_table[index];
+        size_t depth = state.stack.size();
+        ++state.executed;
+        if (depth < static_cast<size_t>(info.pops)) {
+            sim_error(state, ip, std::string("Not enough elements in stack for ")
+                    + info.name + " operation");
+        }
+        if (info.pushes > info.pops &&
+                depth + static_cast<size_t>(info.pushes - info.pops) > state.stack_size) {
+            sim_error(state, ip, "Data stack overflow");
+        }
+        ip = sim_handlers[index](state, ip);
+    }
+}
+
+
+static void sim_run(SimState &state, uint64_t ip, uint64_t end) {
+    if (state.meter != nullptr) {
+        sim_loop<true>(state, ip, end);
+    }
+    else {
+        sim_loop<false>(state, ip, end);
+    }
+}
+
+
+// Indices [next, end) of a parallel loop no worker has taken yet. The owner
+// takes chunks from the front, idle workers steal the back half.
+struct SimRange {
+    std::mutex lock;
+    uint64_t next = 0;
+    uint64_t end = 0;
+};
+
+
+// Takes up to chunk indices from ranges[w] into [first, last)
+static bool sim_take(std::vector<SimRange> &ranges, size_t w, uint64_t chunk,
+        uint64_t &first, uint64_t &last) {
+    std::lock_guard<std::mutex> guard(ranges[w].lock);
+    if (ranges[w].next >= ranges[w].end) {
+        return false;
+    }
+    first = ranges[w].next;
+    last = ranges[w].end - first > chunk ? first + chunk : ranges[w].end;
+    ranges[w].next = last;
+    return true;
+}
+
+
+// Moves the back half of the first other worker with indices left into
+// ranges[w]
+static bool sim_steal(std::vector<SimRange> &ranges, size_t w) {
+    for (size_t k = 1; k < ranges.size(); ++k) {
+        SimRange &victim = ranges[(w + k) % ranges.size()];
+        std::unique_lock<std::mutex> guard(victim.lock);
+        if (victim.next >= victim.end) {
+            continue;
+        }
+        uint64_t left = victim.end - victim.next;
+        uint64_t end = victim.end;
+        victim.end -= left - left / 2;
+        uint64_t mid = victim.end;
+        guard.unlock();
+
+        std::lock_guard<std::mutex> own(ranges[w].lock);
+        ranges[w].next = mid;
+        ranges[w].end = end;
+        return true;
+    }
+    return false;
+}
+
+
+// Runs the body of the loop on one std::thread per CPU, like the compiled
+// program does with its own threads
+template <>
+uint64_t simulate_op<Operations::OP_PARALLEL>(SimState &state, uint64_t ip) {
+    uint64_t end = sim_pop(state);
+    uint64_t start = sim_pop(state);
+    uint64_t reduce_ip = state.program[ip].jump_loc() - 1;
+    const OpInfo &combine = op_info(static_cast<Operations>(state.program[reduce_ip].operand()));
+
+    uint64_t result = combine.identity;
+    if (start < end) {
+        uint64_t total = end - start;
+        uint64_t workers = std::clamp<uint64_t>(std::thread::hardware_concurrency(),
+                1, PARALLEL_MAX_WORKERS);
+        size_t count = static_cast<size_t>(std::min(workers, total));
+        uint64_t per = total / count;
+        uint64_t chunk = std::max<uint64_t>(1, per / PARALLEL_CHUNKS_PER_WORKER);
+        std::vector<SimRange> ranges(count);
+        uint64_t next = start;
+        for (size_t w = 0; w < count; ++w) {
+            ranges[w].next = next;
+            next += per + (w < total % count);
+            ranges[w].end = next;
+        }
+
+        std::vector<uint64_t> partials(count, combine.identity);
+        std::vector<uint64_t> executed(count, 0);
+        auto work = [&](size_t w) {
+            SimState worker {state.program_file_name, state.options, state.program, {}, {},
+                state.strings, state.memory, state.input,
+                std::min<uint64_t>(state.stack_size, PARALLEL_STACK_SIZE)};
+            worker.meter = state.meter;
+            uint64_t first = 0;
+            uint64_t last = 0;
+            while (sim_take(ranges, w, chunk, first, last) || sim_steal(ranges, w)) {
+                for (uint64_t i = first; i < last; ++i) {
+                    worker.stack.push(i);
+                    sim_run(worker, ip + 1, reduce_ip);
+                    if (worker.stack.size() != 1) {
+                        sim_error(worker, reduce_ip,
+                                "The parallel body must leave exactly one value");
+                    }
+                    partials[w] = combine.fold(partials[w], sim_pop(worker));
+                }
+                first = last;
+            }
+            executed[w] = worker.executed;
+            if (worker.meter != nullptr) {
+                worker.meter->left += worker.credit;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t w = 1; w < count; ++w) {
+            threads.emplace_back(work, w);
+        }
+        work(0);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        for (size_t w = 0; w < count; ++w) {
+            result = combine.fold(result, partials[w]);
+            state.executed += executed[w];
+        }
+    }
+    state.stack.push(result);
+    return state.program[ip].jump_loc();
+}
+
+
+void simulate_program(std::string program_file_name,
+        std::list<Operation> &operations_list, const Options &options) {
+    std::cout << "Simulating\n";
+    std::vector<Operation> program(operations_list.begin(), operations_list.end());
+    // `mem` is address 0 of the simulated memory, string literals follow it
+    // and are read only: stores are checked against options.mem_size
+    std::string string_table;
+    std::map<std::string, uint64_t> strings = intern_strings(program, string_table);
+    if (options.mem_size > SIZE_MAX - string_table.size()) {
+        std::cerr << "ERROR: Invalid value for " << STR_OPT_MEM_SIZE << ' '
+            << options.mem_size << '\n';
+        exit(EXIT_FAILURE);
+    }
+    std::vector<uint8_t> memory = allocate_sim_memory(options.mem_size + string_table.size());
+    memcpy(memory.data() + options.mem_size, string_table.data(), string_table.size());
+    SimInput input;
+    SimState state {program_file_name, options, program, {}, {}, strings, memory, input,
+        options.stack_size};
+    SimMeter meter;
+    if (is_metered(options)) {
+        meter.costs = block_costs(program);
+        meter.left = options.budget;
+        // kept far from overflowing the clock, 2^40 ms are 34 years
+        meter.deadline = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(std::min<uint64_t>(options.deadline_ms, 1ull << 40));
+        state.meter = &meter;
+    }
+
+    sim_run(state, 0, program.size());
+
+    if (options.vm_stats) {
+        std::cerr << "Executed " << state.executed << " operations\n";
+    }
+}
+
+
+// Reads the next chunk of stdin, false at the end of input
+bool sim_input_refill(SimInput &input) {
+    input.pos = 0;
+    input.len = fread(input.buffer.data(), 1, input.buffer.size(), stdin);
+    return input.len > 0;
+}
+
+
+// Skips everything up to the next digit and parses an unsigned decimal
+// number, the byte ending it is left unread. False at the end of input.
+bool sim_read_int(SimInput &input, uint64_t &value) {
+    value = 0;
+    for (;;) {
+        if (input.pos == input.len && !sim_input_refill(input)) {
+            return false;
+        }
+        if (isdigit(input.buffer[input.pos])) {
+            break;
+        }
+        ++input.pos;
+    }
+    while (input.pos < input.len || sim_input_refill(input)) {
+        char c = input.buffer[input.pos];
+        if (!isdigit(c)) {
+            break;
+        }
+        value = value * 10 + static_cast<uint64_t>(c - '0');
+        ++input.pos;
+    }
+    return true;
+}
+
+
+bool sim_read_byte(SimInput &input, uint64_t &value) {
+    if (input.pos == input.len && !sim_input_refill(input)) {
+        value = 0;
+        return false;
+    }
+    value = static_cast<unsigned char>(input.buffer[input.pos++]);
+    return true;
+}
+
+
+// Reports an error unless [addr, addr + size) lies within the simulated memory
+bool check_memory_range(const std::string& program_file_name, const Operation &op,
+        uint64_t addr, uint64_t size, uint64_t mem_size) {
+    if (addr > mem_size || size > mem_size - addr) {
+        print_error(program_file_name, op.line(), op.col(),
+                "Memory access out of bounds");
+        return false;
+    }
+    return true;
+}
+
+
+// Zeroed memory of the simulator, exits with an error when the host can't
+// provide it
+std::vector<uint8_t> allocate_sim_memory(uint64_t size) {
+    try {
+        return std::vector<uint8_t>(size);
+    }
+    catch (const std::bad_alloc &) {
+        std::cerr << "ERROR: Could not allocate " << size << " bytes of memory\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Host side bulk memory operations for the simulator. memset, memmove and
+// memcmp are already vectorized by the C library, the sum uses AVX2 when
+// the CPU has it and SSE2 (always present on x86_64) otherwise.
+void sim_mem_fill(uint8_t *dst, uint64_t count, uint8_t value) {
+    memset(dst, value, count);
+}
+
+
+void sim_mem_copy(const uint8_t *src, uint8_t *dst, uint64_t count) {
+    memmove(dst, src, count);
+}
+
+
+bool sim_mem_eq(const uint8_t *a, const uint8_t *b, uint64_t count) {
+    return memcmp(a, b, count) == 0;
+}
+
+
+__attribute__((target("avx2")))
+static uint64_t sim_mem_sum_avx2(const uint8_t *src, uint64_t words) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    uint64_t i = 0;
+    for (; i + 8 <= words; i += 8) {
+        acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(src + i * 8)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(src + i * 8 + 32)));
+    }
+    acc0 = _mm256_add_epi64(acc0, acc1);
+    __m128i acc = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+            _mm256_extracti128_si256(acc0, 1));
+    uint64_t sum = static_cast<uint64_t>(_mm_cvtsi128_si64(acc))
+        + static_cast<uint64_t>(_mm_extract_epi64(acc, 1));
+    for (; i < words; ++i) {
+        uint64_t word;
+        memcpy(&word, src + i * 8, 8);
+        sum += word;
+    }
+    return sum;
+}
+
+
+static uint64_t sim_mem_sum_sse2(const uint8_t *src, uint64_t words) {
+    __m128i acc = _mm_setzero_si128();
+    uint64_t i = 0;
+    for (; i + 2 <= words; i += 2) {
+        acc = _mm_add_epi64(acc, _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(src + i * 8)));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    uint64_t sum = static_cast<uint64_t>(_mm_cvtsi128_si64(acc));
+    for (; i < words; ++i) {
+        uint64_t word;
+        memcpy(&word, src + i * 8, 8);
+        sum += word;
+    }
+    return sum;
+}
+
+
+uint64_t sim_mem_sum(const uint8_t *src, uint64_t words) {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2 ? sim_mem_sum_avx2(src, words) : sim_mem_sum_sse2(src, words);
+}
+
+
+StackEffect stack_effect(Operations op) {
+    const OpInfo &info = op_info(op);
+    return {info.pops, info.pushes};
+}
+
+
+bool is_metered(const Options &options) {
+    return options.budget != 0 || options.deadline_ms != 0;
+}
+
+
+// Number of ops of the basic block starting at every ip, 0 where none
+// starts. Blocks start at the first op, after every if, else, end, do,
+// procedure, call and parallel loop, and where jumps land: at every while
+// and at the end an if or else jumps to. A while and its condition are one
+// block. One more entry for the end of the program.
+std::vector<uint32_t> block_costs(const std::vector<Operation> &program) {
+    uint64_t n = program.size();
+    std::vector<bool> starts(n + 1, false);
+    starts[0] = true;
+    starts[n] = true;
+    for (uint64_t ip = 0; ip < n; ++ip) {
+        if (op_info(program[ip].op_type()).kind == OpKind::CONTROL &&
+                program[ip].op_type() != Operations::OP_WHILE) {
+            starts[ip + 1] = true;
+        }
+        switch (program[ip].op_type()) {
+            case Operations::OP_WHILE:
+                starts[ip] = true;
+                break;
+            case Operations::OP_IF:
+            case Operations::OP_ELSE:
+                starts[program[ip].jump_loc()] = true;
+                break;
+            default:
+                break;
+        }
+    }
+    std::vector<uint32_t> costs(n + 1, 0);
+    uint64_t next = n;
+    for (uint64_t ip = n; ip-- > 0;) {
+        if (starts[ip]) {
+            costs[ip] = static_cast<uint32_t>(next - ip);
+            next = ip;
+        }
+    }
+    return costs;
+}
+
+
+// Appends every distinct string literal of the program to table once,
+// returning the offset of each text in it.
+std::map<std::string, uint64_t> intern_strings(const std::vector<Operation> &program,
+        std::string &table) {
+    std::map<std::string, uint64_t> offsets;
+    for (const auto &op : program) {
+        if (op.op_type() == Operations::OP_PUSH_STR && !offsets.contains(op.name())) {
+            offsets[op.name()] = table.size();
+            table += op.name();
+        }
+    }
+    return offsets;
+}
+
+
+// Whether nothing but the ends of if/else blocks separate the call at ip
+// from the end of its procedure, so the call can reuse the return address.
+bool is_tail_call(const std::vector<Operation> &program, uint64_t ip) {
+    for (++ip; ip < program.size(); ++ip) {
+        if (program[ip].op_type() == Operations::OP_ELSE) {
+            ip = program[ip].jump_loc();
+        }
+        if (program[ip].op_type() != Operations::OP_END) {
+            return false;
+        }
+        Operations block = program[program[ip].jump_loc()].op_type();
+        if (block == Operations::OP_PROC) {
+            return true;
+        }
+        if (block == Operations::OP_WHILE) {
+            return false;
+        }
+    }
+    return false;
+}
+
+
+void print_help() {
+    print_usage("cl");
+}
+
+
+void print_usage(std::string program) {
+    std::cout << "Usage: " << program << " option file\n";
+    std::cout << "    options:\n";
+    std::cout << "        c - compile\n";
+    std::cout << "        s - simulate\n";
+    std::cout << "        " << STR_OPT_SERVE
+        << " - keep programs in memory and compile them incrementally\n";
+    std::cout << "        " << STR_OPT_CLIENT
+        << " c|s|stats|stop ... - forward a command to the running server\n";
+    std::cout << "    flags:\n";
+    std::cout << "        " << STR_OPT_MEM_SIZE
+        << "N - bytes addressable through mem (default "
+        << DEFAULT_MEM_SIZE << ", at most " << MAX_MEM_SIZE << ")\n";
+    std::cout << "        " << STR_OPT_BUFFERED_OUTPUT
+        << " - compiled programs write output in "
+        << OUTPUT_BUFFER_SIZE << " byte blocks instead of per dump\n";
+    std::cout << "        " << STR_OPT_REGISTER_VM
+        << " - simulate through register bytecode when stack depths are static\n";
+    std::cout << "        " << STR_OPT_SSA
+        << " - optimize in SSA form first, then simulate through register bytecode\n";
+    std::cout << "        " << STR_OPT_VM_STATS
+        << " - print the number of simulated instructions\n";
+    std::cout << "        " << STR_OPT_PROFILE_GENERATE
+        << " - compiled programs write basic block counts to file"
+        << PROFILE_SUFFIX << " on exit\n";
+    std::cout << "        " << STR_OPT_PROFILE_USE
+        << "FILE - inline procedures based on a block profile\n";
+    std::cout << "        " << STR_OPT_BACKEND << STR_BACKEND_NASM << "|" << STR_BACKEND_C
+        << " - emit assembly (default) or C built with " << C_COMPILER " " C_COMPILER_FLAGS "\n";
+    std::cout << "        " << STR_OPT_BUDGET
+        << "N - stop with an error after running N ops\n";
+    std::cout << "        " << STR_OPT_DEADLINE
+        << "MS - stop with an error after MS milliseconds\n";
+    std::cout << "        " << STR_OPT_STACK_SIZE
+        << "N - data stack capacity in cells, rounded up to a multiple of "
+        << STACK_SIZE_GRANULE << " (default " << DEFAULT_STACK_SIZE << ", overridden by $"
+        << STR_ENV_STACK_SIZE << " at run time)\n";
+}
+
+
+// Compiles the program and creates executable ./a.out and generated assembly
 // file %output_filename%.asm and relocatable %output_filename%.o
-void compile_program(std::string output_filename, std::list<Operation> &operations_list) {
+void compile_program(std::string output_filename, const std::string &program_file_name,
+        std::list<Operation> &operations_list, const Options &options) {
     std::cout << "Compiling\n";
 
-    int mock_stack_size = 0;
+    std::ofstream out_file;
+    out_file.open(output_filename + ".asm");
+
+    add_boilerplate_asm(out_file, options);
+
+    CodegenState state;
+    // random access copy for looking ahead from calls
+    std::vector<Operation> program(operations_list.begin(), operations_list.end());
+    if (is_metered(options)) {
+        state.block_costs = block_costs(program);
+    }
+    add_block_counter_asm(out_file, options, state, nullptr, "entry");
+    add_meter_asm(out_file, state, 0, false);
+    // string literals, deduplicated into string_table in .rodata
+    std::string string_table;
+    state.strings = intern_strings(program, string_table);
+    generate_ops_asm(out_file, output_filename, program, 0, program.size(), options, state);
+    add_exit_asm(out_file, options);
+
+    if (options.profile_generate) {
+        add_block_profile_asm(out_file, state.blocks, options);
+    }
+    if (is_metered(options)) {
+        add_meter_runtime_asm(out_file, program_file_name, program, state, options);
+    }
+    add_data_segments_asm(out_file, options, string_table);
+    out_file.close();
+
+    // Creating relocatable object
+    std::string nasm_cmd = "nasm -felf64 ";
+    nasm_cmd += OUTPUT_FILENAME;
+    nasm_cmd += ".asm -o";
+    nasm_cmd += OUTPUT_FILENAME;
+    nasm_cmd += ".o";
+    nasm_cmd += " -g -F dwarf";
+    exec(nasm_cmd);
+
+    // Creating executable
+    std::string ld_cmd = "ld ";
+    ld_cmd += OUTPUT_FILENAME;
+    ld_cmd += ".o -o ./a.out";
+    exec(ld_cmd);
+}
+
+
+static bool fits_imm32(uint64_t value) {
+    return value <= 0x7fffffff;
+}
+
+
+static bool is_power_of_two(uint64_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+
+// Emits the ops in [begin, end) of program, which must not start or end
+// inside a block. Compile time stack checks continue from
+// state.mock_stack_size, errors are reported against error_file_name.
+void generate_ops_asm(std::ofstream& out_file, const std::string &error_file_name,
+        const std::vector<Operation> &program, uint64_t begin, uint64_t end,
+        const Options &options, CodegenState &state) {
+    // ip and type of every open block, labels are named after the ip of
+    // the op opening the block: brN_loop is the head of a while, brNelse
+    // the else branch (or the end of an else-less if), brN its end.
+    std::stack<std::pair<uint64_t, Operations>> conditional_stack;
+    // mock_stack_size on entering each open block. Loops and if-less
+    // branches are assumed to leave the stack as deep as they found it.
+    std::stack<int> block_stack_size;
+
+    for (uint64_t ip = begin; ip < end; ++ip)
+    {
+        const Operation *it = &program[ip];
+        const OpInfo &info = op_info(it->op_type());
+        if (state.mock_stack_size < info.pops) {
+            print_error(error_file_name, it->line(), it->col(),
+                    std::string("Not enough elements in stack for ") + info.name + " operation");
+            exit(EXIT_FAILURE);
+        }
+        // blocks and calls below override this
+        state.mock_stack_size += info.pushes - info.pops;
+        if (generate_stack_op_asm(out_file, *it, state)) {
+            continue;
+        }
+        flush_stack_asm(out_file, state);
+        switch (it->op_type()) {
+            case Operations::OP_DUMP:
+                out_file << "    ;; OP_DUMP\n";
+                out_file << "    pop rdi\n";
+                out_file << "    call dump\n";
+                break;
+
+            // The bulk operations call the kernel selected at startup
+            case Operations::OP_MEM_FILL:
+                out_file << "    ;; OP_MEM_FILL\n";
+                out_file << "    pop rdx\n";
+                out_file << "    pop rsi\n";
+                out_file << "    pop rdi\n";
+                out_file << "    call QWORD [mem_fill_impl]\n";
+                break;
+
+            case Operations::OP_MEM_COPY:
+                out_file << "    ;; OP_MEM_COPY\n";
+                out_file << "    pop rdx\n";
+                out_file << "    pop rsi\n";
+                out_file << "    pop rdi\n";
+                out_file << "    call QWORD [mem_copy_impl]\n";
+                break;
+
+            case Operations::OP_MEM_SUM:
+                out_file << "    ;; OP_MEM_SUM\n";
+                out_file << "    pop rsi\n";
+                out_file << "    pop rdi\n";
+                out_file << "    call QWORD [mem_sum_impl]\n";
+                out_file << "    push rax\n";
+                break;
+
+            case Operations::OP_MEM_EQ:
+                out_file << "    ;; OP_MEM_EQ\n";
+                out_file << "    pop rdx\n";
+                out_file << "    pop rsi\n";
+                out_file << "    pop rdi\n";
+                out_file << "    call QWORD [mem_eq_impl]\n";
+                out_file << "    push rax\n";
+                break;
+
+            case Operations::OP_READ_INT:
+                out_file << "    ;; OP_READ_INT\n";
+                out_file << "    call read_int\n";
+                out_file << "    push rax\n";
+                out_file << "    push rdx\n";
+                break;
+
+            case Operations::OP_READ_BYTE:
+                out_file << "    ;; OP_READ_BYTE\n";
+                out_file << "    call read_byte\n";
+                out_file << "    push rax\n";
+                out_file << "    push rdx\n";
+                break;
+
+            case Operations::OP_PUSH_STR:
+                out_file << "    ;; OP_PUSH_STR\n";
+                out_file << "    mov rax, string_table+" << state.strings.at(it->name()) << "\n";
+                out_file << "    push rax\n";
+                out_file << "    push " << it->name().size() << "\n";
+                break;
+
+            case Operations::OP_PUTS:
+                out_file << "    ;; OP_PUTS\n";
+                out_file << "    pop rdx\n";
+                out_file << "    pop rsi\n";
+                out_file << "    call write_string\n";
+                break;
+
+            case Operations::OP_IF:
+                out_file << "    ;; OP_IF\n";
+                out_file << "    pop rax\n";
+                out_file << "    test rax, rax\n";
+                out_file << "    jz br" << ip << "else\n";
+                add_block_counter_asm(out_file, options, state, it, "then");
+                add_meter_asm(out_file, state, ip + 1, false);
+                conditional_stack.push({ip, Operations::OP_IF});
+                block_stack_size.push(state.mock_stack_size);
+                break;
+
+            case Operations::OP_END:
+                {
+                    auto [start, type] = conditional_stack.top();
+                    conditional_stack.pop();
+                    switch (type) {
+                        // the end itself is a block, see block_costs()
+                        case Operations::OP_IF:
+                            out_file << "br" << start << "else:\n";
+                            add_meter_asm(out_file, state, ip, false);
+                            state.mock_stack_size = block_stack_size.top();
+                            break;
+                        case Operations::OP_ELSE:
+                            out_file << "br" << start << ":\n";
+                            add_meter_asm(out_file, state, ip, false);
+                            break;
+                        case Operations::OP_WHILE:
+                            out_file << "    jmp br" << start << "_loop\n";
+                            out_file << "br" << start << ":\n";
+                            state.mock_stack_size = block_stack_size.top();
+                            break;
+                        case Operations::OP_PROC:
+                            out_file << "    xchg rsp, rbp\n";
+                            out_file << "    ret\n";
+                            out_file << "br" << start << ":\n";
+                            state.mock_stack_size = block_stack_size.top();
+                            break;
+                        default:
+                            assert(false && "unreachable");
+                    }
+                    block_stack_size.pop();
+                    add_block_counter_asm(out_file, options, state, it, "end");
+                    add_meter_asm(out_file, state, ip + 1, false);
+                }
+                break;
+
+            case Operations::OP_ELSE:
+                {
+                    uint64_t start = conditional_stack.top().first;
+                    conditional_stack.pop();
+                    out_file << "    jmp br" << start << "\n";
+                    out_file << "br" << start << "else:\n";
+                    add_block_counter_asm(out_file, options, state, it, "else");
+                    add_meter_asm(out_file, state, ip + 1, false);
+                    conditional_stack.push({start, Operations::OP_ELSE});
+                    state.mock_stack_size = block_stack_size.top();
+                }
+                break;
+
+            case Operations::OP_WHILE:
+                out_file << "\n    ;; OP_WHILE\n";
+                out_file << "br" << ip << "_loop:\n";
+                add_block_counter_asm(out_file, options, state, it, "loop");
+                add_meter_asm(out_file, state, ip, true);
+                conditional_stack.push({ip, Operations::OP_WHILE});
+                block_stack_size.push(state.mock_stack_size);
+                break;
+
+            case Operations::OP_DO:
+                out_file << "    pop rax\n";
+                out_file << "    test rax, rax\n";
+                out_file << "    jz br" << conditional_stack.top().first << "\n";
+                add_block_counter_asm(out_file, options, state, it, "body");
+                add_meter_asm(out_file, state, ip + 1, false);
+                // the loop exits with the stack as it is after the condition
+                block_stack_size.top() = state.mock_stack_size;
+                break;
+
+            // Procedures run with rsp swapped to the native stack in rbp
+            // for call/ret, the data stack stays in rsp inside the body.
+            case Operations::OP_PROC:
+                out_file << "    ;; OP_PROC " << it->name() << "\n";
+                out_file << "    jmp br" << ip << "\n";
+                out_file << "proc_" << it->name() << ":\n";
+                out_file << "    xchg rsp, rbp\n";
+                out_file << "procbody_" << it->name() << ":\n";
+                add_block_counter_asm(out_file, options, state, it, "proc");
+                add_meter_asm(out_file, state, ip + 1, true);
+                conditional_stack.push({ip, Operations::OP_PROC});
+                // the caller's stack is unknown here
+                block_stack_size.push(state.mock_stack_size);
+                state.mock_stack_size = UNKNOWN_STACK_DEPTH;
+                break;
+
+            case Operations::OP_CALL:
+                if (is_tail_call(program, ip)) {
+                    out_file << "    ;; OP_CALL " << it->name() << " (tail)\n";
+                    out_file << "    jmp procbody_" << it->name() << "\n";
+                }
+                else {
+                    out_file << "    ;; OP_CALL " << it->name() << "\n";
+                    out_file << "    xchg rsp, rbp\n";
+                    out_file << "    call proc_" << it->name() << "\n";
+                    out_file << "    xchg rsp, rbp\n";
+                    add_meter_asm(out_file, state, ip + 1, false);
+                }
+                state.mock_stack_size = UNKNOWN_STACK_DEPTH;
+                break;
+
+            // The body becomes a function parallel_run calls on the
+            // workers' threads, like a procedure with the index pushed on
+            // a data stack of the worker's own.
+            case Operations::OP_PARALLEL:
+                {
+                    const Operation &reduce = program[it->jump_loc() - 1];
+                    Operations combine = static_cast<Operations>(reduce.operand());
+                    out_file << "    ;; OP_PARALLEL\n";
+                    out_file << "    pop rsi\n";
+                    out_file << "    pop rdi\n";
+                    out_file << "    mov rdx, par" << ip << "_body\n";
+                    out_file << "    mov ecx, " << static_cast<int>(combine) << "\n";
+                    out_file << "    mov r8, " << op_info(combine).identity << "\n";
+                    out_file << "    xchg rsp, rbp\n";
+                    out_file << "    call parallel_run\n";
+                    out_file << "    xchg rsp, rbp\n";
+                    out_file << "    push rax\n";
+                    out_file << "    jmp par" << ip << "_end\n";
+                    out_file << "par" << ip << "_body:\n";
+                    out_file << "    xchg rsp, rbp\n";
+                    state.in_parallel = true;
+                    add_block_counter_asm(out_file, options, state, it, "parallel");
+                    conditional_stack.push({ip, Operations::OP_PARALLEL});
+                    block_stack_size.push(state.mock_stack_size);
+                    state.mock_stack_size = 1;
+                    // every iteration is a call, checked like a procedure
+                    add_meter_asm(out_file, state, ip + 1, true);
+                }
+                break;
+
+            case Operations::OP_REDUCE:
+                {
+                    if (state.mock_stack_size != 0) {
+                        print_error(error_file_name, it->line(), it->col(),
+                                "The parallel body must leave exactly one value");
+                        exit(EXIT_FAILURE);
+                    }
+                    uint64_t start = conditional_stack.top().first;
+                    conditional_stack.pop();
+                    out_file << "    ;; OP_REDUCE\n";
+                    out_file << "    pop rax\n";
+                    out_file << "    xchg rsp, rbp\n";
+                    out_file << "    ret\n";
+                    out_file << "par" << start << "_end:\n";
+                    state.in_parallel = false;
+                    add_block_counter_asm(out_file, options, state, it, "end");
+                    add_meter_asm(out_file, state, ip + 1, false);
+                    state.mock_stack_size = block_stack_size.top() + 1;
+                    block_stack_size.pop();
+                }
+                break;
+
+            default:
+                std::cerr << "Compilation failed!\n";
+                std::cerr << "ERROR: Operation unknown\n";
+                exit(EXIT_FAILURE);
+        }
+    }
+    flush_stack_asm(out_file, state);
+}
+
+
+// Registers pending values live in. rax, rcx, rdx and rsi stay free as
+// scratch for the ops, r14 and the registers of the runtime are left alone.
+struct StackRegister {
+    const char *q;
+    const char *d;
+    const char *b;
+};
+
+static const StackRegister stack_registers[] = {
+    {"rbx", "ebx", "bl"}, {"rdi", "edi", "dil"}, {"r8", "r8d", "r8b"},
+    {"r9", "r9d", "r9b"}, {"r10", "r10d", "r10b"}, {"r11", "r11d", "r11b"},
+    {"r12", "r12d", "r12b"}, {"r13", "r13d", "r13b"}, {"r15", "r15d", "r15b"},
+};
+
+
+static void push_value_asm(std::ofstream& out_file, const PendingValue &value) {
+    if (value.reg >= 0) {
+        out_file << "    push " << stack_registers[value.reg].q << "\n";
+    }
+    else if (fits_imm32(value.constant)) {
+        out_file << "    push " << value.constant << "\n";
+    }
+    else {
+        // push only takes a sign extended 32 bit immediate
+        out_file << "    mov rax, " << value.constant << "\n";
+        out_file << "    push rax\n";
+    }
+}
+
+
+void flush_stack_asm(std::ofstream& out_file, CodegenState &state) {
+    for (const auto &value : state.pending) {
+        push_value_asm(out_file, value);
+    }
+    state.pending.clear();
+}
+
+
+// A register no pending value is in. When all are taken the bottom
+// pending values are pushed, never the top keep of them.
+static int free_register(std::ofstream& out_file, CodegenState &state, size_t keep) {
+    for (;;) {
+        for (int reg = 0; reg < static_cast<int>(std::size(stack_registers)); ++reg) {
+            if (std::none_of(state.pending.begin(), state.pending.end(),
+                        [reg](const PendingValue &value) { return value.reg == reg; })) {
+                return reg;
+            }
+        }
+        assert(state.pending.size() > keep && "operands take every stack register");
+        push_value_asm(out_file, state.pending.front());
+        state.pending.erase(state.pending.begin());
+    }
+}
+
+
+// Pops values of the data stack in memory below the pending ones until
+// count values are pending
+static void ensure_pending(std::ofstream& out_file, CodegenState &state, size_t count) {
+    while (state.pending.size() < count) {
+        int reg = free_register(out_file, state, state.pending.size());
+        out_file << "    pop " << stack_registers[reg].q << "\n";
+        state.pending.insert(state.pending.begin(), PendingValue{reg, 0});
+    }
+}
+
+
+// A register holding the pending value at depth from_top (1 for the top)
+// that can be overwritten once the top consumed values are popped: its own
+// register unless a value below them shares it, otherwise a copy.
+static int writable_register(std::ofstream& out_file, CodegenState &state,
+        size_t from_top, size_t consumed) {
+    std::vector<PendingValue> &pending = state.pending;
+    PendingValue value = pending[pending.size() - from_top];
+    if (value.reg >= 0 && std::none_of(pending.begin(), pending.end() - static_cast<long>(consumed),
+                [&](const PendingValue &below) { return below.reg == value.reg; })) {
+        return value.reg;
+    }
+    int reg = free_register(out_file, state, consumed);
+    out_file << "    mov " << stack_registers[reg].q << ", ";
+    if (value.reg >= 0) {
+        out_file << stack_registers[value.reg].q << "\n";
+    }
+    else {
+        out_file << value.constant << "\n";
+    }
+    return reg;
+}
+
+
+// Source operand text for value, constants that are no sign extended 32
+// bit immediate go through scratch
+static std::string source_operand(std::ofstream& out_file, const PendingValue &value,
+        const char *scratch) {
+    if (value.reg >= 0) {
+        return stack_registers[value.reg].q;
+    }
+    if (fits_imm32(value.constant)) {
+        return std::to_string(value.constant);
+    }
+    out_file << "    mov " << scratch << ", " << value.constant << "\n";
+    return scratch;
+}
+
+
+// Emits the ops that work on the pending values: pushes, shuffles, mem,
+// loads and stores, arithmetic and comparisons. Shuffles emit nothing
+// once their operands are pending, operands still in memory are popped
+// into registers first. Returns false for every other op. The caller
+// has checked and updated state.mock_stack_size already.
+bool generate_stack_op_asm(std::ofstream& out_file, const Operation &op,
+        CodegenState &state) {
+    std::vector<PendingValue> &pending = state.pending;
+
+    Operations op_type = op.op_type();
+    switch (op_type) {
+        case Operations::OP_PUSH:
+            out_file << "    ;; OP_PUSH " << op.operand() << "\n";
+            pending.push_back(PendingValue{-1, op.operand()});
+            return true;
+
+        case Operations::OP_DUP:
+            out_file << "    ;; OP_DUP\n";
+            ensure_pending(out_file, state, 1);
+            pending.push_back(pending.back());
+            return true;
+
+        case Operations::OP_SWAP:
+            out_file << "    ;; OP_SWAP\n";
+            ensure_pending(out_file, state, 2);
+            std::swap(pending[pending.size() - 1], pending[pending.size() - 2]);
+            return true;
+
+        case Operations::OP_OVER:
+            out_file << "    ;; OP_OVER\n";
+            ensure_pending(out_file, state, 2);
+            pending.push_back(pending[pending.size() - 2]);
+            return true;
+
+        case Operations::OP_ROT:
+            out_file << "    ;; OP_ROT\n";
+            ensure_pending(out_file, state, 3);
+            std::rotate(pending.end() - 3, pending.end() - 2, pending.end());
+            return true;
+
+        case Operations::OP_DROP:
+            out_file << "    ;; OP_DROP\n";
+            if (pending.empty()) {
+                // a load rather than add rsp, 8, so that dropping from an
+                // empty stack hits the guard page above it
+                out_file << "    pop rax\n";
+            }
+            else {
+                pending.pop_back();
+            }
+            return true;
+
+        case Operations::OP_MEM:
+            {
+                out_file << "    ;; OP_MEM\n";
+                int reg = free_register(out_file, state, 0);
+                out_file << "    mov " << stack_registers[reg].q << ", mem\n";
+                pending.push_back(PendingValue{reg, 0});
+            }
+            return true;
+
+        // Unlike the simulator, loads, stores and the bulk kernels don't
+        // check their addresses against the region
+        case Operations::OP_LOAD8:
+        case Operations::OP_LOAD64:
+            {
+                bool byte = op_type == Operations::OP_LOAD8;
+                out_file << (byte ? "    ;; OP_LOAD8\n" : "    ;; OP_LOAD64\n");
+                ensure_pending(out_file, state, 1);
+                int reg = writable_register(out_file, state, 1, 1);
+                const StackRegister &r = stack_registers[reg];
+                if (byte) {
+                    out_file << "    movzx " << r.d << ", BYTE [" << r.q << "]\n";
+                }
+                else {
+                    out_file << "    mov " << r.q << ", QWORD [" << r.q << "]\n";
+                }
+                pending.back() = PendingValue{reg, 0};
+            }
+            return true;
+
+        case Operations::OP_STORE8:
+        case Operations::OP_STORE64:
+            {
+                bool byte = op_type == Operations::OP_STORE8;
+                out_file << (byte ? "    ;; OP_STORE8\n" : "    ;; OP_STORE64\n");
+                ensure_pending(out_file, state, 2);
+                PendingValue addr = pending[pending.size() - 1];
+                PendingValue value = pending[pending.size() - 2];
+                std::string value_text;
+                if (value.reg >= 0) {
+                    value_text = byte ? stack_registers[value.reg].b : stack_registers[value.reg].q;
+                }
+                else if (byte) {
+                    value_text = std::to_string(value.constant & 0xff);
+                }
+                else {
+                    value_text = source_operand(out_file, value, "rcx");
+                }
+                std::string addr_text;
+                if (addr.reg >= 0) {
+                    addr_text = stack_registers[addr.reg].q;
+                }
+                else {
+                    out_file << "    mov rax, " << addr.constant << "\n";
+                    addr_text = "rax";
+                }
+                out_file << "    mov " << (byte ? "BYTE [" : "QWORD [") << addr_text << "], "
+                    << value_text << "\n";
+                pending.resize(pending.size() - 2);
+            }
+            return true;
+
+        default:
+            break;
+    }
+
+    // binary ops and comparisons, folded when both operands are constants
+    const OpInfo &info = op_info(op_type);
+    if (info.fold == nullptr) {
+        return false;
+    }
+    out_file << "    ;; " << info.name << "\n";
+    ensure_pending(out_file, state, 2);
+    PendingValue a = pending[pending.size() - 1];
+    PendingValue b = pending[pending.size() - 2];
+    bool division = info.divides;
+
+    if (a.reg < 0 && b.reg < 0 && !(division && a.constant == 0)) {
+        pending.pop_back();
+        pending.back() = PendingValue{-1, info.fold(b.constant, a.constant)};
+        return true;
+    }
+
+    int reg = writable_register(out_file, state, 2, 2);
+    const char *dst = stack_registers[reg].q;
+    if (info.asm_condition != nullptr) {
+        std::string src = source_operand(out_file, a, "rcx");
+        out_file << "    cmp " << dst << ", " << src << "\n";
+        out_file << "    set" << info.asm_condition << " al\n";
+        out_file << "    movzx " << stack_registers[reg].d << ", al\n";
+    }
+    else if (info.asm_instr != nullptr) {
+        std::string src = source_operand(out_file, a, "rax");
+        out_file << "    " << info.asm_instr << " " << dst << ", " << src << "\n";
+    }
+    else if (a.reg < 0 && !(division && a.constant == 0)) {
+        if (op_type == Operations::OP_MULTIPLY) {
+            add_multiply_constant_asm(out_file, a.constant, dst);
+        }
+        else if (division) {
+            out_file << "    mov rax, " << dst << "\n";
+            add_arithmetic_constant_asm(out_file, op_type, a.constant);
+            out_file << "    mov " << dst << ", rax\n";
+        }
+        else if ((a.constant & 63) != 0) {
+            out_file << (op_type == Operations::OP_SHIFT_LEFT ? "    shl " : "    shr ")
+                << dst << ", " << (a.constant & 63) << "\n";
+        }
+    }
+    else if (op_type == Operations::OP_MULTIPLY) {
+        out_file << "    imul " << dst << ", " << stack_registers[a.reg].q << "\n";
+    }
+    else {
+        out_file << "    mov rcx, " << source_operand(out_file, a, "rcx") << "\n";
+        if (division) {
+            out_file << "    mov rax, " << dst << "\n";
+            add_arithmetic_asm(out_file, op_type);
+            out_file << "    mov " << dst << ", rax\n";
+        }
+        else {
+            out_file << (op_type == Operations::OP_SHIFT_LEFT ? "    shl " : "    shr ")
+                << dst << ", cl\n";
+        }
+    }
+    pending.pop_back();
+    pending.back() = PendingValue{reg, 0};
+    return true;
+}
+
+
+// rax = rax op rcx, clobbers rdx
+void add_arithmetic_asm(std::ofstream& out_file, Operations op_type) {
+    switch (op_type) {
+        case Operations::OP_PLUS:
+            out_file << "    add rax, rcx\n";
+            break;
+        case Operations::OP_MULTIPLY:
+            out_file << "    imul rax, rcx\n";
+            break;
+        case Operations::OP_DIVIDE:
+        case Operations::OP_MODULO:
+            out_file << "    test rcx, rcx\n";
+            out_file << "    jz division_by_zero\n";
+            out_file << "    xor edx, edx\n";
+            out_file << "    div rcx\n";
+            if (op_type == Operations::OP_MODULO) {
+                out_file << "    mov rax, rdx\n";
+            }
+            break;
+        case Operations::OP_BIT_AND:
+            out_file << "    and rax, rcx\n";
+            break;
+        case Operations::OP_BIT_OR:
+            out_file << "    or rax, rcx\n";
+            break;
+        case Operations::OP_BIT_XOR:
+            out_file << "    xor rax, rcx\n";
+            break;
+        case Operations::OP_SHIFT_LEFT:
+            out_file << "    shl rax, cl\n";
+            break;
+        case Operations::OP_SHIFT_RIGHT:
+            out_file << "    shr rax, cl\n";
+            break;
+        default:
+            assert(false && "not an arithmetic op");
+    }
+}
+
+
+// Multiplies reg by a constant, clobbering rdx: shifts and lea for
+// 2^k * {1, 3, 5, 9, 3*3, ..., 9*9, 2^j+1, 2^j-1}, imul otherwise.
+void add_multiply_constant_asm(std::ofstream& out_file, uint64_t constant,
+        const std::string &reg) {
+    if (constant == 0) {
+        out_file << "    xor " << reg << ", " << reg << "\n";
+        return;
+    }
+    int shift = __builtin_ctzll(constant);
+    uint64_t odd = constant >> shift;
+    auto is_lea_factor = [](uint64_t f) { return f == 3 || f == 5 || f == 9; };
+    auto lea = [&](uint64_t f) {
+        out_file << "    lea " << reg << ", [" << reg << "+" << reg << "*" << f - 1 << "]\n";
+    };
+
+    if (odd == 1) {
+    }
+    else if (is_lea_factor(odd)) {
+        lea(odd);
+    }
+    else if (odd % 3 == 0 && is_lea_factor(odd / 3)) {
+        lea(3);
+        lea(odd / 3);
+    }
+    else if (odd % 5 == 0 && is_lea_factor(odd / 5)) {
+        lea(5);
+        lea(odd / 5);
+    }
+    else if (odd == 81) {
+        lea(9);
+        lea(9);
+    }
+    else if (is_power_of_two(odd - 1) || is_power_of_two(odd + 1)) {
+        bool plus = is_power_of_two(odd - 1);
+        out_file << "    mov rdx, " << reg << "\n";
+        out_file << "    shl " << reg << ", " << __builtin_ctzll(plus ? odd - 1 : odd + 1) << "\n";
+        out_file << (plus ? "    add " : "    sub ") << reg << ", rdx\n";
+    }
+    else if (fits_imm32(constant)) {
+        out_file << "    imul " << reg << ", " << reg << ", " << constant << "\n";
+        return;
+    }
+    else {
+        out_file << "    mov rdx, " << constant << "\n";
+        out_file << "    imul " << reg << ", rdx\n";
+        return;
+    }
+    if (shift > 0) {
+        out_file << "    shl " << reg << ", " << shift << "\n";
+    }
+}
+
+
+__extension__ typedef unsigned __int128 uint128;
+
+// Finds m < 2^64 and s with n / d == (n * m) >> (64 + s) for every n below
+// 2^precision: m = ceil(2^(64+s) / d) is exact when its error
+// m * d - 2^(64+s) is at most 2^(64+s-precision).
+static bool find_division_magic(uint64_t d, int precision, uint64_t &m, int &s) {
+    for (s = 0; s < 64; ++s) {
+        uint128 p = static_cast<uint128>(1) << (64 + s);
+        uint128 magic = (p + d - 1) / d;
+        if (magic >> 64) {
+            return false;
+        }
+        if (magic * d - p <= static_cast<uint128>(1) << (64 + s - precision)) {
+            m = static_cast<uint64_t>(magic);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// rax = rax / d with a multiplication by a reciprocal like dump's /100,
+// keeps the dividend in rsi and clobbers rcx and rdx. Divisors whose
+// reciprocal needs 65 bits are pre-shifted when even, otherwise the high
+// bit is added back with the (n - t) / 2 + t trick.
+static void add_divide_constant_asm(std::ofstream& out_file, uint64_t d) {
+    out_file << "    mov rsi, rax\n";
+    if (is_power_of_two(d)) {
+        if (d > 1) {
+            out_file << "    shr rax, " << __builtin_ctzll(d) << "\n";
+        }
+        return;
+    }
+    if (d > (1ull << 63)) {
+        // the quotient is 0 or 1
+        out_file << "    mov rcx, " << d << "\n";
+        out_file << "    xor eax, eax\n";
+        out_file << "    cmp rsi, rcx\n";
+        out_file << "    setae al\n";
+        return;
+    }
+
+    uint64_t m;
+    int s;
+    int pre_shift = __builtin_ctzll(d);
+    if (find_division_magic(d, 64, m, s)) {
+        pre_shift = 0;
+    }
+    else if (pre_shift == 0 || !find_division_magic(d >> pre_shift, 64 - pre_shift, m, s)) {
+        int l = 64 - __builtin_clzll(d);
+        uint128 magic = ((static_cast<uint128>(1) << (64 + l)) + d - 1) / d;
+        out_file << "    mov rcx, " << static_cast<uint64_t>(magic) << "\n";
+        out_file << "    mul rcx\n";
+        out_file << "    mov rax, rsi\n";
+        out_file << "    sub rax, rdx\n";
+        out_file << "    shr rax, 1\n";
+        out_file << "    add rax, rdx\n";
+        out_file << "    shr rax, " << l - 1 << "\n";
+        return;
+    }
+    if (pre_shift > 0) {
+        out_file << "    shr rax, " << pre_shift << "\n";
+    }
+    out_file << "    mov rcx, " << m << "\n";
+    out_file << "    mul rcx\n";
+    out_file << "    mov rax, rdx\n";
+    if (s > 0) {
+        out_file << "    shr rax, " << s << "\n";
+    }
+}
+
+
+// rax = rax op constant, clobbers rcx, rdx and rsi. The constant is
+// never 0 for division and modulo.
+void add_arithmetic_constant_asm(std::ofstream& out_file, Operations op_type,
+        uint64_t constant) {
+    switch (op_type) {
+        case Operations::OP_MULTIPLY:
+            add_multiply_constant_asm(out_file, constant, "rax");
+            break;
+        case Operations::OP_DIVIDE:
+            add_divide_constant_asm(out_file, constant);
+            break;
+        case Operations::OP_MODULO:
+            if (is_power_of_two(constant)) {
+                add_arithmetic_constant_asm(out_file, Operations::OP_BIT_AND, constant - 1);
+            }
+            else {
+                add_divide_constant_asm(out_file, constant);
+                add_multiply_constant_asm(out_file, constant, "rax");
+                out_file << "    sub rsi, rax\n";
+                out_file << "    mov rax, rsi\n";
+            }
+            break;
+        case Operations::OP_BIT_AND:
+        case Operations::OP_BIT_OR:
+        case Operations::OP_BIT_XOR:
+            {
+                const char *instr = op_info(op_type).asm_instr;
+                if (fits_imm32(constant)) {
+                    out_file << "    " << instr << " rax, " << constant << "\n";
+                }
+                else {
+                    out_file << "    mov rcx, " << constant << "\n";
+                    out_file << "    " << instr << " rax, rcx\n";
+                }
+            }
+            break;
+        case Operations::OP_SHIFT_LEFT:
+        case Operations::OP_SHIFT_RIGHT:
+            if ((constant & 63) != 0) {
+                out_file << (op_type == Operations::OP_SHIFT_LEFT ? "    shl rax, " : "    shr rax, ")
+                    << (constant & 63) << "\n";
+            }
+            break;
+        default:
+            assert(false && "not an arithmetic op");
+    }
+}
+
+
+// Blocks are counted with --profile-generate, in the order of
+// state.blocks. Every block starts at a label or right after a conditional
+// jump, where the flags are dead, so a single inc does, locked in the
+// body of a parallel loop.
+void add_block_counter_asm(std::ofstream& out_file, const Options &options,
+        CodegenState &state, const Operation *op, const char *kind) {
+    if (!options.profile_generate) {
+        return;
+    }
+    state.blocks.push_back({op ? op->line() : 0, op ? op->col() : 0, kind});
+    out_file << (state.in_parallel ? "    lock inc QWORD" : "    inc     QWORD")
+        << " [block_counters+" << (state.blocks.size() - 1) * 8 << "]\n";
+}
+
+
+// Charges the block starting at program[ip] to r14 under --budget and
+// --deadline. Loop heads and procedure entries, which any long run keeps
+// coming back to, also stop the program once r14 went negative.
+void add_meter_asm(std::ofstream& out_file, CodegenState &state, uint64_t ip, bool check) {
+    if (state.block_costs.empty() || state.block_costs[ip] == 0) {
+        return;
+    }
+    out_file << "    sub r14, " << state.block_costs[ip] << "\n";
+    if (check) {
+        out_file << "    js meter" << ip << "\n";
+        // parallel bodies run on a data stack of their own and come back
+        // here with the ops they claimed
+        if (state.in_parallel) {
+            out_file << "meter" << ip << "_resume:\n";
+        }
+        state.meter_sites.push_back({ip,
+                state.in_parallel ? state.mock_stack_size : UNKNOWN_STACK_DEPTH,
+                state.in_parallel});
+    }
+}
+
+
+// Flushes pending output and exits with zero, the end of every program
+void add_exit_asm(std::ofstream& out_file, const Options &options) {
+    out_file << "    ;; returning from function with zero exit code\n";
+    out_file << "    call flush_output\n";
+    if (options.profile_generate) {
+        out_file << "    call write_block_profile\n";
+    }
+    out_file << "    mov rax, 60\n";
+    out_file << "    mov rdi, 0\n";
+    out_file << "    syscall\n";
+    out_file << "    ret\n";
+}
+
+
+// Helper funtion for echoing the command being
+// executed.
+void exec(const std::string cmd) {
+    std::cout << "Exec: " << cmd << '\n';
+    if (std::system(cmd.c_str()) != 0) {
+        std::cerr << "ERROR: Failed executing " << cmd << '\n';
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void print_error(const std::string& program_file_name, const int line_num,
+        const int col, const std::string msg) {
+    std::cerr << program_file_name << ':' << line_num << ':'
+        << col << ": ERROR: " << msg << '\n';
+}
+
+
+// Size of the region mapped for every parallel worker, see add_parallel_runtime_asm()
+static constexpr uint64_t parallel_region_size() {
+    return 2 * PAGE_SIZE + PARALLEL_STACK_SIZE * 8 + SIGNAL_STACK_SIZE + 16 * PAGE_SIZE;
+}
+
+
+void add_boilerplate_asm(std::ofstream& out_file, const Options &options) {
+    out_file << "global _start\n";
+    out_file << "segment .text\n";
+
+    // Prints rdi as an unsigned integer followed by a new line. The digit
+    // count is computed up front from the highest set bit, then pairs of
+    // digits are stored back to front straight into output_buffer, using a
+    // reciprocal multiplication for /100 and the digit_pairs table.
+    out_file << "dump:\n";
+    out_file << "    mov     rcx, rdi\n";
+    out_file << "    or      rcx, 1\n";
+    out_file << "    bsr     rax, rcx\n";
+    out_file << "    inc     eax\n";
+    out_file << "    imul    eax, eax, 1233\n";
+    out_file << "    shr     eax, 12\n";
+    out_file << "    cmp     rcx, QWORD [pow10+rax*8]\n";
+    out_file << "    sbb     rax, -1\n";
+    out_file << "    mov     rsi, QWORD [output_len]\n";
+    out_file << "    lea     rcx, [output_buffer+rsi+rax]\n";
+    out_file << "    lea     rsi, [rsi+rax+1]\n";
+    out_file << "    mov     QWORD [output_len], rsi\n";
+    out_file << "    mov     BYTE [rcx], 10\n";
+    out_file << "    mov     r8, 0x28f5c28f5c28f5c3\n";
+    out_file << "    cmp     rdi, 100\n";
+    out_file << "    jb      .tail\n";
+    out_file << ".pairs:\n";
+    out_file << "    mov     rax, rdi\n";
+    out_file << "    shr     rax, 2\n";
+    out_file << "    mul     r8\n";
+    out_file << "    shr     rdx, 2\n";
+    out_file << "    imul    rax, rdx, 100\n";
+    out_file << "    sub     rdi, rax\n";
+    out_file << "    movzx   eax, WORD [digit_pairs+rdi*2]\n";
+    out_file << "    sub     rcx, 2\n";
+    out_file << "    mov     WORD [rcx], ax\n";
+    out_file << "    mov     rdi, rdx\n";
+    out_file << "    cmp     rdi, 100\n";
+    out_file << "    jae     .pairs\n";
+    out_file << ".tail:\n";
+    out_file << "    cmp     edi, 10\n";
+    out_file << "    jb      .single\n";
+    out_file << "    movzx   eax, WORD [digit_pairs+rdi*2]\n";
+    out_file << "    mov     WORD [rcx-2], ax\n";
+    out_file << "    jmp     .written\n";
+    out_file << ".single:\n";
+    out_file << "    add     edi, 48\n";
+    out_file << "    mov     BYTE [rcx-1], dil\n";
+    out_file << ".written:\n";
+    if (options.buffered_output) {
+        // keep room for the longest number and its new line
+        out_file << "    cmp     rsi, " << OUTPUT_BUFFER_SIZE - 21 << "\n";
+        out_file << "    jae     flush_output\n";
+        out_file << "    ret\n";
+    }
+
+    // Writes out whatever is pending in output_buffer
+    out_file << "flush_output:\n";
+    out_file << "    mov     rdx, QWORD [output_len]\n";
+    out_file << "    test    rdx, rdx\n";
+    out_file << "    jz      .empty\n";
+    out_file << "    mov     eax, 1\n";
+    out_file << "    mov     rdi, QWORD [output_fd]\n";
+    out_file << "    mov     rsi, output_buffer\n";
+    out_file << "    syscall\n";
+    out_file << "    mov     QWORD [output_len], 0\n";
+    out_file << ".empty:\n";
+    out_file << "    ret\n";
+
+    // Prints the string at rsi of length rdx. Without --buffered-output,
+    // and for strings too long for the buffer, with a single write straight
+    // from .rodata.
+    out_file << "write_string:\n";
+    if (options.buffered_output) {
+        out_file << "    mov     rax, QWORD [output_len]\n";
+        out_file << "    lea     rcx, [rax+rdx]\n";
+        out_file << "    cmp     rcx, " << OUTPUT_BUFFER_SIZE - 21 << "\n";
+        out_file << "    jb      .copy\n";
+        out_file << "    push    rsi\n";
+        out_file << "    push    rdx\n";
+        out_file << "    call    flush_output\n";
+        out_file << "    pop     rdx\n";
+        out_file << "    pop     rsi\n";
+        out_file << "    cmp     rdx, " << OUTPUT_BUFFER_SIZE - 21 << "\n";
+        out_file << "    jae     .direct\n";
+        out_file << "    xor     eax, eax\n";
+        out_file << ".copy:\n";
+        out_file << "    lea     rdi, [output_buffer+rax]\n";
+        out_file << "    lea     rcx, [rax+rdx]\n";
+        out_file << "    mov     QWORD [output_len], rcx\n";
+        out_file << "    mov     rcx, rdx\n";
+        out_file << "    rep movsb\n";
+        out_file << "    ret\n";
+        out_file << ".direct:\n";
+    }
+    out_file << "    mov     eax, 1\n";
+    out_file << "    mov     rdi, QWORD [output_fd]\n";
+    out_file << "    syscall\n";
+    out_file << "    ret\n";
+
+    add_input_runtime_asm(out_file);
+
+    // Reads CL_STACK_SIZE from envp (rdi) and returns the data stack
+    // capacity in cells in rax, falling back to the compile time size.
+    out_file << "data_stack_size:\n";
+    out_file << "    mov     rax, " << options.stack_size << "\n";
+    out_file << ".next_env:\n";
+    out_file << "    mov     rsi, QWORD [rdi]\n";
+    out_file << "    test    rsi, rsi\n";
+    out_file << "    jz      .done\n";
+    out_file << "    add     rdi, 8\n";
+    out_file << "    mov     rdx, env_stack_size\n";
+    out_file << "    xor     ecx, ecx\n";
+    out_file << ".match:\n";
+    out_file << "    movzx   r8d, BYTE [rdx+rcx]\n";
+    out_file << "    test    r8d, r8d\n";
+    out_file << "    jz      .parse\n";
+    out_file << "    cmp     r8b, BYTE [rsi+rcx]\n";
+    out_file << "    jne     .next_env\n";
+    out_file << "    inc     rcx\n";
+    out_file << "    jmp     .match\n";
+    out_file << ".parse:\n";
+    out_file << "    add     rsi, rcx\n";
+    out_file << "    xor     r9d, r9d\n";
+    out_file << ".digit:\n";
+    out_file << "    movzx   r8d, BYTE [rsi]\n";
+    out_file << "    sub     r8d, 48\n";
+    out_file << "    cmp     r8d, 9\n";
+    out_file << "    ja      .parsed\n";
+    out_file << "    imul    r9, r9, 10\n";
+    out_file << "    add     r9, r8\n";
+    out_file << "    inc     rsi\n";
+    out_file << "    jmp     .digit\n";
+    out_file << ".parsed:\n";
+    out_file << "    test    r9, r9\n";
+    out_file << "    cmovnz  rax, r9\n";
+    out_file << ".done:\n";
+    out_file << "    ret\n";
+
+    // Maps rax cells between two PROT_NONE guard pages and returns the top
+    // of the region in rax. The data stack grows down from there.
+    out_file << "map_data_stack:\n";
+    out_file << "    lea     rsi, [rax*8+" << (PAGE_SIZE - 1) + 2 * PAGE_SIZE << "]\n";
+    out_file << "    and     rsi, -" << PAGE_SIZE << "\n";
+    out_file << "    push    rsi\n";
+    out_file << "    mov     eax, 9\n";
+    out_file << "    xor     edi, edi\n";
+    out_file << "    mov     edx, 3\n";                 // PROT_READ | PROT_WRITE
+    out_file << "    mov     r10d, 0x4022\n";           // MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+    out_file << "    mov     r8, -1\n";
+    out_file << "    xor     r9d, r9d\n";
+    out_file << "    syscall\n";
+    out_file << "    cmp     rax, -4095\n";
+    out_file << "    jae     .failed\n";
+    out_file << "    mov     QWORD [data_stack_base], rax\n";
+    out_file << "    pop     rsi\n";
+    out_file << "    add     rsi, rax\n";
+    out_file << "    sub     rsi, " << PAGE_SIZE << "\n";
+    out_file << "    mov     QWORD [data_stack_top], rsi\n";
+    out_file << "    mov     rdi, rax\n";
+    out_file << "    mov     esi, " << PAGE_SIZE << "\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    mov     eax, 10\n";
+    out_file << "    syscall\n";
+    out_file << "    mov     rdi, QWORD [data_stack_top]\n";
+    out_file << "    mov     esi, " << PAGE_SIZE << "\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    mov     eax, 10\n";
+    out_file << "    syscall\n";
+    out_file << "    mov     rax, QWORD [data_stack_top]\n";
+    out_file << "    ret\n";
+    out_file << ".failed:\n";
+    out_file << "    mov     rsi, msg_stack_map\n";
+    out_file << "    mov     edx, msg_stack_map_len\n";
+    out_file << "    jmp     runtime_error\n";
+
+    // SIGSEGV handler, running on its own signal stack. Faults inside the
+    // guard pages are reported as data stack overflow/underflow.
+    out_file << "segv_handler:\n";
+    out_file << "    mov     rax, QWORD [rsi+16]\n";   // siginfo_t.si_addr
+    out_file << "    mov     rcx, QWORD [data_stack_base]\n";
+    out_file << "    mov     rdx, rax\n";
+    out_file << "    sub     rdx, rcx\n";
+    out_file << "    cmp     rdx, " << PAGE_SIZE << "\n";
+    out_file << "    jb      .overflow\n";
+    out_file << "    mov     rdx, rax\n";
+    out_file << "    sub     rdx, QWORD [data_stack_top]\n";
+    out_file << "    cmp     rdx, " << PAGE_SIZE << "\n";
+    out_file << "    jb      .underflow\n";
+    // the guard pages of the parallel workers, see add_parallel_runtime_asm()
+    out_file << "    sub     rax, QWORD [parallel_stacks]\n";
+    out_file << "    cmp     rax, QWORD [parallel_stacks_size]\n";
+    out_file << "    jae     .other\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    mov     ecx, " << parallel_region_size() << "\n";
+    out_file << "    div     rcx\n";
+    out_file << "    cmp     rdx, " << PAGE_SIZE << "\n";
+    out_file << "    jb      .overflow\n";
+    out_file << "    sub     rdx, " << PAGE_SIZE + PARALLEL_STACK_SIZE * 8 << "\n";
+    out_file << "    cmp     rdx, " << PAGE_SIZE << "\n";
+    out_file << "    jb      .underflow\n";
+    out_file << ".other:\n";
+    out_file << "    mov     rsi, msg_segv\n";
+    out_file << "    mov     edx, msg_segv_len\n";
+    out_file << "    jmp     runtime_error\n";
+    out_file << ".overflow:\n";
+    out_file << "    mov     rsi, msg_stack_overflow\n";
+    out_file << "    mov     edx, msg_stack_overflow_len\n";
+    out_file << "    jmp     runtime_error\n";
+    out_file << ".underflow:\n";
+    out_file << "    mov     rsi, msg_stack_underflow\n";
+    out_file << "    mov     edx, msg_stack_underflow_len\n";
+
+    // Writes the message in rsi/rdx to stderr and exits with status 1, from
+    // any thread
+    out_file << "runtime_error:\n";
+    out_file << "    push    rsi\n";
+    out_file << "    push    rdx\n";
+    out_file << "    call    flush_output\n";
+    out_file << "    pop     rdx\n";
+    out_file << "    pop     rsi\n";
+    out_file << "    mov     eax, 1\n";
+    out_file << "    mov     edi, 2\n";
+    out_file << "    syscall\n";
+    out_file << "    mov     eax, 231\n";             // exit_group, stops every worker
+    out_file << "    mov     edi, 1\n";
+    out_file << "    syscall\n";
+
+    out_file << "division_by_zero:\n";
+    out_file << "    mov     rsi, msg_division_by_zero\n";
+    out_file << "    mov     edx, msg_division_by_zero_len\n";
+    out_file << "    jmp     runtime_error\n";
+
+    add_memory_kernels_asm(out_file);
+    add_parallel_runtime_asm(out_file, options);
+
+    out_file << "signal_restorer:\n";
+    out_file << "    mov     eax, 15\n";               // rt_sigreturn
+    out_file << "    syscall\n";
+
+    out_file << "_start:\n";
+    // envp starts after argc, argv and argv's NULL terminator
+    out_file << "    mov     rax, QWORD [rsp]\n";
+    out_file << "    lea     rdi, [rsp+rax*8+16]\n";
+    out_file << "    call    data_stack_size\n";
+    out_file << "    call    map_data_stack\n";
+    out_file << "    push    rax\n";
+    out_file << "    call    select_mem_kernels\n";
+    out_file << "    pop     rax\n";
+    out_file << "    push    rax\n";
+    out_file << "    mov     eax, 131\n";              // sigaltstack
+    out_file << "    mov     rdi, signal_stack_desc\n";
+    out_file << "    xor     esi, esi\n";
+    out_file << "    syscall\n";
+    out_file << "    mov     eax, 13\n";               // rt_sigaction(SIGSEGV)
+    out_file << "    mov     edi, 11\n";
+    out_file << "    mov     rsi, segv_action\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    mov     r10d, 8\n";
+    out_file << "    syscall\n";
+    if (is_metered(options)) {
+        // ops left to run, see add_meter_asm()
+        out_file << "    mov     r14, " << std::min<uint64_t>(
+                options.budget != 0 ? options.budget : INT64_MAX, INT64_MAX) << "\n";
+    }
+    if (options.deadline_ms != 0) {
+        out_file << "    mov     eax, 13\n";           // rt_sigaction(SIGALRM)
+        out_file << "    mov     edi, 14\n";
+        out_file << "    mov     rsi, meter_alarm_action\n";
+        out_file << "    xor     edx, edx\n";
+        out_file << "    mov     r10d, 8\n";
+        out_file << "    syscall\n";
+        out_file << "    mov     eax, 38\n";           // setitimer(ITIMER_REAL)
+        out_file << "    xor     edi, edi\n";
+        out_file << "    mov     rsi, meter_timer\n";
+        out_file << "    xor     edx, edx\n";
+        out_file << "    syscall\n";
+    }
+    out_file << "    pop     rax\n";
+    // rsp is the data stack register from here on, every stack operation
+    // stays a single push/pop. The native stack is kept in rbp.
+    out_file << "    mov     rbp, rsp\n";
+    out_file << "    mov     rsp, rax\n";
+}
+
+
+// Buffered stdin for readint and readbyte, input_buffer is refilled with a
+// single read syscall once input_pos reaches input_len.
+void add_input_runtime_asm(std::ofstream& out_file) {
+    // Returns rsi = 0 and r8 = bytes read, 0 at the end of input or on
+    // error. Preserves rax and rdi.
+    out_file << "refill_input:\n";
+    out_file << "    push    rax\n";
+    out_file << "    push    rdi\n";
+    out_file << ".again:\n";
+    out_file << "    xor     eax, eax\n";
+    out_file << "    xor     edi, edi\n";
+    out_file << "    mov     rsi, input_buffer\n";
+    out_file << "    mov     edx, " << INPUT_BUFFER_SIZE << "\n";
+    out_file << "    syscall\n";
+    out_file << "    cmp     rax, -4\n";               // EINTR
+    out_file << "    je      .again\n";
+    out_file << "    xor     r8d, r8d\n";
+    out_file << "    test    rax, rax\n";
+    out_file << "    cmovns  r8, rax\n";
+    out_file << "    mov     QWORD [input_len], r8\n";
+    out_file << "    xor     esi, esi\n";
+    out_file << "    pop     rdi\n";
+    out_file << "    pop     rax\n";
+    out_file << "    ret\n";
+
+    // Skips to the next digit and parses an unsigned decimal number into
+    // rax, leaving the byte after it unread. rdx = 1, or 0 at end of input.
+    out_file << "read_int:\n";
+    out_file << "    mov     rsi, QWORD [input_pos]\n";
+    out_file << "    mov     r8, QWORD [input_len]\n";
+    out_file << ".skip:\n";
+    out_file << "    cmp     rsi, r8\n";
+    out_file << "    jb      .skip_byte\n";
+    out_file << "    call    refill_input\n";
+    out_file << "    test    r8, r8\n";
+    out_file << "    jz      .eof\n";
+    out_file << ".skip_byte:\n";
+    out_file << "    movzx   eax, BYTE [input_buffer+rsi]\n";
+    out_file << "    inc     rsi\n";
+    out_file << "    sub     eax, 48\n";
+    out_file << "    cmp     eax, 9\n";
+    out_file << "    ja      .skip\n";
+    out_file << ".digits:\n";
+    out_file << "    cmp     rsi, r8\n";
+    out_file << "    jb      .digit\n";
+    out_file << "    call    refill_input\n";
+    out_file << "    test    r8, r8\n";
+    out_file << "    jz      .done\n";
+    out_file << ".digit:\n";
+    out_file << "    movzx   ecx, BYTE [input_buffer+rsi]\n";
+    out_file << "    sub     ecx, 48\n";
+    out_file << "    cmp     ecx, 9\n";
+    out_file << "    ja      .done\n";
+    out_file << "    inc     rsi\n";
+    out_file << "    lea     rax, [rax+rax*4]\n";
+    out_file << "    lea     rax, [rcx+rax*2]\n";
+    out_file << "    jmp     .digits\n";
+    out_file << ".done:\n";
+    out_file << "    mov     QWORD [input_pos], rsi\n";
+    out_file << "    mov     edx, 1\n";
+    out_file << "    ret\n";
+    out_file << ".eof:\n";
+    out_file << "    mov     QWORD [input_pos], rsi\n";
+    out_file << "    xor     eax, eax\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    ret\n";
+
+    // Returns the next byte in rax, rdx = 1, or 0 at end of input
+    out_file << "read_byte:\n";
+    out_file << "    mov     rsi, QWORD [input_pos]\n";
+    out_file << "    cmp     rsi, QWORD [input_len]\n";
+    out_file << "    jb      .have\n";
+    out_file << "    call    refill_input\n";
+    out_file << "    test    r8, r8\n";
+    out_file << "    jz      .eof\n";
+    out_file << ".have:\n";
+    out_file << "    movzx   eax, BYTE [input_buffer+rsi]\n";
+    out_file << "    inc     rsi\n";
+    out_file << "    mov     QWORD [input_pos], rsi\n";
+    out_file << "    mov     edx, 1\n";
+    out_file << "    ret\n";
+    out_file << ".eof:\n";
+    out_file << "    mov     QWORD [input_pos], rsi\n";
+    out_file << "    xor     eax, eax\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    ret\n";
+}
+
+
+// SSE2 and AVX2 kernels for the bulk memory operations, called through the
+// mem_*_impl pointers that select_mem_kernels sets at startup.
+//   mem_fill(rdi = addr, rsi = count, dl = byte)
+//   mem_copy(rdi = src, rsi = dst, rdx = count), overlapping ranges allowed
+//   mem_sum(rdi = addr, rsi = words) -> rax
+//   mem_eq(rdi = a, rsi = b, rdx = count) -> rax
+void add_memory_kernels_asm(std::ofstream& out_file) {
+    // Uses the AVX2 kernels when the CPU has AVX2 and the OS saves ymm state
+    out_file << "select_mem_kernels:\n";
+    out_file << "    mov     eax, 1\n";
+    out_file << "    cpuid\n";
+    out_file << "    and     ecx, 0x18000000\n";       // OSXSAVE | AVX
+    out_file << "    cmp     ecx, 0x18000000\n";
+    out_file << "    jne     .done\n";
+    out_file << "    xor     ecx, ecx\n";
+    out_file << "    xgetbv\n";
+    out_file << "    and     eax, 6\n";
+    out_file << "    cmp     eax, 6\n";
+    out_file << "    jne     .done\n";
+    out_file << "    mov     eax, 7\n";
+    out_file << "    xor     ecx, ecx\n";
+    out_file << "    cpuid\n";
+    out_file << "    test    ebx, 32\n";
+    out_file << "    jz      .done\n";
+    for (const char *kernel : {"fill", "copy", "sum", "eq"}) {
+        out_file << "    mov     rax, mem_" << kernel << "_avx2\n";
+        out_file << "    mov     QWORD [mem_" << kernel << "_impl], rax\n";
+    }
+    out_file << ".done:\n";
+    out_file << "    ret\n";
+
+    for (int avx2 = 0; avx2 <= 1; ++avx2) {
+        const char *suffix = avx2 ? "_avx2" : "_sse2";
+        const char *vec = avx2 ? "ymm" : "xmm";
+        int width = avx2 ? 32 : 16;
+
+        out_file << "mem_fill" << suffix << ":\n";
+        out_file << "    movzx   eax, dl\n";
+        out_file << "    mov     rcx, 0x0101010101010101\n";
+        out_file << "    imul    rax, rcx\n";
+        if (avx2) {
+            out_file << "    vmovq   xmm0, rax\n";
+            out_file << "    vpbroadcastq ymm0, xmm0\n";
+        }
+        else {
+            out_file << "    movq    xmm0, rax\n";
+            out_file << "    punpcklqdq xmm0, xmm0\n";
+        }
+        out_file << ".block:\n";
+        out_file << "    cmp     rsi, " << width << "\n";
+        out_file << "    jb      .tail\n";
+        out_file << "    " << (avx2 ? "vmovdqu" : "movdqu ") << " [rdi], " << vec << "0\n";
+        out_file << "    add     rdi, " << width << "\n";
+        out_file << "    sub     rsi, " << width << "\n";
+        out_file << "    jmp     .block\n";
+        out_file << ".tail:\n";
+        if (avx2) {
+            out_file << "    vzeroupper\n";
+        }
+        out_file << "    test    rsi, rsi\n";
+        out_file << "    jz      .done\n";
+        out_file << "    mov     BYTE [rdi], al\n";
+        out_file << "    inc     rdi\n";
+        out_file << "    dec     rsi\n";
+        out_file << "    jmp     .tail\n";
+        out_file << ".done:\n";
+        out_file << "    ret\n";
+
+        // copies backwards when dst lies inside [src, src + count)
+        out_file << "mem_copy" << suffix << ":\n";
+        out_file << "    mov     rax, rsi\n";
+        out_file << "    sub     rax, rdi\n";
+        out_file << "    cmp     rax, rdx\n";
+        out_file << "    jb      mem_copy_backward\n";
+        out_file << ".block:\n";
+        out_file << "    cmp     rdx, " << width << "\n";
+        out_file << "    jb      .tail\n";
+        out_file << "    " << (avx2 ? "vmovdqu" : "movdqu ") << " " << vec << "0, [rdi]\n";
+        out_file << "    " << (avx2 ? "vmovdqu" : "movdqu ") << " [rsi], " << vec << "0\n";
+        out_file << "    add     rdi, " << width << "\n";
+        out_file << "    add     rsi, " << width << "\n";
+        out_file << "    sub     rdx, " << width << "\n";
+        out_file << "    jmp     .block\n";
+        out_file << ".tail:\n";
+        if (avx2) {
+            out_file << "    vzeroupper\n";
+        }
+        out_file << "    test    rdx, rdx\n";
+        out_file << "    jz      .done\n";
+        out_file << "    mov     al, BYTE [rdi]\n";
+        out_file << "    mov     BYTE [rsi], al\n";
+        out_file << "    inc     rdi\n";
+        out_file << "    inc     rsi\n";
+        out_file << "    dec     rdx\n";
+        out_file << "    jmp     .tail\n";
+        out_file << ".done:\n";
+        out_file << "    ret\n";
+
+        out_file << "mem_sum" << suffix << ":\n";
+        if (avx2) {
+            out_file << "    vpxor   ymm0, ymm0, ymm0\n";
+            out_file << ".block:\n";
+            out_file << "    cmp     rsi, 4\n";
+            out_file << "    jb      .reduce\n";
+            out_file << "    vpaddq  ymm0, ymm0, [rdi]\n";
+            out_file << "    add     rdi, 32\n";
+            out_file << "    sub     rsi, 4\n";
+            out_file << "    jmp     .block\n";
+            out_file << ".reduce:\n";
+            out_file << "    vextracti128 xmm1, ymm0, 1\n";
+            out_file << "    vpaddq  xmm0, xmm0, xmm1\n";
+            out_file << "    vpshufd xmm1, xmm0, 0x4e\n";
+            out_file << "    vpaddq  xmm0, xmm0, xmm1\n";
+            out_file << "    vmovq   rax, xmm0\n";
+            out_file << "    vzeroupper\n";
+        }
+        else {
+            out_file << "    pxor    xmm0, xmm0\n";
+            out_file << ".block:\n";
+            out_file << "    cmp     rsi, 2\n";
+            out_file << "    jb      .reduce\n";
+            out_file << "    movdqu  xmm1, [rdi]\n";
+            out_file << "    paddq   xmm0, xmm1\n";
+            out_file << "    add     rdi, 16\n";
+            out_file << "    sub     rsi, 2\n";
+            out_file << "    jmp     .block\n";
+            out_file << ".reduce:\n";
+            out_file << "    pshufd  xmm1, xmm0, 0x4e\n";
+            out_file << "    paddq   xmm0, xmm1\n";
+            out_file << "    movq    rax, xmm0\n";
+        }
+        out_file << ".tail:\n";
+        out_file << "    test    rsi, rsi\n";
+        out_file << "    jz      .done\n";
+        out_file << "    add     rax, QWORD [rdi]\n";
+        out_file << "    add     rdi, 8\n";
+        out_file << "    dec     rsi\n";
+        out_file << "    jmp     .tail\n";
+        out_file << ".done:\n";
+        out_file << "    ret\n";
+
+        out_file << "mem_eq" << suffix << ":\n";
+        out_file << ".block:\n";
+        out_file << "    cmp     rdx, " << width << "\n";
+        out_file << "    jb      .tail\n";
+        if (avx2) {
+            out_file << "    vmovdqu ymm0, [rdi]\n";
+            out_file << "    vpcmpeqb ymm0, ymm0, [rsi]\n";
+            out_file << "    vpmovmskb eax, ymm0\n";
+            out_file << "    cmp     eax, -1\n";
+        }
+        else {
+            out_file << "    movdqu  xmm0, [rdi]\n";
+            out_file << "    movdqu  xmm1, [rsi]\n";
+            out_file << "    pcmpeqb xmm0, xmm1\n";
+            out_file << "    pmovmskb eax, xmm0\n";
+            out_file << "    cmp     eax, 0xffff\n";
+        }
+        out_file << "    jne     .differ\n";
+        out_file << "    add     rdi, " << width << "\n";
+        out_file << "    add     rsi, " << width << "\n";
+        out_file << "    sub     rdx, " << width << "\n";
+        out_file << "    jmp     .block\n";
+        out_file << ".tail:\n";
+        if (avx2) {
+            out_file << "    vzeroupper\n";
+        }
+        out_file << "    test    rdx, rdx\n";
+        out_file << "    jz      .equal\n";
+        out_file << "    mov     al, BYTE [rdi]\n";
+        out_file << "    cmp     al, BYTE [rsi]\n";
+        out_file << "    jne     .differ\n";
+        out_file << "    inc     rdi\n";
+        out_file << "    inc     rsi\n";
+        out_file << "    dec     rdx\n";
+        out_file << "    jmp     .tail\n";
+        out_file << ".equal:\n";
+        out_file << "    mov     eax, 1\n";
+        out_file << "    ret\n";
+        out_file << ".differ:\n";
+        if (avx2) {
+            out_file << "    vzeroupper\n";
+        }
+        out_file << "    xor     eax, eax\n";
+        out_file << "    ret\n";
+    }
+
+    out_file << "mem_copy_backward:\n";
+    out_file << "    xchg    rdi, rsi\n";
+    out_file << "    lea     rsi, [rsi+rdx-1]\n";
+    out_file << "    lea     rdi, [rdi+rdx-1]\n";
+    out_file << "    mov     rcx, rdx\n";
+    out_file << "    std\n";
+    out_file << "    rep movsb\n";
+    out_file << "    cld\n";
+    out_file << "    ret\n";
+}
 
-    std::ofstream out_file;
-    out_file.open(output_filename + ".asm");
 
-    add_boilerplate_asm(out_file);
+// Threads for parallel loops, started with clone and joined through futex
+// waits on their CLONE_CHILD_CLEARTID word. Every worker has a 64 byte slot
+// in parallel_slots:
+//   +0  next, +8 end   indices not taken yet, updated with cmpxchg16b
+//   +16 partial        reduction of the indices the worker ran
+//   +24 tid            cleared by the kernel when the thread exits
+//   +32 data stack top, +40 native stack top, +48 signal stack
+// and a region of its own mapped on the first parallel loop: a guard page,
+// the data stack, another guard page, the signal stack and the native stack.
+void add_parallel_runtime_asm(std::ofstream& out_file, const Options &options) {
+    constexpr uint64_t data_size = PARALLEL_STACK_SIZE * 8;
+    constexpr uint64_t region_size = parallel_region_size();
+    static_assert(region_size % PAGE_SIZE == 0 && region_size <= 0x7fffffff);
+    static_assert(std::has_single_bit(static_cast<uint64_t>(PARALLEL_CHUNKS_PER_WORKER)));
+
+    // Counts the CPUs the process may run on and maps the worker regions
+    out_file << "parallel_setup:\n";
+    out_file << "    sub     rsp, 128\n";
+    out_file << "    mov     eax, 204\n";              // sched_getaffinity
+    out_file << "    xor     edi, edi\n";
+    out_file << "    mov     esi, 128\n";
+    out_file << "    mov     rdx, rsp\n";
+    out_file << "    syscall\n";
+    out_file << "    xor     ecx, ecx\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    test    rax, rax\n";
+    out_file << "    jle     .counted\n";
+    out_file << "    shr     rax, 3\n";
+    out_file << ".mask:\n";
+    out_file << "    cmp     rdx, rax\n";
+    out_file << "    jae     .counted\n";
+    out_file << "    mov     r8, QWORD [rsp+rdx*8]\n";
+    out_file << "    inc     rdx\n";
+    out_file << ".bits:\n";
+    out_file << "    test    r8, r8\n";
+    out_file << "    jz      .mask\n";
+    out_file << "    lea     r9, [r8-1]\n";
+    out_file << "    and     r8, r9\n";
+    out_file << "    inc     rcx\n";
+    out_file << "    jmp     .bits\n";
+    out_file << ".counted:\n";
+    out_file << "    add     rsp, 128\n";
+    out_file << "    mov     eax, 1\n";
+    out_file << "    test    rcx, rcx\n";
+    out_file << "    cmovz   rcx, rax\n";
+    out_file << "    mov     eax, " << PARALLEL_MAX_WORKERS << "\n";
+    out_file << "    cmp     rcx, rax\n";
+    out_file << "    cmova   rcx, rax\n";
+    out_file << "    mov     QWORD [parallel_workers], rcx\n";
+    out_file << "    imul    rsi, rcx, " << region_size << "\n";
+    out_file << "    mov     QWORD [parallel_stacks_size], rsi\n";
+    out_file << "    mov     eax, 9\n";                // mmap
+    out_file << "    xor     edi, edi\n";
+    out_file << "    mov     edx, 3\n";                // PROT_READ | PROT_WRITE
+    out_file << "    mov     r10d, 0x4022\n";          // MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+    out_file << "    mov     r8, -1\n";
+    out_file << "    xor     r9d, r9d\n";
+    out_file << "    syscall\n";
+    out_file << "    cmp     rax, -4095\n";
+    out_file << "    jae     .failed\n";
+    out_file << "    mov     QWORD [parallel_stacks], rax\n";
+    out_file << "    xor     r12d, r12d\n";
+    out_file << ".region:\n";
+    out_file << "    imul    rdi, r12, " << region_size << "\n";
+    out_file << "    add     rdi, QWORD [parallel_stacks]\n";
+    out_file << "    mov     esi, " << PAGE_SIZE << "\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    mov     eax, 10\n";               // mprotect
+    out_file << "    syscall\n";
+    out_file << "    add     rdi, " << PAGE_SIZE + data_size << "\n";
+    out_file << "    mov     rax, r12\n";
+    out_file << "    shl     rax, 6\n";
+    out_file << "    mov     QWORD [parallel_slots+rax+32], rdi\n";
+    out_file << "    lea     rdx, [rdi+" << PAGE_SIZE << "]\n";
+    out_file << "    mov     QWORD [parallel_slots+rax+48], rdx\n";
+    out_file << "    lea     rdx, [rdi+" << region_size - PAGE_SIZE - data_size << "]\n";
+    out_file << "    mov     QWORD [parallel_slots+rax+40], rdx\n";
+    out_file << "    mov     esi, " << PAGE_SIZE << "\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    mov     eax, 10\n";
+    out_file << "    syscall\n";
+    out_file << "    inc     r12\n";
+    out_file << "    cmp     r12, QWORD [parallel_workers]\n";
+    out_file << "    jb      .region\n";
+    out_file << "    ret\n";
+    out_file << ".failed:\n";
+    out_file << "    mov     rsi, msg_stack_map\n";
+    out_file << "    mov     edx, msg_stack_map_len\n";
+    out_file << "    jmp     runtime_error\n";
+
+    // Takes a chunk of the indices of worker rdi: returns the first in rax
+    // and the end in rdx, rax >= rdx once the worker has none left.
+    out_file << "parallel_take:\n";
+    out_file << "    shl     rdi, 6\n";
+    out_file << "    lea     r8, [parallel_slots+rdi]\n";
+    out_file << "    mov     rax, QWORD [r8]\n";
+    out_file << "    mov     rdx, QWORD [r8+8]\n";
+    out_file << ".retry:\n";
+    out_file << "    cmp     rax, rdx\n";
+    out_file << "    jae     .done\n";
+    out_file << "    mov     rbx, rax\n";
+    out_file << "    add     rbx, QWORD [parallel_chunk]\n";
+    out_file << "    jc      .clamp\n";
+    out_file << "    cmp     rbx, rdx\n";
+    out_file << "    jbe     .claim\n";
+    out_file << ".clamp:\n";
+    out_file << "    mov     rbx, rdx\n";
+    out_file << ".claim:\n";
+    out_file << "    mov     rcx, rdx\n";
+    out_file << "    lock cmpxchg16b [r8]\n";
+    out_file << "    jne     .retry\n";
+    out_file << "    mov     rdx, rbx\n";
+    out_file << ".done:\n";
+    out_file << "    ret\n";
 
-    std::stack<uint64_t> conditional_stack;
-    uint64_t while_jump_loc = 0;
-    uint64_t while_start_loc = 0;
+    // Moves the back half of the indices another worker has left to worker
+    // rdi, eax = 0 when every worker is out of indices
+    out_file << "parallel_steal:\n";
+    out_file << "    mov     r9, rdi\n";
+    out_file << "    mov     r10, rdi\n";
+    out_file << "    mov     r11, QWORD [parallel_count]\n";
+    out_file << "    lea     rsi, [r11-1]\n";
+    out_file << ".next:\n";
+    out_file << "    test    rsi, rsi\n";
+    out_file << "    jz      .none\n";
+    out_file << "    dec     rsi\n";
+    out_file << "    inc     r10\n";
+    out_file << "    cmp     r10, r11\n";
+    out_file << "    jb      .victim\n";
+    out_file << "    xor     r10d, r10d\n";
+    out_file << ".victim:\n";
+    out_file << "    mov     r8, r10\n";
+    out_file << "    shl     r8, 6\n";
+    out_file << "    lea     r8, [parallel_slots+r8]\n";
+    out_file << "    mov     rax, QWORD [r8]\n";
+    out_file << "    mov     rdx, QWORD [r8+8]\n";
+    out_file << ".retry:\n";
+    out_file << "    cmp     rax, rdx\n";
+    out_file << "    jae     .next\n";
+    out_file << "    mov     rcx, rdx\n";
+    out_file << "    sub     rcx, rax\n";
+    out_file << "    shr     rcx, 1\n";
+    out_file << "    adc     rcx, 0\n";
+    out_file << "    neg     rcx\n";
+    out_file << "    add     rcx, rdx\n";
+    out_file << "    mov     rbx, rax\n";
+    out_file << "    lock cmpxchg16b [r8]\n";
+    out_file << "    jne     .retry\n";
+    out_file << "    mov     r10, rcx\n";
+    out_file << "    mov     r11, rdx\n";
+    out_file << "    shl     r9, 6\n";
+    out_file << "    lea     r8, [parallel_slots+r9]\n";
+    out_file << "    mov     rax, QWORD [r8]\n";
+    out_file << "    mov     rdx, QWORD [r8+8]\n";
+    out_file << ".install:\n";
+    out_file << "    mov     rbx, r10\n";
+    out_file << "    mov     rcx, r11\n";
+    out_file << "    lock cmpxchg16b [r8]\n";
+    out_file << "    jne     .install\n";
+    out_file << "    mov     eax, 1\n";
+    out_file << "    ret\n";
+    out_file << ".none:\n";
+    out_file << "    xor     eax, eax\n";
+    out_file << "    ret\n";
 
-    // Check for whether implemented every operation in Operations
-    assert(static_cast<Operations>(15) == Operations::OP_CNT && "Implement every operation" &&
-            "compile_program()");
-    uint64_t ip = 0;
-    for (auto it = operations_list.begin(); it != operations_list.end(); ++it, ++ip)
-    {
-        if (mock_stack_size >= MAX_STACK_SIZE) {
-            std::cerr << "Stack size exceeded limit\n";
-            exit(EXIT_FAILURE);
+    // Runs the body for the indices of worker rdi and whatever it can
+    // steal, then stores its partial reduction. The body clobbers every
+    // register but rsp, so the state lives on the native stack:
+    // [rsp] worker, [rsp+8] partial, [rsp+16] index, [rsp+24] chunk end.
+    out_file << "parallel_worker:\n";
+    out_file << "    sub     rsp, 40\n";
+    out_file << "    mov     QWORD [rsp], rdi\n";
+    out_file << "    mov     rax, QWORD [parallel_identity]\n";
+    out_file << "    mov     QWORD [rsp+8], rax\n";
+    out_file << ".take:\n";
+    out_file << "    mov     rdi, QWORD [rsp]\n";
+    out_file << "    call    parallel_take\n";
+    out_file << "    cmp     rax, rdx\n";
+    out_file << "    jb      .chunk\n";
+    out_file << "    mov     rdi, QWORD [rsp]\n";
+    out_file << "    call    parallel_steal\n";
+    out_file << "    test    eax, eax\n";
+    out_file << "    jnz     .take\n";
+    out_file << "    mov     rdi, QWORD [rsp]\n";
+    out_file << "    shl     rdi, 6\n";
+    out_file << "    mov     rax, QWORD [rsp+8]\n";
+    out_file << "    mov     QWORD [parallel_slots+rdi+16], rax\n";
+    out_file << "    add     rsp, 40\n";
+    out_file << "    ret\n";
+    out_file << ".chunk:\n";
+    out_file << "    mov     QWORD [rsp+16], rax\n";
+    out_file << "    mov     QWORD [rsp+24], rdx\n";
+    out_file << ".index:\n";
+    out_file << "    mov     rdi, QWORD [rsp]\n";
+    out_file << "    shl     rdi, 6\n";
+    out_file << "    mov     rbp, QWORD [parallel_slots+rdi+32]\n";
+    out_file << "    sub     rbp, 8\n";
+    out_file << "    mov     QWORD [rbp], rax\n";
+    out_file << "    call    QWORD [parallel_body]\n";
+    out_file << "    mov     rcx, rax\n";
+    out_file << "    mov     rax, QWORD [rsp+8]\n";
+    out_file << "    call    QWORD [parallel_combine]\n";
+    out_file << "    mov     QWORD [rsp+8], rax\n";
+    out_file << "    mov     rax, QWORD [rsp+16]\n";
+    out_file << "    inc     rax\n";
+    out_file << "    mov     QWORD [rsp+16], rax\n";
+    out_file << "    cmp     rax, QWORD [rsp+24]\n";
+    out_file << "    jb      .index\n";
+    out_file << "    jmp     .take\n";
+
+    // Runs a parallel loop over [rdi, rsi): rdx is the body, ecx the op
+    // combining the values and r8 its identity. Returns the reduction in
+    // rax. Worker 0 is the calling thread, the others are started here and
+    // exit once they run out of indices.
+    out_file << "parallel_run:\n";
+    out_file << "    push    rbp\n";
+    out_file << "    mov     QWORD [parallel_body], rdx\n";
+    out_file << "    mov     rcx, QWORD [reduce_routines+rcx*8]\n";
+    out_file << "    mov     QWORD [parallel_combine], rcx\n";
+    out_file << "    mov     QWORD [parallel_identity], r8\n";
+    out_file << "    mov     rax, r8\n";
+    out_file << "    cmp     rdi, rsi\n";
+    out_file << "    jae     .done\n";
+    out_file << "    cmp     QWORD [parallel_workers], 0\n";
+    out_file << "    jne     .split\n";
+    out_file << "    push    rdi\n";
+    out_file << "    push    rsi\n";
+    out_file << "    call    parallel_setup\n";
+    out_file << "    pop     rsi\n";
+    out_file << "    pop     rdi\n";
+    out_file << ".split:\n";
+    // every worker starts with total / count indices, the first
+    // total % count of them with one more
+    out_file << "    mov     rax, rsi\n";
+    out_file << "    sub     rax, rdi\n";
+    out_file << "    mov     rcx, QWORD [parallel_workers]\n";
+    out_file << "    cmp     rax, rcx\n";
+    out_file << "    cmovb   rcx, rax\n";
+    out_file << "    mov     QWORD [parallel_count], rcx\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    div     rcx\n";
+    out_file << "    mov     r9, rax\n";
+    out_file << "    shr     r9, " << std::countr_zero(static_cast<uint64_t>(PARALLEL_CHUNKS_PER_WORKER)) << "\n";
+    out_file << "    mov     r10d, 1\n";
+    out_file << "    test    r9, r9\n";
+    out_file << "    cmovz   r9, r10\n";
+    out_file << "    mov     QWORD [parallel_chunk], r9\n";
+    out_file << "    mov     r8, QWORD [parallel_identity]\n";
+    out_file << "    xor     r12d, r12d\n";
+    out_file << ".range:\n";
+    out_file << "    mov     r10, r12\n";
+    out_file << "    shl     r10, 6\n";
+    out_file << "    mov     QWORD [parallel_slots+r10], rdi\n";
+    out_file << "    lea     r11, [rdi+rax]\n";
+    out_file << "    cmp     r12, rdx\n";
+    out_file << "    adc     r11, 0\n";
+    out_file << "    mov     QWORD [parallel_slots+r10+8], r11\n";
+    out_file << "    mov     QWORD [parallel_slots+r10+16], r8\n";
+    out_file << "    mov     DWORD [parallel_slots+r10+24], 1\n";
+    out_file << "    mov     rdi, r11\n";
+    out_file << "    inc     r12\n";
+    out_file << "    cmp     r12, rcx\n";
+    out_file << "    jb      .range\n";
+    if (is_metered(options)) {
+        // the threads, this one included, claim the ops left from
+        // meter_pool, see add_meter_runtime_asm()
+        out_file << "    mov     QWORD [meter_pool], r14\n";
+        out_file << "    xor     r14d, r14d\n";
+    }
+    out_file << "    mov     r12d, 1\n";
+    out_file << ".spawn:\n";
+    out_file << "    cmp     r12, QWORD [parallel_count]\n";
+    out_file << "    jae     .run\n";
+    out_file << "    mov     r10, r12\n";
+    out_file << "    shl     r10, 6\n";
+    out_file << "    mov     rsi, QWORD [parallel_slots+r10+40]\n";
+    out_file << "    sub     rsi, 8\n";
+    out_file << "    mov     QWORD [rsi], r12\n";
+    out_file << "    lea     r10, [parallel_slots+r10+24]\n";
+    out_file << "    mov     eax, 56\n";               // clone
+    // CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD |
+    // CLONE_SYSVSEM | CLONE_CHILD_CLEARTID
+    out_file << "    mov     edi, 0x250f00\n";
+    out_file << "    xor     edx, edx\n";
+    out_file << "    xor     r8d, r8d\n";
+    out_file << "    syscall\n";
+    out_file << "    test    rax, rax\n";
+    out_file << "    jz      .child\n";
+    out_file << "    js      .failed\n";
+    out_file << "    inc     r12\n";
+    out_file << "    jmp     .spawn\n";
+    out_file << ".run:\n";
+    out_file << "    xor     edi, edi\n";
+    out_file << "    call    parallel_worker\n";
+    out_file << "    mov     r12d, 1\n";
+    out_file << ".join:\n";
+    out_file << "    cmp     r12, QWORD [parallel_count]\n";
+    out_file << "    jae     .combine\n";
+    out_file << "    mov     rdi, r12\n";
+    out_file << "    shl     rdi, 6\n";
+    out_file << "    lea     rdi, [parallel_slots+rdi+24]\n";
+    out_file << ".wait:\n";
+    out_file << "    mov     edx, DWORD [rdi]\n";
+    out_file << "    test    edx, edx\n";
+    out_file << "    jz      .joined\n";
+    out_file << "    mov     eax, 202\n";              // futex(FUTEX_WAIT)
+    out_file << "    xor     esi, esi\n";
+    out_file << "    xor     r10d, r10d\n";
+    out_file << "    syscall\n";
+    out_file << "    jmp     .wait\n";
+    out_file << ".joined:\n";
+    out_file << "    inc     r12\n";
+    out_file << "    jmp     .join\n";
+    out_file << ".combine:\n";
+    if (is_metered(options)) {
+        // the ops no thread used, unless the deadline passed meanwhile
+        out_file << "    mov     rax, QWORD [meter_pool]\n";
+        out_file << "    test    rax, rax\n";
+        out_file << "    jle     .drained\n";
+        out_file << "    add     r14, rax\n";
+        out_file << ".drained:\n";
+        out_file << "    cmp     BYTE [meter_deadline_passed], 0\n";
+        out_file << "    je      .metered\n";
+        out_file << "    mov     r14, -1\n";
+        out_file << ".metered:\n";
+    }
+    out_file << "    mov     rax, QWORD [parallel_identity]\n";
+    out_file << "    xor     r12d, r12d\n";
+    out_file << ".partial:\n";
+    out_file << "    mov     rcx, r12\n";
+    out_file << "    shl     rcx, 6\n";
+    out_file << "    mov     rcx, QWORD [parallel_slots+rcx+16]\n";
+    out_file << "    call    QWORD [parallel_combine]\n";
+    out_file << "    inc     r12\n";
+    out_file << "    cmp     r12, QWORD [parallel_count]\n";
+    out_file << "    jb      .partial\n";
+    out_file << ".done:\n";
+    out_file << "    pop     rbp\n";
+    out_file << "    ret\n";
+    // the new thread starts here on its native stack, holding the worker
+    out_file << ".child:\n";
+    out_file << "    mov     rdi, QWORD [rsp]\n";
+    out_file << "    shl     rdi, 6\n";
+    out_file << "    sub     rsp, 24\n";
+    out_file << "    mov     rax, QWORD [parallel_slots+rdi+48]\n";
+    out_file << "    mov     QWORD [rsp], rax\n";
+    out_file << "    mov     QWORD [rsp+8], 0\n";
+    out_file << "    mov     QWORD [rsp+16], " << SIGNAL_STACK_SIZE << "\n";
+    out_file << "    mov     eax, 131\n";              // sigaltstack
+    out_file << "    mov     rdi, rsp\n";
+    out_file << "    xor     esi, esi\n";
+    out_file << "    syscall\n";
+    out_file << "    add     rsp, 24\n";
+    out_file << "    mov     rdi, QWORD [rsp]\n";
+    out_file << "    call    parallel_worker\n";
+    if (is_metered(options)) {
+        // returns the ops claimed but not used
+        out_file << "    test    r14, r14\n";
+        out_file << "    jle     .exit\n";
+        out_file << "    lock add QWORD [meter_pool], r14\n";
+        out_file << ".exit:\n";
+    }
+    out_file << "    mov     eax, 60\n";               // exit, only this thread
+    out_file << "    xor     edi, edi\n";
+    out_file << "    syscall\n";
+    out_file << ".failed:\n";
+    out_file << "    mov     rsi, msg_thread\n";
+    out_file << "    mov     edx, msg_thread_len\n";
+    out_file << "    jmp     runtime_error\n";
+
+    // rax = rax op rcx for every op a loop can reduce with, indexed by op
+    for (const OpInfo &info : op_table) {
+        if (info.reduces) {
+            out_file << "reduce_" << static_cast<int>(info.op) << ":\n";
+            add_arithmetic_asm(out_file, info.op);
+            out_file << "    ret\n";
         }
-        switch (it->op_type()) {
-            case Operations::OP_PUSH:
-                out_file << "    ;; OP_PUSH\n";
-                out_file << "    push " << it->operand() << '\n';
-                ++mock_stack_size;
-                break;
+    }
+}
 
-            case Operations::OP_PLUS:
-                if (mock_stack_size < 2) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_PLUS(+) operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    out_file << "    ;; ADD\n";
-                    out_file << "    pop rdx\n";
-                    out_file << "    pop rsi\n";
-                    out_file << "    add rdx, rsi\n";
-                    out_file << "    push rdx\n";
-                    --mock_stack_size;
-                }
-                break;
 
-            case Operations::OP_MINUS:
-                if (mock_stack_size < 2) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_MINUS(-) operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    out_file << "    ;; OP_MINUS\n";
-                    out_file << "    pop rdx\n";
-                    out_file << "    pop rsi\n";
-                    out_file << "    sub rsi, rdx\n";
-                    out_file << "    push rsi\n";
-                    --mock_stack_size;
-                }
-                break;
+// Read only messages and writable runtime state, emitted after the program.
+void add_data_segments_asm(std::ofstream& out_file, const Options &options,
+        const std::string &string_table) {
+    out_file << "segment .rodata\n";
+    add_string_table_asm(out_file, string_table);
+    out_file << "env_stack_size: db \"" << STR_ENV_STACK_SIZE << "=\", 0\n";
+    out_file << "msg_stack_overflow: db \"ERROR: Data stack overflow\", 10\n";
+    out_file << "msg_stack_overflow_len equ $ - msg_stack_overflow\n";
+    out_file << "msg_stack_underflow: db \"ERROR: Data stack underflow\", 10\n";
+    out_file << "msg_stack_underflow_len equ $ - msg_stack_underflow\n";
+    out_file << "msg_stack_map: db \"ERROR: Could not map data stack\", 10\n";
+    out_file << "msg_stack_map_len equ $ - msg_stack_map\n";
+    out_file << "msg_segv: db \"ERROR: Segmentation fault\", 10\n";
+    out_file << "msg_segv_len equ $ - msg_segv\n";
+    out_file << "msg_division_by_zero: db \"ERROR: Division by zero\", 10\n";
+    out_file << "msg_division_by_zero_len equ $ - msg_division_by_zero\n";
+    out_file << "msg_thread: db \"ERROR: Could not start a thread\", 10\n";
+    out_file << "msg_thread_len equ $ - msg_thread\n";
+    out_file << "digit_pairs: db \"";
+    for (int i = 0; i < 100; ++i) {
+        out_file << static_cast<char>('0' + i / 10) << static_cast<char>('0' + i % 10);
+    }
+    out_file << "\"\n";
+    out_file << "align 8\n";
+    out_file << "pow10: dq 1";
+    for (uint64_t i = 1, p = 10; i < 20; ++i, p *= 10) {
+        out_file << ", " << p;
+    }
+    out_file << "\n";
+
+    out_file << "segment .data\n";
+    // struct sigaction: handler, SA_SIGINFO | SA_ONSTACK | SA_RESTORER,
+    // restorer, mask
+    out_file << "segv_action: dq segv_handler, 0x0c000004, signal_restorer, 0\n";
+    // stack_t: ss_sp, ss_flags, ss_size
+    out_file << "signal_stack_desc: dq signal_stack, 0, " << SIGNAL_STACK_SIZE << "\n";
+    // flush_output writes here, switched to the profile file on exit
+    out_file << "output_fd: dq 1\n";
+    for (const char *kernel : {"fill", "copy", "sum", "eq"}) {
+        out_file << "mem_" << kernel << "_impl: dq mem_" << kernel << "_sse2\n";
+    }
+    out_file << "reduce_routines: dq ";
+    for (const OpInfo &info : op_table) {
+        out_file << (&info == op_table ? "" : ", ");
+        if (info.reduces) {
+            out_file << "reduce_" << static_cast<int>(info.op);
+        }
+        else {
+            out_file << "0";
+        }
+    }
+    out_file << "\n";
+
+    out_file << "segment .bss\n";
+    out_file << "data_stack_base: resq 1\n";
+    out_file << "data_stack_top: resq 1\n";
+    out_file << "output_len: resq 1\n";
+    out_file << "output_buffer: resb " << OUTPUT_BUFFER_SIZE << "\n";
+    out_file << "input_pos: resq 1\n";
+    out_file << "input_len: resq 1\n";
+    out_file << "input_buffer: resb " << INPUT_BUFFER_SIZE << "\n";
+    out_file << "signal_stack: resb " << SIGNAL_STACK_SIZE << "\n";
+    out_file << "parallel_workers: resq 1\n";
+    out_file << "parallel_count: resq 1\n";
+    out_file << "parallel_stacks: resq 1\n";
+    out_file << "parallel_stacks_size: resq 1\n";
+    out_file << "parallel_body: resq 1\n";
+    out_file << "parallel_combine: resq 1\n";
+    out_file << "parallel_identity: resq 1\n";
+    out_file << "parallel_chunk: resq 1\n";
+    out_file << "alignb 64\n";
+    out_file << "parallel_slots: resb " << PARALLEL_MAX_WORKERS * 64 << "\n";
+    out_file << "alignb 32\n";
+    out_file << "mem: resb " << options.mem_size << "\n";
+}
 
-            case Operations::OP_DUMP:
-                if (mock_stack_size < 1) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_DUMP operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    out_file << "    ;; OP_DUMP\n";
-                    out_file << "    pop rdi\n";
-                    out_file << "    call dump\n";
-                    --mock_stack_size;
-                }
-                break;
 
-            case Operations::OP_DUP:
-                if (mock_stack_size < 1) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_DUP operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    out_file << "    ;; OP_DUP\n";
-                    out_file << "    pop rax\n";
-                    out_file << "    push rax\n";
-                    out_file << "    push rax\n";
-                    ++mock_stack_size;
-                }
-                break;
+// The stops of add_meter_asm() and meter_exhausted, which reports them like
+// the simulator: "file:line:col: ERROR: Budget of N operations exhausted,
+// stack depth D" and exit status 1. Once the deadline passed, SIGALRM sets
+// r14 of the thread it interrupts to -1. Threads running a parallel loop
+// claim METER_CREDIT ops at a time from meter_pool, where parallel_run put
+// what was left, and stop once it is empty.
+void add_meter_runtime_asm(std::ofstream& out_file, const std::string &program_file_name,
+        const std::vector<Operation> &program, const CodegenState &state,
+        const Options &options) {
+    for (auto [ip, depth, parallel] : state.meter_sites) {
+        out_file << "meter" << ip << ":\n";
+        if (parallel) {
+            out_file << "    cmp     BYTE [meter_deadline_passed], 0\n";
+            out_file << "    jne     meter" << ip << "_stop\n";
+            out_file << "    mov     rax, -" << METER_CREDIT << "\n";
+            out_file << "    lock xadd QWORD [meter_pool], rax\n";
+            out_file << "    test    rax, rax\n";
+            out_file << "    jle     meter" << ip << "_stop\n";
+            out_file << "    cmp     rax, " << METER_CREDIT << "\n";
+            out_file << "    jbe     meter" << ip << "_claimed\n";
+            out_file << "    mov     eax, " << METER_CREDIT << "\n";
+            out_file << "meter" << ip << "_claimed:\n";
+            out_file << "    add     r14, rax\n";
+            out_file << "    js      meter" << ip << "\n";
+            out_file << "    jmp     meter" << ip << "_resume\n";
+            out_file << "meter" << ip << "_stop:\n";
+        }
+        if (depth == UNKNOWN_STACK_DEPTH) {
+            out_file << "    mov     rdi, QWORD [data_stack_top]\n";
+            out_file << "    sub     rdi, rsp\n";
+            out_file << "    shr     rdi, 3\n";
+        }
+        else {
+            out_file << "    mov     edi, " << depth << "\n";
+        }
+        out_file << "    mov     rsi, meter_at" << ip << "\n";
+        out_file << "    mov     edx, meter_at" << ip << "_len\n";
+        out_file << "    xchg    rsp, rbp\n";
+        out_file << "    jmp     meter_exhausted\n";
+    }
 
-            case Operations::OP_EQUALS:
-                if (mock_stack_size < 2) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_EQUALS(=) operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    out_file << "    ;; OP_EQUALS\n";
-                    out_file << "    pop rax\n";
-                    out_file << "    pop rbx\n";
-
-                    out_file << "    mov rcx, 0\n";
-                    out_file << "    mov rdx, 1\n";
-                    out_file << "    cmp rax, rbx\n";
-                    out_file << "    cmove rcx, rdx\n";
-                    out_file << "    push rcx\n";
-                    --mock_stack_size;
-                }
-                break;
+    // Writes the position in rsi/rdx, the message and the stack depth in
+    // rdi to stderr and exits with status 1, from any thread
+    out_file << "meter_exhausted:\n";
+    out_file << "    push    rdi\n";
+    out_file << "    push    rsi\n";
+    out_file << "    push    rdx\n";
+    out_file << "    call    flush_output\n";
+    out_file << "    mov     QWORD [output_fd], 2\n";
+    out_file << "    pop     rdx\n";
+    out_file << "    pop     rsi\n";
+    out_file << "    call    write_string\n";
+    out_file << "    mov     rsi, msg_budget\n";
+    out_file << "    mov     edx, msg_budget_len\n";
+    out_file << "    cmp     BYTE [meter_deadline_passed], 0\n";
+    out_file << "    je      .message\n";
+    out_file << "    mov     rsi, msg_deadline\n";
+    out_file << "    mov     edx, msg_deadline_len\n";
+    out_file << ".message:\n";
+    out_file << "    call    write_string\n";
+    out_file << "    pop     rdi\n";
+    out_file << "    call    dump\n";
+    out_file << "    call    flush_output\n";
+    out_file << "    mov     eax, 231\n";             // exit_group
+    out_file << "    mov     edi, 1\n";
+    out_file << "    syscall\n";
 
-            case Operations::OP_LESS_THAN:
-                if (mock_stack_size < 2) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_EQUALS(=) operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    out_file << "    ;; OP_LESS_THAN\n";
+    out_file << "meter_alarm:\n";
+    out_file << "    mov     BYTE [meter_deadline_passed], 1\n";
+    out_file << "    mov     QWORD [rdx+88], -1\n";   // ucontext_t gregs[REG_R14]
+    out_file << "    ret\n";
 
-                    out_file << "    pop rax\n";
-                    out_file << "    pop rbx\n";
-
-                    out_file << "    mov rcx, 0\n";
-                    out_file << "    mov rdx, 1\n";
-                    out_file << "    cmp rbx, rax\n";
-                    out_file << "    cmovl rcx, rdx\n";
-                    out_file << "    push rcx\n";
-                    --mock_stack_size;
-                }
-                break;
+    out_file << "segment .rodata\n";
+    for (auto [ip, depth, parallel] : state.meter_sites) {
+        // as bytes, the file name may contain quotes
+        std::string at = program_file_name + ":" + std::to_string(program[ip].line()) + ":"
+            + std::to_string(program[ip].col()) + ": ERROR: ";
+        out_file << "meter_at" << ip << ": db ";
+        for (size_t i = 0; i < at.size(); ++i) {
+            out_file << (i == 0 ? "" : ", ") << static_cast<int>(static_cast<unsigned char>(at[i]));
+        }
+        out_file << "\n";
+        out_file << "meter_at" << ip << "_len equ $ - meter_at" << ip << "\n";
+    }
+    out_file << "msg_budget: db \"Budget of " << options.budget
+        << " operations exhausted, stack depth \"\n";
+    out_file << "msg_budget_len equ $ - msg_budget\n";
+    out_file << "msg_deadline: db \"Deadline of " << options.deadline_ms
+        << " ms exceeded, stack depth \"\n";
+    out_file << "msg_deadline_len equ $ - msg_deadline\n";
+    // struct sigaction: handler, SA_SIGINFO | SA_RESTART | SA_ONSTACK |
+    // SA_RESTORER, restorer, mask
+    out_file << "meter_alarm_action: dq meter_alarm, 0x1c000004, signal_restorer, 0\n";
+    // struct itimerval: it_interval then it_value, in seconds and
+    // microseconds
+    out_file << "meter_timer: dq 0, " << METER_TIMER_INTERVAL_US << ", "
+        << options.deadline_ms / 1000 << ", " << options.deadline_ms % 1000 * 1000 << "\n";
+    out_file << "segment .bss\n";
+    out_file << "meter_pool: resq 1\n";
+    out_file << "meter_deadline_passed: resb 1\n";
+}
 
-            case Operations::OP_LESS_THAN_EQ:
-                if (mock_stack_size < 2) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_EQUALS(=) operation");
-                    exit(EXIT_FAILURE);
-                }
-                else {
-                    out_file << "    ;; OP_LESS_THAN_EQ\n";
-                    out_file << "    pop rax\n";
-                    out_file << "    pop rbx\n";
-
-                    out_file << "    mov rcx, 0\n";
-                    out_file << "    mov rdx, 1\n";
-                    out_file << "    cmp rbx, rax\n";
-                    out_file << "    cmovle rcx, rdx\n";
-                    out_file << "    push rcx\n";
-                    --mock_stack_size;
+
+// Counters and exit routine for --profile-generate. write_block_profile
+// points flush_output at the profile file and writes one
+// "line col kind count" line per block, reusing dump for the counts.
+void add_block_profile_asm(std::ofstream& out_file,
+        const std::vector<ProfiledBlock> &blocks, const Options &options) {
+    out_file << "write_block_profile:\n";
+    out_file << "    mov     eax, 2\n";                // open
+    out_file << "    mov     rdi, profile_path\n";
+    out_file << "    mov     esi, 0x241\n";            // O_WRONLY | O_CREAT | O_TRUNC
+    out_file << "    mov     edx, 420\n";              // 0644
+    out_file << "    syscall\n";
+    out_file << "    test    rax, rax\n";
+    out_file << "    js      .failed\n";
+    out_file << "    mov     QWORD [output_fd], rax\n";
+    out_file << "    xor     ebx, ebx\n";
+    out_file << ".next:\n";
+    out_file << "    mov     rax, rbx\n";
+    out_file << "    shl     rax, 4\n";
+    out_file << "    mov     rsi, QWORD [block_keys+rax]\n";
+    out_file << "    mov     rdx, QWORD [block_keys+rax+8]\n";
+    out_file << "    mov     rax, QWORD [output_len]\n";
+    out_file << "    lea     rcx, [rax+rdx+21]\n";
+    out_file << "    cmp     rcx, " << OUTPUT_BUFFER_SIZE << "\n";
+    out_file << "    jbe     .room\n";
+    out_file << "    push    rsi\n";
+    out_file << "    push    rdx\n";
+    out_file << "    call    flush_output\n";
+    out_file << "    pop     rdx\n";
+    out_file << "    pop     rsi\n";
+    out_file << "    xor     eax, eax\n";
+    out_file << ".room:\n";
+    out_file << "    lea     rdi, [output_buffer+rax]\n";
+    out_file << "    add     rax, rdx\n";
+    out_file << "    mov     QWORD [output_len], rax\n";
+    out_file << "    mov     rcx, rdx\n";
+    out_file << "    rep movsb\n";
+    out_file << "    mov     rdi, QWORD [block_counters+rbx*8]\n";
+    out_file << "    call    dump\n";
+    out_file << "    inc     rbx\n";
+    out_file << "    cmp     rbx, " << blocks.size() << "\n";
+    out_file << "    jb      .next\n";
+    out_file << "    call    flush_output\n";
+    out_file << "    mov     eax, 3\n";                // close
+    out_file << "    mov     rdi, QWORD [output_fd]\n";
+    out_file << "    syscall\n";
+    out_file << "    mov     QWORD [output_fd], 1\n";
+    out_file << "    ret\n";
+    out_file << ".failed:\n";
+    out_file << "    mov     rsi, msg_profile\n";
+    out_file << "    mov     edx, msg_profile_len\n";
+    out_file << "    jmp     runtime_error\n";
+
+    out_file << "segment .rodata\n";
+    // as bytes, the path may contain quotes
+    out_file << "profile_path: db ";
+    for (unsigned char c : options.profile_path) {
+        out_file << static_cast<int>(c) << ", ";
+    }
+    out_file << "0\n";
+    out_file << "msg_profile: db \"ERROR: Could not write block profile\", 10\n";
+    out_file << "msg_profile_len equ $ - msg_profile\n";
+    // the header goes in front of the first key
+    out_file << "block_key0: db \"# cl block profile\", 10, \"# line col block count\", 10, "
+        << "\"0 0 entry \"\n";
+    for (size_t i = 1; i < blocks.size(); ++i) {
+        out_file << "block_key" << i << ": db \"" << blocks[i].line << ' '
+            << blocks[i].col << ' ' << blocks[i].kind << " \"\n";
+    }
+    out_file << "block_keys_end:\n";
+    out_file << "align 8\n";
+    out_file << "block_keys:";
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        std::string next = i + 1 < blocks.size()
+            ? "block_key" + std::to_string(i + 1) : "block_keys_end";
+        out_file << (i == 0 ? " dq " : ", ") << "block_key" << i << ", "
+            << next << " - block_key" << i;
+    }
+    out_file << "\n";
+
+    out_file << "segment .bss\n";
+    out_file << "block_counters: resq " << blocks.size() << "\n";
+    out_file << "segment .text\n";
+}
+
+
+// Emits the string_table label followed by the bytes of table
+void add_string_table_asm(std::ofstream& out_file, const std::string &table) {
+    out_file << "string_table:";
+    for (size_t i = 0; i < table.size(); ++i) {
+        out_file << (i % 16 == 0 ? "\n    db " : ", ")
+            << static_cast<int>(static_cast<unsigned char>(table[i]));
+    }
+    out_file << "\n";
+}
+
+
+// Sets jump_loc of every block op (see Operation::jump_loc()) and resolves
+// procedure calls. Safe to run again after the op list was rewritten.
+void crossreference_conditional(std::string program_file_name,
+        std::list<Operation> &ops) {
+    std::vector<Operation *> program;
+    for (auto &op : ops) {
+        program.push_back(&op);
+    }
+
+    std::stack<uint64_t> conditional_op;
+    std::map<std::string, uint64_t> procedures;
+    bool in_proc = false;
+    bool in_parallel = false;
+    for (uint64_t ip = 0; ip < program.size(); ++ip) {
+        Operation *op = program[ip];
+        // other threads run the body at the same time, keep it to
+        // computing a value
+        if (in_parallel) {
+            switch (op->op_type()) {
+                case Operations::OP_PARALLEL:
+                case Operations::OP_CALL:
+                case Operations::OP_DUMP:
+                case Operations::OP_PUTS:
+                case Operations::OP_READ_INT:
+                case Operations::OP_READ_BYTE:
+                {
+                    std::string word = op->op_type() == Operations::OP_CALL ? op->name()
+                        : std::string(op_info(op->op_type()).spelling);
+                    print_error(program_file_name, op->line(), op->col(),
+                            word + " is not allowed inside parallel");
                 }
+                    exit(EXIT_FAILURE);
+                default:
+                    break;
+            }
+        }
+        switch (op->op_type()) {
+            case Operations::OP_IF:
+            case Operations::OP_WHILE:
+                conditional_op.push(ip);
                 break;
 
-            case Operations::OP_GREATER_THAN:
-                if (mock_stack_size < 2) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_EQUALS(=) operation");
+            case Operations::OP_PROC:
+                if (in_proc || !conditional_op.empty()) {
+                    print_error(program_file_name, op->line(), op->col(),
+                            "Procedures can only be defined at top level");
                     exit(EXIT_FAILURE);
                 }
-                else {
-                    out_file << "    ;; OP_GREATER_THAN\n";
-                    out_file << "    pop rax\n";
-                    out_file << "    pop rbx\n";
-
-                    out_file << "    mov rcx, 0\n";
-                    out_file << "    mov rdx, 1\n";
-                    out_file << "    cmp rbx, rax\n";
-                    out_file << "    cmovg rcx, rdx\n";
-                    out_file << "    push rcx\n";
-                    --mock_stack_size;
+                if (procedures.count(op->name()) != 0) {
+                    print_error(program_file_name, op->line(), op->col(),
+                            "Redefinition of procedure " + op->name());
+                    exit(EXIT_FAILURE);
                 }
+                procedures[op->name()] = ip;
+                in_proc = true;
+                conditional_op.push(ip);
                 break;
 
-            case Operations::OP_GREATER_THAN_EQ:
-                if (mock_stack_size < 2) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_EQUALS(=) operation");
+            case Operations::OP_ELSE:
+                if (conditional_op.empty() ||
+                        program[conditional_op.top()]->op_type() != Operations::OP_IF) {
+                    print_error(program_file_name, op->line(), op->col(),
+                            "else without if");
                     exit(EXIT_FAILURE);
                 }
-                else {
-                    out_file << "    ;; OP_GREATER_THAN_EQ\n";
-                    out_file << "    pop rax\n";
-                    out_file << "    pop rbx\n";
-
-                    out_file << "    mov rcx, 0\n";
-                    out_file << "    mov rdx, 1\n";
-                    out_file << "    cmp rbx, rax\n";
-                    out_file << "    cmovge rcx, rdx\n";
-                    out_file << "    push rcx\n";
-                    --mock_stack_size;
-                }
+                program[conditional_op.top()]->jump_loc(ip + 1);
+                conditional_op.pop();
+                conditional_op.push(ip);
                 break;
 
-            case Operations::OP_IF:
-                if (mock_stack_size < 1) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_IF operation");
+            case Operations::OP_DO:
+                if (conditional_op.empty() ||
+                        program[conditional_op.top()]->op_type() != Operations::OP_WHILE) {
+                    print_error(program_file_name, op->line(), op->col(),
+                            "do without while");
                     exit(EXIT_FAILURE);
                 }
-                else {
-                    out_file << "    ;; OP_IF\n";
-                    out_file << "    pop rax\n";
-                    out_file << "    test rax, rax\n";
-                    conditional_stack.push(it->jump_loc());
-                    // Hack to make else-less if statement work
-                    conditional_stack.push(0);
-                    out_file << "    jz br" << it->jump_loc() << "else\n";
-                }
-                break;
-            case Operations::OP_END:
-                // Hack to make else-less if statement work
-                if (conditional_stack.top() == 0) {
-                    conditional_stack.pop();
-                    out_file << "br" << conditional_stack.top() << "else:\n";
-                }
-                if (while_start_loc != 0) {
-                    out_file << "    jmp br" << while_start_loc << "_loop\n";
-                    out_file << "br" << while_jump_loc << "_loop:\n";
-                    while_start_loc = 0;
-                }
-                out_file << "br" << conditional_stack.top() << ":\n";
-                conditional_stack.pop();
+                conditional_op.push(ip);
                 break;
 
-            case Operations::OP_ELSE:
-                // Hack to make else-less if statement work
-                conditional_stack.pop();
-                out_file << "    jmp br" << conditional_stack.top() << "\n";
-                out_file << "br" << conditional_stack.top() << "else:\n";
+            case Operations::OP_PARALLEL:
+                conditional_op.push(ip);
+                in_parallel = true;
                 break;
 
-            case Operations::OP_WHILE:
-                if (mock_stack_size < 1) {
-                    print_error(output_filename, it->line(), it->col(),
-                            "Not enough elements in stack for OP_IF operation");
+            case Operations::OP_REDUCE:
+                if (conditional_op.empty() ||
+                        program[conditional_op.top()]->op_type() != Operations::OP_PARALLEL) {
+                    print_error(program_file_name, op->line(), op->col(),
+                            "reduce without parallel");
                     exit(EXIT_FAILURE);
                 }
-                else {
-                    out_file << "\n    ;; OP_WHILE\n";
-                    out_file << "br" << ip << "_loop:\n";
-                    conditional_stack.push(it->jump_loc());
-                    while_jump_loc = it->jump_loc();
-                    while_start_loc = ip;
-                }
+                program[conditional_op.top()]->jump_loc(ip + 1);
+                op->jump_loc(conditional_op.top());
+                conditional_op.pop();
+                in_parallel = false;
                 break;
 
-            case Operations::OP_DO:
-                out_file << "    pop rax\n";
-                out_file << "    test rax, rax\n";
-                out_file << "    jz br" << while_jump_loc << "\n";
+            case Operations::OP_END:
+                {
+                    if (conditional_op.empty()) {
+                        print_error(program_file_name, op->line(), op->col(),
+                                "end without an open block");
+                        exit(EXIT_FAILURE);
+                    }
+                    uint64_t c_ip = conditional_op.top();
+                    conditional_op.pop();
+                    Operation *c_op = program[c_ip];
+                    if (c_op->op_type() == Operations::OP_DO) {
+                        c_op->jump_loc(ip + 1);
+                        c_ip = conditional_op.top();
+                        conditional_op.pop();
+                        program[c_ip]->jump_loc(ip);
+                    }
+                    else if (c_op->op_type() == Operations::OP_WHILE) {
+                        print_error(program_file_name, c_op->line(), c_op->col(),
+                                "while without do");
+                        exit(EXIT_FAILURE);
+                    }
+                    else if (c_op->op_type() == Operations::OP_PROC) {
+                        c_op->jump_loc(ip + 1);
+                        in_proc = false;
+                    }
+                    else if (c_op->op_type() == Operations::OP_PARALLEL) {
+                        print_error(program_file_name, c_op->line(), c_op->col(),
+                                "parallel without reduce");
+                        exit(EXIT_FAILURE);
+                    }
+                    else {
+                        // OP_IF or OP_ELSE
+                        c_op->jump_loc(ip);
+                    }
+                    op->jump_loc(c_ip);
+                }
                 break;
 
             default:
-                std::cerr << "Compilation failed!\n";
-                std::cerr << "ERROR: Operation unknown\n";
-                exit(EXIT_FAILURE);
+                break;
         }
     }
 
-    // exiting with zero
-    out_file << "    ;; returning from function with zero exit code\n";
-    out_file << "    mov rax, 60\n";
-    out_file << "    mov rdi, 0\n";
-    out_file << "    syscall\n";
-    out_file << "    ret\n";
-
-    out_file.close();
-
-    // Creating relocatable object
-    std::string nasm_cmd = "nasm -felf64 ";
-    nasm_cmd += OUTPUT_FILENAME;
-    nasm_cmd += ".asm -o";
-    nasm_cmd += OUTPUT_FILENAME;
-    nasm_cmd += ".o";
-    nasm_cmd += " -g -F dwarf";
-    exec(nasm_cmd);
+    if (!conditional_op.empty()) {
+        Operation *c_op = program[conditional_op.top()];
+        print_error(program_file_name, c_op->line(), c_op->col(),
+                "Unclosed block");
+        exit(EXIT_FAILURE);
+    }
 
-    // Creating executable
-    std::string ld_cmd = "ld ";
-    ld_cmd += OUTPUT_FILENAME;
-    ld_cmd += ".o -o ./a.out";
-    exec(ld_cmd);
+    for (auto op : program) {
+        if (op->op_type() != Operations::OP_CALL) {
+            continue;
+        }
+        auto proc = procedures.find(op->name());
+        if (proc == procedures.end()) {
+            print_error(program_file_name, op->line(), op->col(),
+                    "Unknown word " + op->name());
+            exit(EXIT_FAILURE);
+        }
+        op->jump_loc(proc->second);
+    }
 }
 
 
-// Helper funtion for echoing the command being
-// executed.
-void exec(const std::string cmd) {
-    std::cout << "Exec: " << cmd << '\n';
-    if (std::system(cmd.c_str()) != 0) {
-        std::cerr << "ERROR: Failed executing " << cmd << '\n';
-        exit(EXIT_FAILURE);
+
+// Reads a profile written by a --profile-generate binary. Counts of blocks
+// sharing a key (procedure bodies inlined more than once) are summed.
+bool read_block_profile(const std::string &path, BlockProfile &profile) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    for (std::string line; std::getline(in, line);) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        int line_num, col;
+        std::string kind;
+        uint64_t count;
+        if (!(fields >> line_num >> col >> kind >> count)) {
+            return false;
+        }
+        profile[{line_num, col}] += count;
     }
+    return true;
 }
 
 
-void print_error(const std::string& program_file_name, const int line_num,
-        const int col, const std::string msg) {
-    std::cerr << program_file_name << ':' << line_num << ':'
-        << col << ": ERROR: " << msg << '\n';
+// Key of the block containing `it`, the op starting it is the closest
+// control flow op before it (see compile_program()).
+static std::pair<int, int> block_key(const std::list<Operation> &ops,
+        std::list<Operation>::const_iterator it) {
+    while (it != ops.begin()) {
+        --it;
+        switch (it->op_type()) {
+            case Operations::OP_IF:
+            case Operations::OP_ELSE:
+            case Operations::OP_END:
+            case Operations::OP_WHILE:
+            case Operations::OP_DO:
+            case Operations::OP_PROC:
+                return {it->line(), it->col()};
+            default:
+                break;
+        }
+    }
+    return {0, 0};
 }
 
 
-void add_boilerplate_asm(std::ofstream& out_file) {
-    out_file << "global _start\n";
-    out_file << "segment .text\n";
-
-    // Created using a C program to print a number
-    // with a new line
-    out_file << "dump:\n";
-    out_file << "    push    rbp\n";
-    out_file << "    mov     rbp, rsp\n";
-    out_file << "    sub     rsp, 64\n";
-    out_file << "    mov     QWORD [rbp-56], rdi\n";
-    out_file << "    mov     DWORD [rbp-4], 1\n";
-    out_file << "    mov     edx, DWORD [rbp-4]\n";
-    out_file << "    mov     eax, 32\n";
-    out_file << "    sub     rax, rdx\n";
-    out_file << "    mov     BYTE [rbp-48+rax], 10\n";
-    out_file << ".L2:\n";
-    out_file << "    mov     rcx, QWORD [rbp-56]\n";
-    out_file << "    mov     rdx, -3689348814741910323\n";
-    out_file << "    mov     rax, rcx\n";
-    out_file << "    mul     rdx\n";
-    out_file << "    shr     rdx, 3\n";
-    out_file << "    mov     rax, rdx\n";
-    out_file << "    sal     rax, 2\n";
-    out_file << "    add     rax, rdx\n";
-    out_file << "    add     rax, rax\n";
-    out_file << "    sub     rcx, rax\n";
-    out_file << "    mov     rdx, rcx\n";
-    out_file << "    mov     eax, edx\n";
-    out_file << "    lea     ecx, [rax+48]\n";
-    out_file << "    mov     edx, DWORD [rbp-4]\n";
-    out_file << "    mov     eax, 31\n";
-    out_file << "    sub     rax, rdx\n";
-    out_file << "    mov     edx, ecx\n";
-    out_file << "    mov     BYTE [rbp-48+rax], dl\n";
-    out_file << "    add     DWORD [rbp-4], 1\n";
-    out_file << "    mov     rax, QWORD [rbp-56]\n";
-    out_file << "    mov     rdx, -3689348814741910323\n";
-    out_file << "    mul     rdx\n";
-    out_file << "    mov     rax, rdx\n";
-    out_file << "    shr     rax, 3\n";
-    out_file << "    mov     QWORD [rbp-56], rax\n";
-    out_file << "    cmp     QWORD [rbp-56], 0\n";
-    out_file << "    jne     .L2\n";
-    out_file << "    mov     eax, DWORD [rbp-4]\n";
-    out_file << "    mov     edx, DWORD [rbp-4]\n";
-    out_file << "    mov     ecx, 32\n";
-    out_file << "    sub     rcx, rdx\n";
-    out_file << "    lea     rdx, [rbp-48]\n";
-    out_file << "    add     rcx, rdx\n";
-    out_file << "    mov     rdx, rax\n";
-    out_file << "    mov     rsi, rcx\n";
-    out_file << "    mov     edi, 1\n";
-    out_file << "    mov     rax, 1\n";
-    out_file << "    syscall\n";
-    out_file << "    nop\n";
-    out_file << "    leave\n";
-    out_file << "    ret\n";
+// Ops a call may inline, raised for hot blocks and zero for blocks that
+// never ran when a profile is given.
+static size_t inline_cost_limit(const std::list<Operation> &ops,
+        std::list<Operation>::const_iterator call, const BlockProfile *profile) {
+    if (profile == nullptr) {
+        return INLINE_COST_THRESHOLD;
+    }
+    auto count = profile->find(block_key(ops, call));
+    if (count == profile->end()) {
+        return INLINE_COST_THRESHOLD;
+    }
+    if (count->second >= PROFILE_HOT_COUNT) {
+        return PROFILE_HOT_INLINE_COST;
+    }
+    return count->second == 0 ? 0 : INLINE_COST_THRESHOLD;
+}
 
 
-    out_file << "_start:\n";
-}
+// Replaces calls to procedures of at most INLINE_COST_THRESHOLD ops with a
+// copy of their body, then drops procedures that are no longer called and
+// cross references the result again. A block profile changes the
+// limit per call site, see inline_cost_limit().
+void inline_procedures(std::string program_file_name, std::list<Operation> &ops,
+        const BlockProfile *profile) {
+    for (int depth = 0; depth < MAX_INLINE_DEPTH; ++depth) {
+        std::map<std::string, std::list<Operation>> bodies;
+        for (auto it = ops.begin(); it != ops.end(); ++it) {
+            if (it->op_type() != Operations::OP_PROC) {
+                continue;
+            }
+            std::list<Operation> body;
+            bool recursive = false;
+            int nesting = 0;
+            for (auto body_it = std::next(it); ; ++body_it) {
+                if (body_it->op_type() == Operations::OP_END) {
+                    if (nesting == 0) {
+                        break;
+                    }
+                    --nesting;
+                }
+                else if (body_it->op_type() == Operations::OP_IF ||
+                        body_it->op_type() == Operations::OP_WHILE) {
+                    ++nesting;
+                }
+                else if (body_it->op_type() == Operations::OP_CALL &&
+                        body_it->name() == it->name()) {
+                    recursive = true;
+                }
+                body.push_back(*body_it);
+            }
+            if (!recursive && body.size() <=
+                    (profile ? PROFILE_HOT_INLINE_COST : INLINE_COST_THRESHOLD)) {
+                bodies[it->name()] = body;
+            }
+        }
 
+        bool inlined = false;
+        auto it = ops.begin();
+        while (it != ops.end()) {
+            auto body = it->op_type() == Operations::OP_CALL
+                ? bodies.find(it->name()) : bodies.end();
+            if (body == bodies.end() || body->second.size() > inline_cost_limit(ops, it, profile)) {
+                ++it;
+                continue;
+            }
+            std::list<Operation> copy = body->second;
+            ops.splice(it, copy);
+            it = ops.erase(it);
+            inlined = true;
+        }
+        if (!inlined) {
+            break;
+        }
+    }
 
-// Adds where a conditional statement ends
-void crossreference_conditional(std::list<Operation> &ops) {
-    std::stack<Operation *> conditional_op;
-    // Check for whether implemented conditional operation in Operations
-    assert(static_cast<Operations>(15) == Operations::OP_CNT && "Implement conditional operations" &&
-            "crossreference_conditional()");
-    uint64_t ip = 0;
-    for (auto it = ops.begin(); it != ops.end(); ++it, ++ip) {
-        if (it->op_type() == Operations::OP_IF) {
-            conditional_op.push(&(*it));
+    // procedures only called from their own body are dead as well
+    std::map<std::string, bool> called;
+    std::string current_proc;
+    int nesting = 0;
+    for (auto &op : ops) {
+        if (op.op_type() == Operations::OP_PROC) {
+            current_proc = op.name();
         }
-        if (it->op_type() == Operations::OP_WHILE) {
-            conditional_op.push(&(*it));
+        else if (op.op_type() == Operations::OP_IF || op.op_type() == Operations::OP_WHILE) {
+            ++nesting;
         }
-        else if (it->op_type() == Operations::OP_END) {
-            if (!conditional_op.empty()) {
-                auto c_op = conditional_op.top();
-                if (c_op->jump_loc() == 0) {
-                    c_op->jump_loc(ip);
-                }
-                conditional_op.pop();
+        else if (op.op_type() == Operations::OP_END) {
+            if (nesting == 0) {
+                current_proc.clear();
             }
             else {
-                std::cerr << "Operations on empty stack\n";
+                --nesting;
             }
         }
-        else if (it->op_type() == Operations::OP_ELSE) {
-            if (!conditional_op.empty()) {
-                auto c_op = conditional_op.top();
-                c_op->jump_loc(ip);
+        else if (op.op_type() == Operations::OP_CALL && op.name() != current_proc) {
+            called[op.name()] = true;
+        }
+    }
+    auto it = ops.begin();
+    while (it != ops.end()) {
+        if (it->op_type() != Operations::OP_PROC || called[it->name()]) {
+            ++it;
+            continue;
+        }
+        nesting = 0;
+        auto end = std::next(it);
+        for (; !(end->op_type() == Operations::OP_END && nesting == 0); ++end) {
+            if (end->op_type() == Operations::OP_IF || end->op_type() == Operations::OP_WHILE) {
+                ++nesting;
             }
-            else {
-                std::cerr << "Operations on empty stack\n";
+            else if (end->op_type() == Operations::OP_END) {
+                --nesting;
             }
         }
+        it = ops.erase(it, std::next(end));
     }
+
+    crossreference_conditional(program_file_name, ops);
 }
@@ -1,19 +1,80 @@
 #pragma once
 
+#include <fstream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+
 #define MAX_KEYWORD_LEN 32
 #define TEST_PROGRAM "./examples/test.cl"
-#define MAX_STACK_SIZE 1024
+// Data stack capacity in cells (8 bytes each). Used by both the simulator and
+// the compiled runtime, and can be changed with --stack-size=N at compile time
+// or the CL_STACK_SIZE environment variable at run time. Sizes are rounded
+// up to whole pages of STACK_SIZE_GRANULE cells, the compiled runtime puts
+// guard pages at both ends, so every tier stops at the same depth.
+#define DEFAULT_STACK_SIZE (1024 * 1024)
+#define STR_ENV_STACK_SIZE "CL_STACK_SIZE"
+#define PAGE_SIZE 4096
+#define STACK_SIZE_GRANULE (PAGE_SIZE / 8)
+#define SIGNAL_STACK_SIZE 16384
+// Bytes addressable through `mem`, changed with --mem-size=N up to
+// MAX_MEM_SIZE. The simulator allocates all of it up front.
+#define DEFAULT_MEM_SIZE (1024 * 1024)
+#define MAX_MEM_SIZE (1ull << 36)
+// Bytes of formatted output the compiled runtime can hold before a write,
+// without --buffered-output every dump is written out right away
+#define OUTPUT_BUFFER_SIZE 65536
+// Bytes of stdin read by a single read syscall
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+// With --profile-use, calls from blocks that ran at least PROFILE_HOT_COUNT
+// times inline procedures of up to PROFILE_HOT_INLINE_COST ops, calls from
+// blocks that never ran are not inlined.
+#define PROFILE_HOT_COUNT 1000
+#define PROFILE_HOT_INLINE_COST 48
+#define PROFILE_SUFFIX ".profile"
 
-#define STR_KEYWORD_END "end"
-#define STR_KEYWORD_WHILE "while"
-#define STR_KEYWORD_ELSE "else"
-#define STR_KEYWORD_DUP "dup"
-#define STR_KEYWORD_DO "do"
+// Procedures with at most this many ops are inlined at their call sites,
+// repeating for calls that inlining exposed up to MAX_INLINE_DEPTH times.
+#define INLINE_COST_THRESHOLD 12
+#define MAX_INLINE_DEPTH 4
+// `start end parallel ... reduce +` runs on up to PARALLEL_MAX_WORKERS
+// threads, one per CPU. Every worker starts with a range of indices and
+// takes chunks of about 1/PARALLEL_CHUNKS_PER_WORKER of it, idle workers
+// steal half of what another worker has left. The body runs on a data
+// stack of PARALLEL_STACK_SIZE cells per worker.
+#define PARALLEL_MAX_WORKERS 64
+#define PARALLEL_CHUNKS_PER_WORKER 8
+#define PARALLEL_STACK_SIZE (64 * 1024)
+// --budget and --deadline charge every basic block its number of ops when
+// control enters it. The simulator's threads take the budget from a shared
+// pool METER_CREDIT ops at a time and look at the clock every
+// METER_CLOCK_BLOCKS blocks. Compiled programs keep what is left in r14,
+// their deadline timer fires again every METER_TIMER_INTERVAL_US
+// microseconds until a thread notices.
+#define METER_CREDIT 65536
+#define METER_CLOCK_BLOCKS 1024
+#define METER_TIMER_INTERVAL_US 1000
+// Stack depth assumed by the compile time checks once it is not statically
+// known (inside procedures and after calls)
+#define UNKNOWN_STACK_DEPTH (1 << 30)
 
 enum class Operations {
     OP_PUSH,
     OP_PLUS,
     OP_MINUS,
+    /* unsigned arithmetic and bitwise, shift counts are taken modulo 64 */
+    OP_MULTIPLY,
+    OP_DIVIDE,
+    OP_MODULO,
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
     OP_DUMP,
     OP_EQUALS,
     OP_LESS_THAN_EQ,
@@ -21,6 +82,11 @@ enum class Operations {
     OP_GREATER_THAN,
     OP_GREATER_THAN_EQ,
     OP_DUP,
+    /* stack shuffles */
+    OP_SWAP,    // a b -- b a
+    OP_OVER,    // a b -- a b a
+    OP_ROT,     // a b c -- b c a
+    OP_DROP,    // a --
     /* conditional */
     OP_IF,
     OP_ELSE,
@@ -28,6 +94,28 @@ enum class Operations {
     OP_WHILE,
     OP_DO,
     // end conditional
+    /* procedures */
+    OP_PROC,
+    OP_CALL,
+    /* memory */
+    OP_MEM,
+    OP_LOAD8,
+    OP_STORE8,
+    OP_LOAD64,
+    OP_STORE64,
+    OP_MEM_FILL,
+    OP_MEM_COPY,
+    OP_MEM_SUM,
+    OP_MEM_EQ,
+    /* input */
+    OP_READ_INT,
+    OP_READ_BYTE,
+    /* strings */
+    OP_PUSH_STR,
+    OP_PUTS,
+    /* parallel loops */
+    OP_PARALLEL, // start end --, runs the body for every index in [start, end)
+    OP_REDUCE,   // value --, the operand is the op combining the values
     OP_CNT, // This value is treated as UNKNOWN OPERATION
 };
 
@@ -39,6 +127,7 @@ class Operation {
         int m_line = -1;
         int m_col = -1;
         uint64_t m_jump_loc = 0;
+        std::string m_name;
 
     public:
         Operation() {};
@@ -73,13 +162,38 @@ class Operation {
             m_opr = operand;
         }
 
+        // name of the procedure for OP_PROC and OP_CALL, the text of the
+        // literal for OP_PUSH_STR
+        const std::string &name() const {
+            return m_name;
+        }
+        void name(std::string name) {
+            m_name = std::move(name);
+        }
+
+        // Set by crossreference_conditional(), where control continues:
+        //   OP_IF    - first op of the else branch, or the end when false
+        //   OP_ELSE  - the end of the if
+        //   OP_WHILE - the end of the loop
+        //   OP_DO    - the op after the end of the loop when false
+        //   OP_END   - the op opening the block
+        //   OP_PROC  - the op after the end of the procedure
+        //   OP_CALL  - the called OP_PROC
+        //   OP_PARALLEL - the op after its reduce
+        //   OP_REDUCE   - the OP_PARALLEL
         void jump_loc(uint64_t j) {
             m_jump_loc = j;
         }
         uint64_t jump_loc() const {
             assert((op_type() == Operations::OP_IF ||
                     op_type() == Operations::OP_ELSE ||
-                    op_type() == Operations::OP_WHILE)
+                    op_type() == Operations::OP_WHILE ||
+                    op_type() == Operations::OP_DO ||
+                    op_type() == Operations::OP_END ||
+                    op_type() == Operations::OP_PROC ||
+                    op_type() == Operations::OP_CALL ||
+                    op_type() == Operations::OP_PARALLEL ||
+                    op_type() == Operations::OP_REDUCE)
                   && "jump_loc should not be called with other operands");
             return m_jump_loc;
         }
@@ -89,29 +203,202 @@ class Operation {
 #define STR_OPT_COMPILE "c"
 #define STR_OPT_SIMULATE "s"
 #define STR_OPT_HELP "help"
+#define STR_OPT_SERVE "serve"
+#define STR_OPT_CLIENT "client"
+
+#define STR_OPT_STACK_SIZE "--stack-size="
+#define STR_OPT_MEM_SIZE "--mem-size="
+#define STR_OPT_BUFFERED_OUTPUT "--buffered-output"
+#define STR_OPT_REGISTER_VM "--regvm"
+#define STR_OPT_SSA "--ssa"
+#define STR_OPT_VM_STATS "--vm-stats"
+#define STR_OPT_PROFILE_GENERATE "--profile-generate"
+#define STR_OPT_PROFILE_USE "--profile-use="
+#define STR_OPT_BACKEND "--backend="
+#define STR_OPT_BUDGET "--budget="
+#define STR_OPT_DEADLINE "--deadline="
+#define STR_BACKEND_NASM "nasm"
+#define STR_BACKEND_C "c"
 
 #define OUTPUT_FILENAME "output"
 
+
+// Code generator used by `cl c`
+enum class Backend {
+    NASM,
+    C,
+};
+
+
+// Options shared by the compiler and the simulator.
+struct Options {
+    uint64_t stack_size = DEFAULT_STACK_SIZE;
+    uint64_t mem_size = DEFAULT_MEM_SIZE;
+    bool buffered_output = false;
+    // simulate through the register bytecode in regvm.cpp when possible
+    bool register_vm = false;
+    // optimize in SSA form before translating to register bytecode, see
+    // ssa.cpp
+    bool ssa = false;
+    // report the number of executed instructions after simulating
+    bool vm_stats = false;
+    // count basic block executions in compiled programs, written to
+    // profile_path on exit
+    bool profile_generate = false;
+    std::string profile_path;
+    // block profile guiding inlining, empty when not given
+    std::string profile_use;
+    Backend backend = Backend::NASM;
+    // stop after running this many ops, 0 for no limit
+    uint64_t budget = 0;
+    // stop after this many milliseconds of wall clock time, 0 for no limit
+    uint64_t deadline_ms = 0;
+};
+
+
+// A counted basic block of a compiled program. Blocks are keyed by the
+// line and column of the op they start at, the entry block by 0 0.
+struct ProfiledBlock {
+    int line;
+    int col;
+    const char *kind;
+};
+
+// Execution count of every block read back from a profile file
+using BlockProfile = std::map<std::pair<int, int>, uint64_t>;
+
+
+// A value on top of the data stack that the code generator has not
+// pushed yet: a register (index into stack_registers) or a constant.
+struct PendingValue {
+    int reg = -1;
+    uint64_t constant = 0;
+};
+
+
+// Code generation state carried between generate_ops_asm() calls, so a
+// Block checking the budget, see add_meter_asm()
+struct MeterSite {
+    uint64_t ip;
+    // static stack depth or UNKNOWN_STACK_DEPTH
+    int depth;
+    // inside a parallel body, where the thread first claims more ops
+    bool parallel;
+};
+
+
+// program can be emitted in one go or one top level block at a time.
+struct CodegenState {
+    int mock_stack_size = 0;
+    // values above the data stack in memory, top last. Within a basic
+    // block pushes, shuffles and arithmetic only rearrange these, they are
+    // pushed at block boundaries and before any other op.
+    std::vector<PendingValue> pending;
+    // offset of every string literal in string_table
+    std::map<std::string, uint64_t> strings;
+    std::vector<ProfiledBlock> blocks;
+    // inside the body of a parallel loop, which other threads run as well
+    bool in_parallel = false;
+    // block_costs() of the program under --budget and --deadline, empty
+    // otherwise
+    std::vector<uint32_t> block_costs;
+    std::vector<MeterSite> meter_sites;
+};
+
+
+// Values an operation pops and then pushes, from its op_table entry.
+// Calls are not included.
+struct StackEffect {
+    int pops;
+    int pushes;
+};
+
+
+// stdin for the simulator, read in INPUT_BUFFER_SIZE chunks like the
+// compiled runtime
+struct SimInput {
+    std::vector<char> buffer = std::vector<char>(INPUT_BUFFER_SIZE);
+    size_t pos = 0;
+    size_t len = 0;
+};
+
 [[nodiscard("every op is needed")]] std::list<Operation> parse_program(std::string program_file_name);
 [[nodiscard("every op is needed")]] std::list<Operation> parse_op_from_line(std::string line);
+Operations keyword_operation(const std::string &word);
+void finish_parsing(std::string program_file_name, std::list<Operation> &ops);
+void bind_procedure_names(std::string program_file_name, std::list<Operation> &ops);
+void bind_reduce_operators(std::string program_file_name, std::list<Operation> &ops);
+
 
+Options parse_options(int argc, char **argv, std::string &program_file_name);
+uint64_t parse_size_option(const std::string &arg, const char *option);
+uint64_t round_stack_size(uint64_t cells);
+uint64_t stack_size_from_env(uint64_t default_size);
 
+void prepare_compilation(const std::string &program_file_name,
+        std::list<Operation> &operations, Options &options);
+void simulate(const std::string &program_file_name,
+        std::list<Operation> &operations, Options &options);
 void simulate_program(std::string program_file_name,
-        std::list<Operation> &operations_list);
-void crossreference_conditional(std::list<Operation> &ops);
+        std::list<Operation> &operations_list, const Options &options);
+StackEffect stack_effect(Operations op);
+bool is_metered(const Options &options);
+std::vector<uint32_t> block_costs(const std::vector<Operation> &program);
+bool is_tail_call(const std::vector<Operation> &program, uint64_t ip);
+void crossreference_conditional(std::string program_file_name,
+        std::list<Operation> &ops);
+void inline_procedures(std::string program_file_name, std::list<Operation> &ops,
+        const BlockProfile *profile = nullptr);
+bool read_block_profile(const std::string &path, BlockProfile &profile);
 
-void compile_program(std::string output_filename,
-        std::list<Operation> &operations_list);
-void add_boilerplate_asm(std::ofstream& out_file);
+void compile_program(std::string output_filename, const std::string &program_file_name,
+        std::list<Operation> &operations_list, const Options &options);
+void generate_ops_asm(std::ofstream& out_file, const std::string &error_file_name,
+        const std::vector<Operation> &program, uint64_t begin, uint64_t end,
+        const Options &options, CodegenState &state);
+bool generate_stack_op_asm(std::ofstream& out_file, const Operation &op,
+        CodegenState &state);
+void flush_stack_asm(std::ofstream& out_file, CodegenState &state);
+void add_arithmetic_asm(std::ofstream& out_file, Operations op_type);
+void add_arithmetic_constant_asm(std::ofstream& out_file, Operations op_type,
+        uint64_t constant);
+void add_multiply_constant_asm(std::ofstream& out_file, uint64_t constant,
+        const std::string &reg);
+void add_block_counter_asm(std::ofstream& out_file, const Options &options,
+        CodegenState &state, const Operation *op, const char *kind);
+void add_meter_asm(std::ofstream& out_file, CodegenState &state, uint64_t ip, bool check);
+void add_exit_asm(std::ofstream& out_file, const Options &options);
+void add_boilerplate_asm(std::ofstream& out_file, const Options &options);
+void add_memory_kernels_asm(std::ofstream& out_file);
+void add_parallel_runtime_asm(std::ofstream& out_file, const Options &options);
+void add_input_runtime_asm(std::ofstream& out_file);
+void add_data_segments_asm(std::ofstream& out_file, const Options &options,
+        const std::string &string_table);
+void add_string_table_asm(std::ofstream& out_file, const std::string &table);
+std::map<std::string, uint64_t> intern_strings(const std::vector<Operation> &program,
+        std::string &table);
+void add_block_profile_asm(std::ofstream& out_file,
+        const std::vector<ProfiledBlock> &blocks, const Options &options);
+void add_meter_runtime_asm(std::ofstream& out_file, const std::string &program_file_name,
+        const std::vector<Operation> &program, const CodegenState &state,
+        const Options &options);
+
+bool check_memory_range(const std::string& program_file_name, const Operation &op,
+        uint64_t addr, uint64_t size, uint64_t mem_size);
+bool sim_input_refill(SimInput &input);
+bool sim_read_int(SimInput &input, uint64_t &value);
+bool sim_read_byte(SimInput &input, uint64_t &value);
+std::vector<uint8_t> allocate_sim_memory(uint64_t size);
+void sim_mem_fill(uint8_t *dst, uint64_t count, uint8_t value);
+void sim_mem_copy(const uint8_t *src, uint8_t *dst, uint64_t count);
+uint64_t sim_mem_sum(const uint8_t *src, uint64_t words);
+bool sim_mem_eq(const uint8_t *a, const uint8_t *b, uint64_t count);
 int generate_asm_for_if_else(std::ofstream& out_file,
         std::list<Operation>::iterator begin,
         std::list<Operation>::iterator end,
         uint64_t ip);
 void exec(const std::string cmd);
 
-bool is_comparison_operation(Operations op_type);
-bool is_conditional_op(Operations op_type);
-
 void print_usage(std::string program);
 void print_help();
 void print_error(const std::string& program_file_name, const int line_num,
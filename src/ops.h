@@ -0,0 +1,281 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "main.h"
+
+
+// Every operation is described once in op_table below. The lexer, the
+// stack checks of the simulator and both code generators, constant
+// folding and the stack depth analyses all read it. A new comparison or
+// single instruction binary op needs its entry and a register form in
+// regvm.cpp. Ops with their own behaviour (control flow, memory, I/O)
+// still need a case in the simulator and code generators.
+enum class OpKind : uint8_t {
+    VALUE,      // pushes a constant, an address or input
+    BINARY,     // b a -- fold(b, a)
+    COMPARISON, // b a -- fold(b, a), 0 or 1
+    SHUFFLE,    // rearranges or drops the top values
+    CONTROL,    // if, else, end, while, do, proc and calls
+    MEMORY,     // loads, stores and the bulk operations
+    OUTPUT,     // dump and puts
+    INVALID,    // OP_CNT, anything the lexer did not recognize
+};
+
+
+using FoldFn = uint64_t (*)(uint64_t b, uint64_t a);
+
+
+struct OpInfo {
+    Operations op;
+    // keyword or symbol, empty for ops without a fixed spelling
+    std::string_view spelling;
+    // name in error messages
+    const char *name;
+    int pops;
+    int pushes;
+    OpKind kind;
+    // `b a op` for BINARY and COMPARISON ops, unsigned 64 bit
+    FoldFn fold = nullptr;
+    // a == 0 is a runtime error
+    bool divides = false;
+    // x86 instruction computing `dst = dst op src` for the binary ops that
+    // have one, setcc condition for comparisons
+    const char *asm_instr = nullptr;
+    const char *asm_condition = nullptr;
+    // C expression for BINARY and COMPARISON ops, {b} and {a} stand for
+    // the operands
+    const char *c_expr = nullptr;
+    // associative and commutative, usable after `reduce`, with the value
+    // of a reduction over no indices
+    bool reduces = false;
+    uint64_t identity = 0;
+};
+
+
+// Indexed by Operations, OP_CNT last
+inline constexpr OpInfo op_table[] = {
+    {.op = Operations::OP_PUSH, .spelling = "", .name = "OP_PUSH",
+        .pops = 0, .pushes = 1, .kind = OpKind::VALUE},
+    {.op = Operations::OP_PLUS, .spelling = "+", .name = "OP_PLUS(+)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b + a; },
+        .asm_instr = "add", .c_expr = "{b} + {a}", .reduces = true},
+    {.op = Operations::OP_MINUS, .spelling = "-", .name = "OP_MINUS(-)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b - a; },
+        .asm_instr = "sub", .c_expr = "{b} - {a}"},
+    {.op = Operations::OP_MULTIPLY, .spelling = "*", .name = "OP_MULTIPLY(*)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b * a; },
+        .c_expr = "{b} * {a}", .reduces = true, .identity = 1},
+    {.op = Operations::OP_DIVIDE, .spelling = "/", .name = "OP_DIVIDE(/)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b / a; }, .divides = true,
+        .c_expr = "{b} / {a}"},
+    {.op = Operations::OP_MODULO, .spelling = "%", .name = "OP_MODULO(%)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b % a; }, .divides = true,
+        .c_expr = "{b} % {a}"},
+    {.op = Operations::OP_BIT_AND, .spelling = "&", .name = "OP_BIT_AND(&)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b & a; },
+        .asm_instr = "and", .c_expr = "{b} & {a}", .reduces = true, .identity = ~0ull},
+    {.op = Operations::OP_BIT_OR, .spelling = "|", .name = "OP_BIT_OR(|)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b | a; },
+        .asm_instr = "or", .c_expr = "{b} | {a}", .reduces = true},
+    {.op = Operations::OP_BIT_XOR, .spelling = "^", .name = "OP_BIT_XOR(^)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b ^ a; },
+        .asm_instr = "xor", .c_expr = "{b} ^ {a}", .reduces = true},
+    // shift counts are taken modulo 64 like the x86 shifts
+    {.op = Operations::OP_SHIFT_LEFT, .spelling = "<<", .name = "OP_SHIFT_LEFT(<<)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b << (a & 63); },
+        .c_expr = "{b} << ({a} & 63)"},
+    {.op = Operations::OP_SHIFT_RIGHT, .spelling = ">>", .name = "OP_SHIFT_RIGHT(>>)",
+        .pops = 2, .pushes = 1, .kind = OpKind::BINARY,
+        .fold = [](uint64_t b, uint64_t a) { return b >> (a & 63); },
+        .c_expr = "{b} >> ({a} & 63)"},
+    {.op = Operations::OP_DUMP, .spelling = ".", .name = "OP_DUMP",
+        .pops = 1, .pushes = 0, .kind = OpKind::OUTPUT},
+    {.op = Operations::OP_EQUALS, .spelling = "=", .name = "OP_EQUALS(=)",
+        .pops = 2, .pushes = 1, .kind = OpKind::COMPARISON,
+        .fold = [](uint64_t b, uint64_t a) -> uint64_t { return b == a; },
+        .asm_condition = "e", .c_expr = "(cell)({b} == {a})"},
+    {.op = Operations::OP_LESS_THAN_EQ, .spelling = "<=", .name = "OP_LESS_THAN_EQ(<=)",
+        .pops = 2, .pushes = 1, .kind = OpKind::COMPARISON,
+        .fold = [](uint64_t b, uint64_t a) -> uint64_t { return b <= a; },
+        .asm_condition = "be", .c_expr = "(cell)({b} <= {a})"},
+    {.op = Operations::OP_LESS_THAN, .spelling = "<", .name = "OP_LESS_THAN(<)",
+        .pops = 2, .pushes = 1, .kind = OpKind::COMPARISON,
+        .fold = [](uint64_t b, uint64_t a) -> uint64_t { return b < a; },
+        .asm_condition = "b", .c_expr = "(cell)({b} < {a})"},
+    {.op = Operations::OP_GREATER_THAN, .spelling = ">", .name = "OP_GREATER_THAN(>)",
+        .pops = 2, .pushes = 1, .kind = OpKind::COMPARISON,
+        .fold = [](uint64_t b, uint64_t a) -> uint64_t { return b > a; },
+        .asm_condition = "a", .c_expr = "(cell)({b} > {a})"},
+    {.op = Operations::OP_GREATER_THAN_EQ, .spelling = ">=", .name = "OP_GREATER_THAN_EQ(>=)",
+        .pops = 2, .pushes = 1, .kind = OpKind::COMPARISON,
+        .fold = [](uint64_t b, uint64_t a) -> uint64_t { return b >= a; },
+        .asm_condition = "ae", .c_expr = "(cell)({b} >= {a})"},
+    {.op = Operations::OP_DUP, .spelling = "dup", .name = "OP_DUP",
+        .pops = 1, .pushes = 2, .kind = OpKind::SHUFFLE},
+    {.op = Operations::OP_SWAP, .spelling = "swap", .name = "OP_SWAP",
+        .pops = 2, .pushes = 2, .kind = OpKind::SHUFFLE},
+    {.op = Operations::OP_OVER, .spelling = "over", .name = "OP_OVER",
+        .pops = 2, .pushes = 3, .kind = OpKind::SHUFFLE},
+    {.op = Operations::OP_ROT, .spelling = "rot", .name = "OP_ROT",
+        .pops = 3, .pushes = 3, .kind = OpKind::SHUFFLE},
+    {.op = Operations::OP_DROP, .spelling = "drop", .name = "OP_DROP",
+        .pops = 1, .pushes = 0, .kind = OpKind::SHUFFLE},
+    {.op = Operations::OP_IF, .spelling = "if", .name = "OP_IF",
+        .pops = 1, .pushes = 0, .kind = OpKind::CONTROL},
+    {.op = Operations::OP_ELSE, .spelling = "else", .name = "OP_ELSE",
+        .pops = 0, .pushes = 0, .kind = OpKind::CONTROL},
+    {.op = Operations::OP_END, .spelling = "end", .name = "OP_END",
+        .pops = 0, .pushes = 0, .kind = OpKind::CONTROL},
+    {.op = Operations::OP_WHILE, .spelling = "while", .name = "OP_WHILE",
+        .pops = 0, .pushes = 0, .kind = OpKind::CONTROL},
+    {.op = Operations::OP_DO, .spelling = "do", .name = "OP_DO",
+        .pops = 1, .pushes = 0, .kind = OpKind::CONTROL},
+    {.op = Operations::OP_PROC, .spelling = "proc", .name = "OP_PROC",
+        .pops = 0, .pushes = 0, .kind = OpKind::CONTROL},
+    // any word that is no keyword, the callee's effect is not known here
+    {.op = Operations::OP_CALL, .spelling = "", .name = "OP_CALL",
+        .pops = 0, .pushes = 0, .kind = OpKind::CONTROL},
+    {.op = Operations::OP_MEM, .spelling = "mem", .name = "OP_MEM",
+        .pops = 0, .pushes = 1, .kind = OpKind::VALUE},
+    {.op = Operations::OP_LOAD8, .spelling = "@8", .name = "OP_LOAD8",
+        .pops = 1, .pushes = 1, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_STORE8, .spelling = "!8", .name = "OP_STORE8",
+        .pops = 2, .pushes = 0, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_LOAD64, .spelling = "@64", .name = "OP_LOAD64",
+        .pops = 1, .pushes = 1, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_STORE64, .spelling = "!64", .name = "OP_STORE64",
+        .pops = 2, .pushes = 0, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_MEM_FILL, .spelling = "memfill", .name = "OP_MEM_FILL",
+        .pops = 3, .pushes = 0, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_MEM_COPY, .spelling = "memcopy", .name = "OP_MEM_COPY",
+        .pops = 3, .pushes = 0, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_MEM_SUM, .spelling = "memsum", .name = "OP_MEM_SUM",
+        .pops = 2, .pushes = 1, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_MEM_EQ, .spelling = "memeq", .name = "OP_MEM_EQ",
+        .pops = 3, .pushes = 1, .kind = OpKind::MEMORY},
+    {.op = Operations::OP_READ_INT, .spelling = "readint", .name = "OP_READ_INT",
+        .pops = 0, .pushes = 2, .kind = OpKind::VALUE},
+    {.op = Operations::OP_READ_BYTE, .spelling = "readbyte", .name = "OP_READ_BYTE",
+        .pops = 0, .pushes = 2, .kind = OpKind::VALUE},
+    {.op = Operations::OP_PUSH_STR, .spelling = "", .name = "OP_PUSH_STR",
+        .pops = 0, .pushes = 2, .kind = OpKind::VALUE},
+    {.op = Operations::OP_PUTS, .spelling = "puts", .name = "OP_PUTS",
+        .pops = 2, .pushes = 0, .kind = OpKind::OUTPUT},
+    // the body starts with the index on an empty stack of its own
+    {.op = Operations::OP_PARALLEL, .spelling = "parallel", .name = "OP_PARALLEL",
+        .pops = 2, .pushes = 0, .kind = OpKind::CONTROL},
+    // the value of the iteration, the reduction of all of them is pushed
+    // after the loop
+    {.op = Operations::OP_REDUCE, .spelling = "reduce", .name = "OP_REDUCE",
+        .pops = 1, .pushes = 0, .kind = OpKind::CONTROL},
+    {.op = Operations::OP_CNT, .spelling = "", .name = "unknown operation",
+        .pops = 0, .pushes = 0, .kind = OpKind::INVALID},
+};
+
+inline constexpr size_t OP_TABLE_SIZE = std::size(op_table);
+
+
+constexpr bool op_table_complete() {
+    for (size_t i = 0; i < OP_TABLE_SIZE; ++i) {
+        if (static_cast<size_t>(op_table[i].op) != i) {
+            return false;
+        }
+    }
+    return OP_TABLE_SIZE == static_cast<size_t>(Operations::OP_CNT) + 1;
+}
+static_assert(op_table_complete(), "op_table needs one entry per operation, in enum order");
+
+
+constexpr const OpInfo &op_info(Operations op) {
+    return op_table[static_cast<size_t>(op)];
+}
+
+
+// Perfect hash of the spellings: the first, middle and last character and
+// the length are packed into one word and multiplied by a seed found at
+// compile time, the top bits index a table with at most one spelling per
+// slot. A lookup is one multiplication and one comparison, no matter how
+// many keywords there are.
+inline constexpr size_t SPELLING_HASH_BITS = 8;
+
+constexpr size_t spelling_hash(std::string_view word, uint64_t seed) {
+    uint64_t key = static_cast<uint8_t>(word.front())
+        | static_cast<uint64_t>(static_cast<uint8_t>(word[word.size() / 2])) << 8
+        | static_cast<uint64_t>(static_cast<uint8_t>(word.back())) << 16
+        | static_cast<uint64_t>(word.size()) << 24;
+    return static_cast<size_t>((key * seed) >> (64 - SPELLING_HASH_BITS));
+}
+
+
+struct SpellingTable {
+    uint64_t seed = 0;
+    // index into op_table, OP_CNT for empty slots
+    std::array<uint8_t, size_t(1) << SPELLING_HASH_BITS> slots{};
+};
+
+
+constexpr SpellingTable make_spelling_table() {
+    for (uint64_t attempt = 1; attempt < 100000; ++attempt) {
+        SpellingTable table;
+        // odd multipliers spread over the whole 64 bit range
+        table.seed = (attempt * 0x9e3779b97f4a7c15u) | 1;
+        table.slots.fill(static_cast<uint8_t>(Operations::OP_CNT));
+        bool collision = false;
+        for (size_t i = 0; i < OP_TABLE_SIZE && !collision; ++i) {
+            if (op_table[i].spelling.empty()) {
+                continue;
+            }
+            uint8_t &slot = table.slots[spelling_hash(op_table[i].spelling, table.seed)];
+            collision = slot != static_cast<uint8_t>(Operations::OP_CNT);
+            slot = static_cast<uint8_t>(i);
+        }
+        if (!collision) {
+            return table;
+        }
+    }
+    return SpellingTable();
+}
+
+inline constexpr SpellingTable spelling_table = make_spelling_table();
+static_assert(spelling_table.seed != 0, "no perfect hash for the op spellings");
+
+
+// The op spelled word, OP_CNT when it is no keyword or symbol
+constexpr Operations lookup_spelling(std::string_view word) {
+    if (word.empty()) {
+        return Operations::OP_CNT;
+    }
+    const OpInfo &info = op_table[spelling_table.slots[spelling_hash(word, spelling_table.seed)]];
+    return info.spelling == word ? info.op : Operations::OP_CNT;
+}
+
+
+// Longest spelling not starting with a letter, the lexer tries symbols of
+// this length down to one character
+constexpr size_t max_symbol_length() {
+    size_t longest = 0;
+    for (const OpInfo &info : op_table) {
+        bool letter = !info.spelling.empty()
+            && ((info.spelling[0] >= 'a' && info.spelling[0] <= 'z') || info.spelling[0] == '_');
+        if (!letter && info.spelling.size() > longest) {
+            longest = info.spelling.size();
+        }
+    }
+    return longest;
+}
+
+inline constexpr size_t MAX_SYMBOL_LEN = max_symbol_length();
@@ -0,0 +1,606 @@
+#include <iostream>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "main.h"
+#include "ops.h"
+#include "regvm.h"
+
+
+// Finds the stack depth before every op, following if/else/while edges.
+// Fails when a depth depends on the path taken (unbalanced branches or
+// loops), when an op would underflow, or for procedure calls and parallel
+// loops.
+bool compute_stack_depths(const std::vector<Operation> &program,
+        std::vector<int64_t> &depths, std::string &reason) {
+    depths.assign(program.size() + 1, -1);
+    std::vector<uint64_t> worklist;
+
+    auto reach = [&](uint64_t ip, int64_t depth, const Operation &from) {
+        if (depths[ip] == -1) {
+            depths[ip] = depth;
+            worklist.push_back(ip);
+            return true;
+        }
+        if (depths[ip] != depth) {
+            reason = "stack depth depends on the branch taken at "
+                + std::to_string(from.line()) + ":" + std::to_string(from.col());
+            return false;
+        }
+        return true;
+    };
+
+    if (program.empty()) {
+        depths[0] = 0;
+        return true;
+    }
+    depths[0] = 0;
+    worklist.push_back(0);
+    while (!worklist.empty()) {
+        uint64_t ip = worklist.back();
+        worklist.pop_back();
+        if (ip == program.size()) {
+            continue;
+        }
+
+        const Operation &op = program[ip];
+        if (op.op_type() == Operations::OP_PROC || op.op_type() == Operations::OP_CALL) {
+            reason = "procedure " + op.name() + " is not inlined";
+            return false;
+        }
+        if (op.op_type() == Operations::OP_PARALLEL) {
+            reason = "parallel loop at " + std::to_string(op.line()) + ":"
+                + std::to_string(op.col()) + " runs on the stack simulator";
+            return false;
+        }
+        StackEffect effect = stack_effect(op.op_type());
+        if (depths[ip] < effect.pops) {
+            reason = "possible stack underflow at "
+                + std::to_string(op.line()) + ":" + std::to_string(op.col());
+            return false;
+        }
+        int64_t depth = depths[ip] - effect.pops + effect.pushes;
+
+        bool ok = true;
+        switch (op.op_type()) {
+            case Operations::OP_IF:
+            case Operations::OP_DO:
+                ok = reach(ip + 1, depth, op) && reach(op.jump_loc(), depth, op);
+                break;
+            case Operations::OP_ELSE:
+                ok = reach(op.jump_loc(), depth, op);
+                break;
+            case Operations::OP_END:
+                if (program[op.jump_loc()].op_type() == Operations::OP_WHILE) {
+                    ok = reach(op.jump_loc(), depth, op);
+                }
+                else {
+                    ok = reach(ip + 1, depth, op);
+                }
+                break;
+            default:
+                ok = reach(ip + 1, depth, op);
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool is_comparison(Operations op) {
+    return op_info(op).kind == OpKind::COMPARISON;
+}
+
+
+// binary ops and comparisons, every one has a form in binary_reg_op()
+static bool is_binary_arithmetic(Operations op) {
+    return op_info(op).fold != nullptr;
+}
+
+
+// division by zero is reported by the register form
+static bool is_division(Operations op) {
+    return op_info(op).divides;
+}
+
+
+static bool is_branch(Operations op) {
+    return op == Operations::OP_IF || op == Operations::OP_DO;
+}
+
+
+// register-register, register-immediate, branch and immediate branch form
+// of every binary op
+RegOp binary_reg_op(Operations op, bool immediate, bool branch) {
+    struct Forms { Operations op; RegOp reg; RegOp imm; RegOp jf; RegOp jf_imm; };
+    static const Forms forms[] = {
+        {Operations::OP_PLUS, RegOp::ADD, RegOp::ADDI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_MINUS, RegOp::SUB, RegOp::SUBI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_MULTIPLY, RegOp::MUL, RegOp::MULI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_DIVIDE, RegOp::DIV, RegOp::DIVI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_MODULO, RegOp::MOD, RegOp::MODI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_BIT_AND, RegOp::AND, RegOp::ANDI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_BIT_OR, RegOp::OR, RegOp::ORI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_BIT_XOR, RegOp::XOR, RegOp::XORI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_SHIFT_LEFT, RegOp::SHL, RegOp::SHLI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_SHIFT_RIGHT, RegOp::SHR, RegOp::SHRI, RegOp::HALT, RegOp::HALT},
+        {Operations::OP_EQUALS, RegOp::EQ, RegOp::EQI, RegOp::JF_EQ, RegOp::JF_EQI},
+        {Operations::OP_LESS_THAN, RegOp::LT, RegOp::LTI, RegOp::JF_LT, RegOp::JF_LTI},
+        {Operations::OP_LESS_THAN_EQ, RegOp::LE, RegOp::LEI, RegOp::JF_LE, RegOp::JF_LEI},
+        {Operations::OP_GREATER_THAN, RegOp::GT, RegOp::GTI, RegOp::JF_GT, RegOp::JF_GTI},
+        {Operations::OP_GREATER_THAN_EQ, RegOp::GE, RegOp::GEI, RegOp::JF_GE, RegOp::JF_GEI},
+    };
+    for (const auto &form : forms) {
+        if (form.op == op) {
+            if (branch) {
+                return immediate ? form.jf_imm : form.jf;
+            }
+            return immediate ? form.imm : form.reg;
+        }
+    }
+    assert(false && "not a binary op");
+    return RegOp::HALT;
+}
+
+
+// Translates the cross referenced op list into register bytecode. Ops that
+// are not jump targets are fused with the op before them:
+//   N op          -> opI            N .         -> PRINTI
+//   cmp if/do     -> JF_cmp         dup .       -> PRINT
+//   N cmp if/do   -> JF_cmpI        dup N cmp   -> cmpI into a new register
+//   dup N cmp if/do -> JF_cmpI on the duplicated register
+bool translate_to_registers(const std::vector<Operation> &program,
+        RegProgram &reg_program, std::string &reason) {
+    std::vector<int64_t> depths;
+    if (!compute_stack_depths(program, depths, reason)) {
+        return false;
+    }
+
+    uint64_t n = program.size();
+    std::vector<bool> is_target(n + 1, false);
+    int64_t max_depth = 0;
+    for (uint64_t ip = 0; ip < n; ++ip) {
+        const Operation &op = program[ip];
+        switch (op.op_type()) {
+            case Operations::OP_IF:
+            case Operations::OP_ELSE:
+            case Operations::OP_DO:
+                is_target[op.jump_loc()] = true;
+                break;
+            case Operations::OP_END:
+                if (program[op.jump_loc()].op_type() == Operations::OP_WHILE) {
+                    is_target[op.jump_loc()] = true;
+                }
+                break;
+            default:
+                break;
+        }
+        if (depths[ip] >= 0) {
+            StackEffect effect = stack_effect(op.op_type());
+            max_depth = std::max(max_depth, depths[ip] - effect.pops + effect.pushes);
+        }
+    }
+    reg_program.registers = static_cast<uint32_t>(max_depth + 1);
+
+    auto fusable = [&](uint64_t ip) {
+        return ip < n && !is_target[ip] && depths[ip] >= 0;
+    };
+
+    std::vector<RegInstr> &code = reg_program.code;
+    code.clear();
+    std::vector<uint32_t> start(n + 1, 0);
+    // instructions whose target is still an op index
+    std::vector<size_t> fixups;
+
+    uint64_t ip = 0;
+    while (ip < n) {
+        start[ip] = static_cast<uint32_t>(code.size());
+        if (depths[ip] < 0) {
+            ++ip;
+            continue;
+        }
+
+        const Operation &op = program[ip];
+        uint32_t d = static_cast<uint32_t>(depths[ip]);
+        RegInstr in;
+        in.src = static_cast<uint32_t>(ip);
+        uint64_t consumed = 1;
+        bool emit = true;
+
+        switch (op.op_type()) {
+            case Operations::OP_PUSH:
+                in.imm = op.operand();
+                if (fusable(ip + 1) && program[ip + 1].op_type() == Operations::OP_DUMP) {
+                    in.op = RegOp::PRINTI;
+                    consumed = 2;
+                }
+                else if (fusable(ip + 1) && is_binary_arithmetic(program[ip + 1].op_type()) &&
+                        !(op.operand() == 0 && is_division(program[ip + 1].op_type()))) {
+                    Operations binary = program[ip + 1].op_type();
+                    in.a = d - 1;
+                    if (is_comparison(binary) && fusable(ip + 2) &&
+                            is_branch(program[ip + 2].op_type())) {
+                        in.op = binary_reg_op(binary, true, true);
+                        in.target = static_cast<uint32_t>(program[ip + 2].jump_loc());
+                        fixups.push_back(code.size());
+                        consumed = 3;
+                    }
+                    else {
+                        in.op = binary_reg_op(binary, true, false);
+                        in.d = d - 1;
+                        consumed = 2;
+                    }
+                }
+                else {
+                    in.op = RegOp::MOVI;
+                    in.d = d;
+                }
+                break;
+
+            case Operations::OP_DUP:
+                in.a = d - 1;
+                if (fusable(ip + 1) && program[ip + 1].op_type() == Operations::OP_DUMP) {
+                    in.op = RegOp::PRINT;
+                    consumed = 2;
+                }
+                else if (fusable(ip + 1) && program[ip + 1].op_type() == Operations::OP_PUSH &&
+                        fusable(ip + 2) && is_comparison(program[ip + 2].op_type())) {
+                    Operations binary = program[ip + 2].op_type();
+                    in.imm = program[ip + 1].operand();
+                    if (fusable(ip + 3) && is_branch(program[ip + 3].op_type())) {
+                        in.op = binary_reg_op(binary, true, true);
+                        in.target = static_cast<uint32_t>(program[ip + 3].jump_loc());
+                        fixups.push_back(code.size());
+                        consumed = 4;
+                    }
+                    else {
+                        in.op = binary_reg_op(binary, true, false);
+                        in.d = d;
+                        consumed = 3;
+                    }
+                }
+                else {
+                    in.op = RegOp::MOV;
+                    in.d = d;
+                }
+                break;
+
+            case Operations::OP_SWAP:
+                in.op = RegOp::SWAP;
+                in.a = d - 2;
+                in.b = d - 1;
+                break;
+
+            case Operations::OP_OVER:
+                in.op = RegOp::MOV;
+                in.d = d;
+                in.a = d - 2;
+                break;
+
+            case Operations::OP_ROT:
+                in.op = RegOp::ROT;
+                in.a = d - 3;
+                break;
+
+            case Operations::OP_DROP:
+                emit = false;
+                break;
+
+            case Operations::OP_PLUS:
+            case Operations::OP_MINUS:
+            case Operations::OP_MULTIPLY:
+            case Operations::OP_DIVIDE:
+            case Operations::OP_MODULO:
+            case Operations::OP_BIT_AND:
+            case Operations::OP_BIT_OR:
+            case Operations::OP_BIT_XOR:
+            case Operations::OP_SHIFT_LEFT:
+            case Operations::OP_SHIFT_RIGHT:
+            case Operations::OP_EQUALS:
+            case Operations::OP_LESS_THAN:
+            case Operations::OP_LESS_THAN_EQ:
+            case Operations::OP_GREATER_THAN:
+            case Operations::OP_GREATER_THAN_EQ:
+                in.a = d - 2;
+                in.b = d - 1;
+                if (is_comparison(op.op_type()) && fusable(ip + 1) &&
+                        is_branch(program[ip + 1].op_type())) {
+                    in.op = binary_reg_op(op.op_type(), false, true);
+                    in.target = static_cast<uint32_t>(program[ip + 1].jump_loc());
+                    fixups.push_back(code.size());
+                    consumed = 2;
+                }
+                else {
+                    in.op = binary_reg_op(op.op_type(), false, false);
+                    in.d = d - 2;
+                }
+                break;
+
+            case Operations::OP_DUMP:
+                in.op = RegOp::PRINT;
+                in.a = d - 1;
+                break;
+
+            case Operations::OP_IF:
+            case Operations::OP_DO:
+                in.op = RegOp::JZ;
+                in.a = d - 1;
+                in.target = static_cast<uint32_t>(op.jump_loc());
+                fixups.push_back(code.size());
+                break;
+
+            case Operations::OP_ELSE:
+                in.op = RegOp::JMP;
+                in.target = static_cast<uint32_t>(op.jump_loc());
+                fixups.push_back(code.size());
+                break;
+
+            case Operations::OP_END:
+                if (program[op.jump_loc()].op_type() == Operations::OP_WHILE) {
+                    in.op = RegOp::JMP;
+                    in.target = static_cast<uint32_t>(op.jump_loc());
+                    fixups.push_back(code.size());
+                }
+                else {
+                    emit = false;
+                }
+                break;
+
+            case Operations::OP_WHILE:
+                emit = false;
+                break;
+
+            // address 0 like simulate_op<OP_MEM>()
+            case Operations::OP_MEM:
+                in.op = RegOp::MOVI;
+                in.d = d;
+                in.imm = 0;
+                break;
+
+            case Operations::OP_LOAD8:
+            case Operations::OP_LOAD64:
+                in.op = op.op_type() == Operations::OP_LOAD8 ? RegOp::LOAD8 : RegOp::LOAD64;
+                in.d = d - 1;
+                in.a = d - 1;
+                break;
+
+            case Operations::OP_STORE8:
+            case Operations::OP_STORE64:
+                in.op = op.op_type() == Operations::OP_STORE8 ? RegOp::STORE8 : RegOp::STORE64;
+                in.a = d - 2;
+                in.b = d - 1;
+                break;
+
+            case Operations::OP_MEM_FILL:
+            case Operations::OP_MEM_COPY:
+            case Operations::OP_MEM_EQ:
+                in.op = op.op_type() == Operations::OP_MEM_FILL ? RegOp::MEM_FILL
+                    : op.op_type() == Operations::OP_MEM_COPY ? RegOp::MEM_COPY : RegOp::MEM_EQ;
+                in.d = d - 3;
+                in.a = d - 3;
+                in.b = d - 2;
+                in.c = d - 1;
+                break;
+
+            case Operations::OP_MEM_SUM:
+                in.op = RegOp::MEM_SUM;
+                in.d = d - 2;
+                in.a = d - 2;
+                in.b = d - 1;
+                break;
+
+            case Operations::OP_READ_INT:
+            case Operations::OP_READ_BYTE:
+                in.op = op.op_type() == Operations::OP_READ_INT ? RegOp::READ_INT : RegOp::READ_BYTE;
+                in.d = d;
+                break;
+
+            default:
+                reason = "unsupported operation at "
+                    + std::to_string(op.line()) + ":" + std::to_string(op.col());
+                return false;
+        }
+
+        if (emit) {
+            code.push_back(in);
+        }
+        for (uint64_t i = 1; i < consumed; ++i) {
+            start[ip + i] = start[ip];
+        }
+        ip += consumed;
+    }
+    start[n] = static_cast<uint32_t>(code.size());
+    RegInstr halt;
+    halt.op = RegOp::HALT;
+    halt.src = static_cast<uint32_t>(n == 0 ? 0 : n - 1);
+    code.push_back(halt);
+
+    for (size_t i : fixups) {
+        code[i].target = start[code[i].target];
+    }
+    return true;
+}
+
+
+void run_register_program(const std::string &program_file_name,
+        const std::vector<Operation> &program, const RegProgram &reg_program,
+        const Options &options) {
+    std::vector<uint64_t> r(reg_program.registers);
+    std::vector<uint8_t> memory = allocate_sim_memory(options.mem_size);
+    SimInput input;
+    const RegInstr *code = reg_program.code.data();
+    uint64_t executed = 0;
+
+    auto in_memory = [&](const RegInstr &in, uint64_t addr, uint64_t size) {
+        if (!check_memory_range(program_file_name, program[in.src], addr, size, memory.size())) {
+            exit(EXIT_FAILURE);
+        }
+    };
+
+    uint32_t pc = 0;
+    for (;;) {
+        const RegInstr &in = code[pc];
+        ++executed;
+        ++pc;
+        switch (in.op) {
+            case RegOp::MOVI: r[in.d] = in.imm; break;
+            case RegOp::MOV: r[in.d] = r[in.a]; break;
+            case RegOp::SWAP: std::swap(r[in.a], r[in.b]); break;
+            case RegOp::ROT:
+                {
+                    uint64_t first = r[in.a];
+                    r[in.a] = r[in.a + 1];
+                    r[in.a + 1] = r[in.a + 2];
+                    r[in.a + 2] = first;
+                }
+                break;
+            case RegOp::ADD: r[in.d] = r[in.a] + r[in.b]; break;
+            case RegOp::SUB: r[in.d] = r[in.a] - r[in.b]; break;
+            case RegOp::ADDI: r[in.d] = r[in.a] + in.imm; break;
+            case RegOp::SUBI: r[in.d] = r[in.a] - in.imm; break;
+            case RegOp::MUL: r[in.d] = r[in.a] * r[in.b]; break;
+            case RegOp::DIV:
+            case RegOp::MOD:
+                if (r[in.b] == 0) {
+                    print_error(program_file_name, program[in.src].line(), program[in.src].col(),
+                            "Division by zero");
+                    exit(EXIT_FAILURE);
+                }
+                r[in.d] = in.op == RegOp::DIV ? r[in.a] / r[in.b] : r[in.a] % r[in.b];
+                break;
+            case RegOp::AND: r[in.d] = r[in.a] & r[in.b]; break;
+            case RegOp::OR: r[in.d] = r[in.a] | r[in.b]; break;
+            case RegOp::XOR: r[in.d] = r[in.a] ^ r[in.b]; break;
+            case RegOp::SHL: r[in.d] = r[in.a] << (r[in.b] & 63); break;
+            case RegOp::SHR: r[in.d] = r[in.a] >> (r[in.b] & 63); break;
+            case RegOp::MULI: r[in.d] = r[in.a] * in.imm; break;
+            case RegOp::DIVI: r[in.d] = r[in.a] / in.imm; break;
+            case RegOp::MODI: r[in.d] = r[in.a] % in.imm; break;
+            case RegOp::ANDI: r[in.d] = r[in.a] & in.imm; break;
+            case RegOp::ORI: r[in.d] = r[in.a] | in.imm; break;
+            case RegOp::XORI: r[in.d] = r[in.a] ^ in.imm; break;
+            case RegOp::SHLI: r[in.d] = r[in.a] << (in.imm & 63); break;
+            case RegOp::SHRI: r[in.d] = r[in.a] >> (in.imm & 63); break;
+            case RegOp::EQ: r[in.d] = r[in.a] == r[in.b]; break;
+            case RegOp::LT: r[in.d] = r[in.a] < r[in.b]; break;
+            case RegOp::LE: r[in.d] = r[in.a] <= r[in.b]; break;
+            case RegOp::GT: r[in.d] = r[in.a] > r[in.b]; break;
+            case RegOp::GE: r[in.d] = r[in.a] >= r[in.b]; break;
+            case RegOp::EQI: r[in.d] = r[in.a] == in.imm; break;
+            case RegOp::LTI: r[in.d] = r[in.a] < in.imm; break;
+            case RegOp::LEI: r[in.d] = r[in.a] <= in.imm; break;
+            case RegOp::GTI: r[in.d] = r[in.a] > in.imm; break;
+            case RegOp::GEI: r[in.d] = r[in.a] >= in.imm; break;
+            case RegOp::JMP: pc = in.target; break;
+            case RegOp::JZ: if (r[in.a] == 0) pc = in.target; break;
+            case RegOp::JF_EQ: if (!(r[in.a] == r[in.b])) pc = in.target; break;
+            case RegOp::JF_LT: if (!(r[in.a] < r[in.b])) pc = in.target; break;
+            case RegOp::JF_LE: if (!(r[in.a] <= r[in.b])) pc = in.target; break;
+            case RegOp::JF_GT: if (!(r[in.a] > r[in.b])) pc = in.target; break;
+            case RegOp::JF_GE: if (!(r[in.a] >= r[in.b])) pc = in.target; break;
+            case RegOp::JF_EQI: if (!(r[in.a] == in.imm)) pc = in.target; break;
+            case RegOp::JF_LTI: if (!(r[in.a] < in.imm)) pc = in.target; break;
+            case RegOp::JF_LEI: if (!(r[in.a] <= in.imm)) pc = in.target; break;
+            case RegOp::JF_GTI: if (!(r[in.a] > in.imm)) pc = in.target; break;
+            case RegOp::JF_GEI: if (!(r[in.a] >= in.imm)) pc = in.target; break;
+            case RegOp::PRINT: std::cout << r[in.a] << '\n'; break;
+            case RegOp::PRINTI: std::cout << in.imm << '\n'; break;
+
+            case RegOp::LOAD8:
+                in_memory(in, r[in.a], 1);
+                r[in.d] = memory[r[in.a]];
+                break;
+            case RegOp::LOAD64:
+                {
+                    in_memory(in, r[in.a], 8);
+                    uint64_t value;
+                    memcpy(&value, memory.data() + r[in.a], 8);
+                    r[in.d] = value;
+                }
+                break;
+            case RegOp::STORE8:
+                in_memory(in, r[in.b], 1);
+                memory[r[in.b]] = static_cast<uint8_t>(r[in.a]);
+                break;
+            case RegOp::STORE64:
+                in_memory(in, r[in.b], 8);
+                memcpy(memory.data() + r[in.b], &r[in.a], 8);
+                break;
+            case RegOp::MEM_FILL:
+                in_memory(in, r[in.a], r[in.b]);
+                sim_mem_fill(memory.data() + r[in.a], r[in.b], static_cast<uint8_t>(r[in.c]));
+                break;
+            case RegOp::MEM_COPY:
+                in_memory(in, r[in.a], r[in.c]);
+                in_memory(in, r[in.b], r[in.c]);
+                sim_mem_copy(memory.data() + r[in.a], memory.data() + r[in.b], r[in.c]);
+                break;
+            case RegOp::MEM_SUM:
+                if (r[in.b] > memory.size() / 8) {
+                    print_error(program_file_name, program[in.src].line(), program[in.src].col(),
+                            "Memory access out of bounds");
+                    exit(EXIT_FAILURE);
+                }
+                in_memory(in, r[in.a], r[in.b] * 8);
+                r[in.d] = sim_mem_sum(memory.data() + r[in.a], r[in.b]);
+                break;
+            case RegOp::MEM_EQ:
+                in_memory(in, r[in.a], r[in.c]);
+                in_memory(in, r[in.b], r[in.c]);
+                r[in.d] = sim_mem_eq(memory.data() + r[in.a], memory.data() + r[in.b], r[in.c]);
+                break;
+            case RegOp::READ_INT:
+                r[in.d + 1] = sim_read_int(input, r[in.d]);
+                break;
+            case RegOp::READ_BYTE:
+                r[in.d + 1] = sim_read_byte(input, r[in.d]);
+                break;
+
+            case RegOp::HALT:
+                if (options.vm_stats) {
+                    std::cerr << "Executed " << executed << " register instructions\n";
+                }
+                return;
+        }
+    }
+}
+
+
+// Simulates through register bytecode, returns false without running
+// anything when the program cannot be translated.
+bool simulate_register_program(std::string program_file_name,
+        const std::list<Operation> &operations_list, const Options &options) {
+    // small procedures disappear when inlined, any left over are unsupported
+    std::list<Operation> inlined = operations_list;
+    inline_procedures(program_file_name, inlined);
+    std::vector<Operation> program(inlined.begin(), inlined.end());
+
+    RegProgram reg_program;
+    std::string reason;
+    if (!translate_to_registers(program, reg_program, reason)) {
+        if (options.vm_stats) {
+            std::cerr << "Register VM unavailable: " << reason << '\n';
+        }
+        return false;
+    }
+    // overflows are reported by the stack interpreter where they happen
+    if (reg_program.registers > options.stack_size) {
+        if (options.vm_stats) {
+            std::cerr << "Register VM unavailable: stack size exceeded\n";
+        }
+        return false;
+    }
+
+    std::cout << "Simulating\n";
+    run_register_program(program_file_name, program, reg_program, options);
+    return true;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "main.h"
+
+
+// Register bytecode for the simulator. Stack slot N becomes register N,
+// which works when every op runs at a stack depth known before running
+// the program. Pushed constants are folded into the following instruction
+// and comparisons into the following if/do, see translate_to_registers().
+enum class RegOp : uint8_t {
+    MOVI,       // d = imm
+    MOV,        // d = a
+    SWAP,       // swap a and b
+    ROT,        // a, a + 1, a + 2 = a + 1, a + 2, a
+    ADD,        // d = a + b
+    SUB,        // d = a - b
+    ADDI,       // d = a + imm
+    SUBI,       // d = a - imm
+    MUL,        // d = a * b
+    DIV,        // d = a / b, b checked for 0
+    MOD,
+    AND,
+    OR,
+    XOR,
+    SHL,        // d = a << (b & 63)
+    SHR,
+    MULI,       // d = a * imm
+    DIVI,       // d = a / imm, imm is never 0
+    MODI,
+    ANDI,
+    ORI,
+    XORI,
+    SHLI,
+    SHRI,
+    EQ,         // d = a == b
+    LT,
+    LE,
+    GT,
+    GE,
+    EQI,        // d = a == imm
+    LTI,
+    LEI,
+    GTI,
+    GEI,
+    JMP,        // goto target
+    JZ,         // if (a == 0) goto target
+    JF_EQ,      // if (!(a == b)) goto target
+    JF_LT,
+    JF_LE,
+    JF_GT,
+    JF_GE,
+    JF_EQI,     // if (!(a == imm)) goto target
+    JF_LTI,
+    JF_LEI,
+    JF_GTI,
+    JF_GEI,
+    PRINT,      // print a
+    PRINTI,     // print imm
+    LOAD8,      // d = mem[a]
+    LOAD64,
+    STORE8,     // mem[b] = a
+    STORE64,
+    MEM_FILL,   // fill(a, b, c)
+    MEM_COPY,   // copy(a, b, c)
+    MEM_SUM,    // d = sum(a, b)
+    MEM_EQ,     // d = eq(a, b, c)
+    READ_INT,   // d = value, d + 1 = ok
+    READ_BYTE,
+    HALT,
+};
+
+
+struct RegInstr {
+    RegOp op = RegOp::HALT;
+    uint32_t d = 0;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+    uint32_t target = 0;
+    // index of the Operation the instruction came from, for errors
+    uint32_t src = 0;
+    uint64_t imm = 0;
+};
+
+
+struct RegProgram {
+    std::vector<RegInstr> code;
+    uint32_t registers = 0;
+};
+
+
+RegOp binary_reg_op(Operations op, bool immediate, bool branch);
+bool compute_stack_depths(const std::vector<Operation> &program,
+        std::vector<int64_t> &depths, std::string &reason);
+bool translate_to_registers(const std::vector<Operation> &program,
+        RegProgram &reg_program, std::string &reason);
+void run_register_program(const std::string &program_file_name,
+        const std::vector<Operation> &program, const RegProgram &reg_program,
+        const Options &options);
+bool simulate_register_program(std::string program_file_name,
+        const std::list<Operation> &operations_list, const Options &options);
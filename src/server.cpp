@@ -0,0 +1,787 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "server.h"
+
+
+namespace fs = std::filesystem;
+
+
+// Runtime symbols referenced by the code of top level blocks
+static const char *runtime_symbols[] = {
+    "dump", "write_string", "read_int", "read_byte", "mem",
+    "mem_fill_impl", "mem_copy_impl", "mem_sum_impl", "mem_eq_impl",
+    "division_by_zero", "parallel_run",
+};
+
+
+// A forwarded command: the client's working directory, its CL_STACK_SIZE
+// (empty when unset), its arguments from the subcommand on and its stdin,
+// stdout and stderr.
+struct Request {
+    std::string cwd;
+    std::string stack_size_env;
+    std::vector<std::string> args;
+    int fds[3] = {-1, -1, -1};
+};
+
+
+// Checks that dir is a directory only this user can enter, creating it
+// first when create is set. Anyone else could put a socket of their own
+// there.
+static bool private_directory(const std::string &dir, bool create) {
+    if (create && mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        std::cerr << "ERROR: Could not create " << dir << ": " << strerror(errno) << '\n';
+        return false;
+    }
+    struct stat info;
+    if (lstat(dir.c_str(), &info) != 0) {
+        std::cerr << "ERROR: Could not access " << dir << ": " << strerror(errno) << '\n';
+        return false;
+    }
+    if (!S_ISDIR(info.st_mode) || info.st_uid != getuid() || (info.st_mode & 077) != 0) {
+        std::cerr << "ERROR: " << dir << " must be a directory private to this user\n";
+        return false;
+    }
+    return true;
+}
+
+
+// --socket=PATH at argv[argi] (consumed), then $CL_SERVER_SOCKET, then a
+// socket in $XDG_RUNTIME_DIR or else in /tmp/cl-serve-<uid>. Those two
+// must be private to the user, with create_dir the one in /tmp is created.
+std::string server_socket_path(int &argi, int argc, char **argv, bool create_dir) {
+    if (argi < argc && strncmp(argv[argi], STR_OPT_SOCKET, strlen(STR_OPT_SOCKET)) == 0) {
+        return argv[argi++] + strlen(STR_OPT_SOCKET);
+    }
+    const char *env = getenv(STR_ENV_SERVER_SOCKET);
+    if (env != nullptr && *env != '\0') {
+        return env;
+    }
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    std::string dir = runtime_dir != nullptr && *runtime_dir != '\0' ? runtime_dir
+        : "/tmp/cl-serve-" + std::to_string(getuid());
+    if (!private_directory(dir, create_dir && runtime_dir == nullptr)) {
+        exit(EXIT_FAILURE);
+    }
+    return dir + "/" + SERVER_SOCKET_NAME;
+}
+
+
+// uid of the process at the other end of the socket, or -1
+static long peer_uid(int conn) {
+    ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0) {
+        return -1;
+    }
+    return static_cast<long>(cred.uid);
+}
+
+
+static bool socket_address(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "ERROR: Socket path too long: " << path << '\n';
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+
+static bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+
+static bool read_all(int fd, char *data, size_t size) {
+    while (size > 0) {
+        ssize_t got = read(fd, data, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+
+// The message is a 32 bit payload length followed by the NUL terminated
+// working directory, CL_STACK_SIZE and arguments, the stdio descriptors
+// travel with the first bytes as SCM_RIGHTS.
+static bool receive_request(int conn, Request &request) {
+    char head[4];
+    char control[CMSG_SPACE(sizeof(request.fds))];
+    iovec iov = {head, sizeof(head)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got = recvmsg(conn, &msg, MSG_WAITALL);
+    if (got != sizeof(head)) {
+        return false;
+    }
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(request.fds))) {
+        return false;
+    }
+    memcpy(request.fds, CMSG_DATA(cmsg), sizeof(request.fds));
+
+    uint32_t size;
+    memcpy(&size, head, sizeof(size));
+    std::string payload(size, '\0');
+    if (!read_all(conn, payload.data(), size)) {
+        return false;
+    }
+    size_t pos = 0;
+    bool first = true;
+    bool have_env = false;
+    while (pos < payload.size()) {
+        size_t end = payload.find('\0', pos);
+        if (end == std::string::npos) {
+            return false;
+        }
+        std::string field = payload.substr(pos, end - pos);
+        if (first) {
+            request.cwd = field;
+            first = false;
+        }
+        else if (!have_env) {
+            request.stack_size_env = field;
+            have_env = true;
+        }
+        else {
+            request.args.push_back(field);
+        }
+        pos = end + 1;
+    }
+    return have_env;
+}
+
+
+// Re-lexes only the lines between the longest unchanged prefix and suffix,
+// the ops of the suffix are moved over and renumbered.
+void relex_source(CachedSource &source, std::vector<std::string> lines,
+        uint64_t &lexed, uint64_t &reused) {
+    size_t old_count = source.lines.size();
+    size_t count = lines.size();
+    size_t prefix = 0;
+    while (prefix < old_count && prefix < count && source.lines[prefix] == lines[prefix]) {
+        ++prefix;
+    }
+    size_t suffix = 0;
+    while (suffix < old_count - prefix && suffix < count - prefix &&
+            source.lines[old_count - 1 - suffix] == lines[count - 1 - suffix]) {
+        ++suffix;
+    }
+
+    std::vector<std::list<Operation>> line_ops;
+    line_ops.reserve(count);
+    for (size_t i = 0; i < prefix; ++i) {
+        line_ops.push_back(std::move(source.line_ops[i]));
+    }
+    for (size_t i = prefix; i < count - suffix; ++i) {
+        std::list<Operation> ops = parse_op_from_line(lines[i]);
+        for (auto &op : ops) {
+            op.line(static_cast<int>(i + 1));
+        }
+        line_ops.push_back(std::move(ops));
+    }
+    for (size_t i = old_count - suffix; i < old_count; ++i) {
+        int line_num = static_cast<int>(i - old_count + count + 1);
+        for (auto &op : source.line_ops[i]) {
+            op.line(line_num);
+        }
+        line_ops.push_back(std::move(source.line_ops[i]));
+    }
+
+    lexed = count - prefix - suffix;
+    reused = prefix + suffix;
+    source.lines = std::move(lines);
+    source.line_ops = std::move(line_ops);
+}
+
+
+// Splits the program into [begin, end) ranges that do not cut through a
+// block: every procedure, top level if, while and parallel loop, and the
+// straight line code between them.
+std::vector<std::pair<uint64_t, uint64_t>> top_level_blocks(
+        const std::vector<Operation> &program) {
+    std::vector<std::pair<uint64_t, uint64_t>> blocks;
+    uint64_t begin = 0;
+    int nesting = 0;
+    for (uint64_t ip = 0; ip < program.size(); ++ip) {
+        switch (program[ip].op_type()) {
+            case Operations::OP_IF:
+            case Operations::OP_WHILE:
+            case Operations::OP_PROC:
+            case Operations::OP_PARALLEL:
+                if (nesting++ == 0 && ip > begin) {
+                    blocks.push_back({begin, ip});
+                    begin = ip;
+                }
+                break;
+            case Operations::OP_END:
+            case Operations::OP_REDUCE:
+                if (--nesting == 0) {
+                    blocks.push_back({begin, ip + 1});
+                    begin = ip + 1;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if (begin < program.size()) {
+        blocks.push_back({begin, program.size()});
+    }
+    return blocks;
+}
+
+
+static void assemble(const fs::path &asm_path, const fs::path &object_path) {
+    exec("nasm -felf64 " + asm_path.string() + " -o " + object_path.string() + " -g -F dwarf");
+}
+
+
+// Everything the generated code of a block depends on: the ops without
+// their positions and the stack depth it starts with.
+static std::string block_key(const std::vector<Operation> &program,
+        uint64_t begin, uint64_t end, int depth) {
+    std::ostringstream key;
+    key << depth;
+    for (uint64_t ip = begin; ip < end; ++ip) {
+        const Operation &op = program[ip];
+        key << ' ' << static_cast<int>(op.op_type()) << ':' << op.operand()
+            << ':' << op.name().size() << ':' << op.name();
+    }
+    return key.str();
+}
+
+
+// Emits block [begin, end) as a routine called from program_main. It runs
+// with the data stack swapped into rsp like a procedure body.
+static void write_block_asm(const fs::path &asm_path, const std::string &symbol,
+        const std::string &program_file_name, const std::vector<Operation> &program,
+        uint64_t begin, uint64_t end, const Options &options, CodegenState &state) {
+    std::set<std::string> defined, called;
+    std::vector<Operation> ops(program.begin() + static_cast<long>(begin),
+            program.begin() + static_cast<long>(end));
+    for (const auto &op : ops) {
+        if (op.op_type() == Operations::OP_PROC) {
+            defined.insert(op.name());
+        }
+        else if (op.op_type() == Operations::OP_CALL) {
+            called.insert(op.name());
+        }
+    }
+
+    std::ofstream out_file(asm_path);
+    out_file << "segment .text\n";
+    for (const char *name : runtime_symbols) {
+        out_file << "extern " << name << "\n";
+    }
+    for (const auto &name : defined) {
+        out_file << "global proc_" << name << "\n";
+        out_file << "global procbody_" << name << "\n";
+    }
+    for (const auto &name : called) {
+        if (!defined.contains(name)) {
+            out_file << "extern proc_" << name << "\n";
+            out_file << "extern procbody_" << name << "\n";
+        }
+    }
+    out_file << "global " << symbol << "\n";
+    out_file << symbol << ":\n";
+    out_file << "    xchg rsp, rbp\n";
+
+    std::string string_table;
+    state.strings = intern_strings(ops, string_table);
+    generate_ops_asm(out_file, program_file_name, program, begin, end, options, state);
+
+    out_file << "    xchg rsp, rbp\n";
+    out_file << "    ret\n";
+    out_file << "segment .rodata\n";
+    add_string_table_asm(out_file, string_table);
+}
+
+
+// Compiles through the object cache in cache_dir and links ./a.out:
+// runtime.o jumps to program_main, which calls the object of every top
+// level block in order and jumps to program_exit.
+BlockCounts compile_incremental(const std::string &program_file_name,
+        std::list<Operation> &operations, const Options &options,
+        const std::string &cache_dir) {
+    std::cout << "Compiling\n";
+    BlockCounts counts;
+    fs::path dir = cache_dir;
+
+    std::string runtime_name = "runtime_" + std::to_string(options.stack_size) + "_"
+        + std::to_string(options.mem_size) + (options.buffered_output ? "_buffered" : "");
+    fs::path runtime_obj = dir / (runtime_name + ".o");
+    if (!fs::exists(runtime_obj)) {
+        fs::path runtime_asm = dir / (runtime_name + ".asm");
+        std::ofstream out_file(runtime_asm);
+        for (const char *name : runtime_symbols) {
+            out_file << "global " << name << "\n";
+        }
+        out_file << "global flush_output\n";
+        out_file << "extern program_main\n";
+        add_boilerplate_asm(out_file, options);
+        out_file << "    jmp program_main\n";
+        add_data_segments_asm(out_file, options, "");
+        out_file.close();
+        assemble(runtime_asm, runtime_obj);
+    }
+
+    fs::path exit_obj = dir / "exit.o";
+    if (!fs::exists(exit_obj)) {
+        fs::path exit_asm = dir / "exit.asm";
+        std::ofstream out_file(exit_asm);
+        out_file << "segment .text\n";
+        out_file << "extern flush_output\n";
+        out_file << "global program_exit\n";
+        out_file << "program_exit:\n";
+        add_exit_asm(out_file, options);
+        out_file.close();
+        assemble(exit_asm, exit_obj);
+    }
+
+    std::vector<Operation> program(operations.begin(), operations.end());
+    CodegenState state;
+    std::vector<std::string> calls;
+    std::vector<fs::path> objects;
+    for (auto [begin, end] : top_level_blocks(program)) {
+        std::string key = block_key(program, begin, end, state.mock_stack_size);
+        std::ostringstream hash;
+        hash << std::hex << std::setw(16) << std::setfill('0') << std::hash<std::string>{}(key);
+        std::string symbol = "block_" + hash.str();
+        fs::path object = dir / (symbol + ".o");
+        // depth after the block, then the key guarding against collisions
+        fs::path info = dir / (symbol + ".info");
+
+        bool cached = false;
+        std::ifstream cached_info(info);
+        int depth_after;
+        std::string cached_key;
+        if (cached_info >> depth_after && cached_info.get() == '\n' &&
+                std::getline(cached_info, cached_key) && cached_key == key) {
+            state.mock_stack_size = depth_after;
+            cached = true;
+            ++counts.reused;
+        }
+        if (!cached) {
+            fs::path asm_path = dir / (symbol + ".asm");
+            write_block_asm(asm_path, symbol, program_file_name, program, begin, end,
+                    options, state);
+            assemble(asm_path, object);
+            std::ofstream(info) << state.mock_stack_size << '\n' << key << '\n';
+            ++counts.built;
+        }
+        calls.push_back(symbol);
+        if (std::find(objects.begin(), objects.end(), object) == objects.end()) {
+            objects.push_back(object);
+        }
+    }
+
+    fs::path main_asm = dir / ("program_" + std::to_string(getpid()) + ".asm");
+    fs::path main_obj = dir / ("program_" + std::to_string(getpid()) + ".o");
+    {
+        std::ofstream out_file(main_asm);
+        out_file << "segment .text\n";
+        out_file << "global program_main\n";
+        out_file << "extern program_exit\n";
+        std::set<std::string> declared;
+        for (const auto &symbol : calls) {
+            if (declared.insert(symbol).second) {
+                out_file << "extern " << symbol << "\n";
+            }
+        }
+        out_file << "program_main:\n";
+        for (const auto &symbol : calls) {
+            out_file << "    xchg rsp, rbp\n";
+            out_file << "    call " << symbol << "\n";
+            out_file << "    xchg rsp, rbp\n";
+        }
+        out_file << "    jmp program_exit\n";
+    }
+    assemble(main_asm, main_obj);
+
+    std::string ld_cmd = "ld " + runtime_obj.string() + " " + main_obj.string();
+    for (const auto &object : objects) {
+        ld_cmd += " " + object.string();
+    }
+    ld_cmd += " " + exit_obj.string() + " -o ./a.out";
+    exec(ld_cmd);
+    fs::remove(main_asm);
+    fs::remove(main_obj);
+    return counts;
+}
+
+
+// Runs a compile or simulate request in the worker process, with the
+// client's stdio and working directory. Errors exit the worker.
+static void run_request(const Request &request, const CachedSource *source,
+        const std::string &cache_dir, int counts_fd) {
+    std::vector<char *> argv = {const_cast<char *>("cl")};
+    for (const auto &arg : request.args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    std::string program_file_name;
+    Options options = parse_options(static_cast<int>(argv.size() - 1), argv.data(),
+            program_file_name);
+    if (program_file_name.empty()) {
+        std::cerr << "ERROR: No input file\n";
+        exit(EXIT_FAILURE);
+    }
+    if (source == nullptr) {
+        std::cerr << "ERROR: Could not read file: " << program_file_name << '\n';
+        exit(EXIT_FAILURE);
+    }
+
+    std::list<Operation> operations;
+    for (const auto &ops : source->line_ops) {
+        operations.insert(operations.end(), ops.begin(), ops.end());
+    }
+    finish_parsing(program_file_name, operations);
+    crossreference_conditional(program_file_name, operations);
+
+    const std::string &command = request.args[0];
+    if (command == STR_OPT_COMPILE) {
+        if (options.profile_generate) {
+            std::cerr << "ERROR: " << STR_OPT_PROFILE_GENERATE << " is not supported by "
+                << STR_OPT_SERVE << ", compile with cl c\n";
+            exit(EXIT_FAILURE);
+        }
+        if (is_metered(options)) {
+            std::cerr << "ERROR: " << STR_OPT_BUDGET << " and " << STR_OPT_DEADLINE
+                << " are not supported by " << STR_OPT_SERVE << ", compile with cl c\n";
+            exit(EXIT_FAILURE);
+        }
+        if (options.backend != Backend::NASM) {
+            std::cerr << "ERROR: " << STR_OPT_BACKEND << STR_BACKEND_C << " is not supported by "
+                << STR_OPT_SERVE << ", compile with cl c\n";
+            exit(EXIT_FAILURE);
+        }
+        prepare_compilation(program_file_name, operations, options);
+        BlockCounts counts = compile_incremental(program_file_name, operations, options,
+                cache_dir);
+        if (!write_all(counts_fd, reinterpret_cast<const char *>(&counts), sizeof(counts))) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (command == STR_OPT_SIMULATE) {
+        simulate(program_file_name, operations, options);
+    }
+    else {
+        std::cerr << "ERROR: Invalid command\n";
+        print_usage("cl client");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void write_stats(int fd, const ServerStats &stats) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2);
+    out << "requests: " << stats.requests << " (" << stats.failures << " failed)\n";
+    if (!stats.latencies.empty()) {
+        std::vector<double> sorted = stats.latencies;
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0;
+        for (double latency : sorted) {
+            sum += latency;
+        }
+        out << "latency ms: mean " << sum / static_cast<double>(sorted.size())
+            << ", p50 " << sorted[sorted.size() / 2]
+            << ", p90 " << sorted[sorted.size() * 9 / 10]
+            << ", max " << sorted.back()
+            << " (last " << sorted.size() << " requests)\n";
+    }
+    out << "lines lexed: " << stats.lines_lexed << ", reused: " << stats.lines_reused << '\n';
+    out << "blocks built: " << stats.blocks_built << ", reused: " << stats.blocks_reused << '\n';
+    std::string text = out.str();
+    write_all(fd, text.data(), text.size());
+}
+
+
+// Handles one request, returns false when the server should stop
+static bool handle_request(int conn, int listener, const Request &request,
+        std::map<std::string, CachedSource> &sources, ServerStats &stats,
+        const std::string &cache_dir) {
+    auto start = std::chrono::steady_clock::now();
+    const std::string command = request.args.empty() ? "" : request.args[0];
+    char status = 0;
+    if (command == STR_CLIENT_STATS) {
+        write_stats(request.fds[1], stats);
+        write_all(conn, &status, 1);
+        return true;
+    }
+    if (command == STR_CLIENT_STOP) {
+        write_all(conn, &status, 1);
+        return false;
+    }
+
+    // the program file is the first argument that is not a flag
+    CachedSource *source = nullptr;
+    for (size_t i = 1; i < request.args.size(); ++i) {
+        if (request.args[i].rfind("--", 0) == 0) {
+            continue;
+        }
+        fs::path path = fs::path(request.cwd) / request.args[i];
+        std::ifstream in(path);
+        if (in) {
+            std::vector<std::string> lines;
+            for (std::string line; std::getline(in, line);) {
+                lines.push_back(line);
+            }
+            uint64_t lexed, reused;
+            source = &sources[fs::weakly_canonical(path).string()];
+            relex_source(*source, std::move(lines), lexed, reused);
+            stats.lines_lexed += lexed;
+            stats.lines_reused += reused;
+        }
+        break;
+    }
+
+    int counts_pipe[2];
+    if (pipe(counts_pipe) != 0) {
+        status = 1;
+        write_all(conn, &status, 1);
+        return true;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(listener);
+        close(conn);
+        close(counts_pipe[0]);
+        for (int i = 0; i < 3; ++i) {
+            dup2(request.fds[i], i);
+        }
+        if (chdir(request.cwd.c_str()) != 0) {
+            std::cerr << "ERROR: Could not change to " << request.cwd << '\n';
+            exit(EXIT_FAILURE);
+        }
+        // the stack size the client would have run with
+        if (request.stack_size_env.empty()) {
+            unsetenv(STR_ENV_STACK_SIZE);
+        }
+        else {
+            setenv(STR_ENV_STACK_SIZE, request.stack_size_env.c_str(), 1);
+        }
+        run_request(request, source, cache_dir, counts_pipe[1]);
+        exit(EXIT_SUCCESS);
+    }
+    close(counts_pipe[1]);
+
+    int wait_status = 0;
+    if (pid > 0) {
+        while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR) {
+        }
+    }
+    BlockCounts counts;
+    if (read_all(counts_pipe[0], reinterpret_cast<char *>(&counts), sizeof(counts))) {
+        stats.blocks_built += counts.built;
+        stats.blocks_reused += counts.reused;
+    }
+    close(counts_pipe[0]);
+
+    status = static_cast<char>(pid > 0 && WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 1);
+    ++stats.requests;
+    stats.failures += status != 0;
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (stats.latencies.size() == SERVER_LATENCY_HISTORY) {
+        stats.latencies.erase(stats.latencies.begin());
+    }
+    stats.latencies.push_back(elapsed.count());
+    write_all(conn, &status, 1);
+    return true;
+}
+
+
+int serve(int argc, char **argv) {
+    int argi = 2;
+    std::string socket_path = server_socket_path(argi, argc, argv, true);
+    if (argi != argc) {
+        std::cerr << "ERROR: Unexpected argument: " << argv[argi] << '\n';
+        return EXIT_FAILURE;
+    }
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr)) {
+        return EXIT_FAILURE;
+    }
+
+    // a socket file left behind by a server that is gone is replaced
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(probe, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0) {
+        std::cerr << "ERROR: A server is already listening on " << socket_path << '\n';
+        close(probe);
+        return EXIT_FAILURE;
+    }
+    close(probe);
+    unlink(socket_path.c_str());
+
+    // only this user may connect, whatever the umask
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t old_umask = umask(077);
+    bool bound = listener >= 0 &&
+        bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    umask(old_umask);
+    if (!bound || listen(listener, 16) != 0) {
+        std::cerr << "ERROR: Could not listen on " << socket_path << ": " << strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
+    std::string cache_dir = (fs::temp_directory_path() / "cl-serve-XXXXXX").string();
+    if (mkdtemp(cache_dir.data()) == nullptr) {
+        std::cerr << "ERROR: Could not create a cache directory\n";
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::cout << "Listening on " << socket_path << std::endl;
+
+    std::map<std::string, CachedSource> sources;
+    ServerStats stats;
+    bool running = true;
+    while (running) {
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn < 0) {
+            continue;
+        }
+        // requests run with the server's rights, so only from its user
+        if (peer_uid(conn) != static_cast<long>(getuid())) {
+            close(conn);
+            continue;
+        }
+        Request request;
+        if (receive_request(conn, request)) {
+            running = handle_request(conn, listener, request, sources, stats, cache_dir);
+        }
+        for (int fd : request.fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        close(conn);
+    }
+
+    close(listener);
+    unlink(socket_path.c_str());
+    fs::remove_all(cache_dir);
+    return EXIT_SUCCESS;
+}
+
+
+// cl client [--socket=PATH] command args...: runs the command in the
+// server with this process' stdio and exits with its status
+int run_client(int argc, char **argv) {
+    int argi = 2;
+    std::string socket_path = server_socket_path(argi, argc, argv, false);
+    if (argi >= argc) {
+        std::cerr << "ERROR: No command for the server\n";
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr)) {
+        return EXIT_FAILURE;
+    }
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0 || connect(conn, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "ERROR: No server listening on " << socket_path
+            << ", start one with `cl " << STR_OPT_SERVE << "`\n";
+        return EXIT_FAILURE;
+    }
+    // the descriptors and working directory only go to this user's server
+    if (peer_uid(conn) != static_cast<long>(getuid())) {
+        std::cerr << "ERROR: " << socket_path << " belongs to another user\n";
+        return EXIT_FAILURE;
+    }
+
+    std::string payload = fs::current_path().string();
+    payload.push_back('\0');
+    const char *stack_size = getenv(STR_ENV_STACK_SIZE);
+    payload += stack_size != nullptr ? stack_size : "";
+    payload.push_back('\0');
+    for (int i = argi; i < argc; ++i) {
+        payload += argv[i];
+        payload.push_back('\0');
+    }
+    uint32_t size = static_cast<uint32_t>(payload.size());
+    char head[4];
+    memcpy(head, &size, sizeof(size));
+
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    iovec iov = {head, sizeof(head)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    std::cout.flush();
+    if (sendmsg(conn, &msg, 0) != sizeof(head) ||
+            !write_all(conn, payload.data(), payload.size())) {
+        std::cerr << "ERROR: Could not send the request to " << socket_path << '\n';
+        return EXIT_FAILURE;
+    }
+
+    char status;
+    if (!read_all(conn, &status, 1)) {
+        std::cerr << "ERROR: The server closed the connection\n";
+        return EXIT_FAILURE;
+    }
+    close(conn);
+    return static_cast<unsigned char>(status);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "main.h"
+
+
+// `cl serve` keeps the lexed lines of every program it compiled and the
+// object file of every top level block (procedures, top level if/while
+// and the straight line code between them), then links a new a.out from
+// cached objects after re-lexing only the lines that changed. `cl client`
+// forwards its command line and stdio to the server.
+#define STR_OPT_SOCKET "--socket="
+#define STR_ENV_SERVER_SOCKET "CL_SERVER_SOCKET"
+// Name of the socket in $XDG_RUNTIME_DIR or /tmp/cl-serve-<uid>
+#define SERVER_SOCKET_NAME "cl-serve.sock"
+#define STR_CLIENT_STATS "stats"
+#define STR_CLIENT_STOP "stop"
+// Most recent request latencies kept for the stats
+#define SERVER_LATENCY_HISTORY 1024
+
+
+// Lines of a program and the ops lexed from each, line numbers included
+struct CachedSource {
+    std::vector<std::string> lines;
+    std::vector<std::list<Operation>> line_ops;
+};
+
+
+struct ServerStats {
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t lines_lexed = 0;
+    uint64_t lines_reused = 0;
+    uint64_t blocks_built = 0;
+    uint64_t blocks_reused = 0;
+    // milliseconds, oldest first
+    std::vector<double> latencies;
+};
+
+
+// Counts reported by a compile worker to the server
+struct BlockCounts {
+    uint64_t built = 0;
+    uint64_t reused = 0;
+};
+
+
+std::string server_socket_path(int &argi, int argc, char **argv, bool create_dir);
+int serve(int argc, char **argv);
+int run_client(int argc, char **argv);
+
+void relex_source(CachedSource &source, std::vector<std::string> lines,
+        uint64_t &lexed, uint64_t &reused);
+std::vector<std::pair<uint64_t, uint64_t>> top_level_blocks(
+        const std::vector<Operation> &program);
+BlockCounts compile_incremental(const std::string &program_file_name,
+        std::list<Operation> &operations, const Options &options,
+        const std::string &cache_dir);
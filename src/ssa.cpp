@@ -0,0 +1,1111 @@
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+
+#include "main.h"
+#include "ops.h"
+#include "regvm.h"
+#include "ssa.h"
+
+
+// Ops the builder turns into instructions, see build_ssa()
+static bool is_supported(Operations op) {
+    switch (op) {
+        case Operations::OP_PUSH_STR:
+        case Operations::OP_PUTS:
+        case Operations::OP_PROC:
+        case Operations::OP_CALL:
+        case Operations::OP_PARALLEL:
+        case Operations::OP_REDUCE:
+        case Operations::OP_CNT:
+            return false;
+        default:
+            return true;
+    }
+}
+
+
+// Successors are visited last to first, so a block is followed by its
+// first successor where possible: the body of a loop or if comes right
+// after the branch into it.
+static std::vector<uint32_t> reverse_postorder(const SsaFunction &function) {
+    const std::vector<SsaBlock> &blocks = function.blocks;
+    std::vector<uint32_t> order;
+    std::vector<bool> seen(blocks.size(), false);
+    std::vector<std::pair<uint32_t, size_t>> dfs = {{0, 0}};
+    seen[0] = true;
+    while (!dfs.empty()) {
+        auto &[b, next] = dfs.back();
+        if (next < blocks[b].succs.size()) {
+            uint32_t s = blocks[b].succs[blocks[b].succs.size() - ++next];
+            if (!seen[s]) {
+                seen[s] = true;
+                dfs.push_back({s, 0});
+            }
+            continue;
+        }
+        order.push_back(b);
+        dfs.pop_back();
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+
+// Blocks start at the first op, at every jump target and after every
+// jump. A while starts two blocks: its preheader, where every path from
+// outside the loop enters, and its header, where the end of the loop
+// jumps back to. Blocks are numbered in program order, so the entry is
+// block 0. Values are then numbered in reverse postorder: a block with a
+// single predecessor takes over its stack, any other starts with a phi
+// per slot whose arguments are filled in once every block is done.
+bool build_ssa(const std::vector<Operation> &program, SsaFunction &function,
+        std::string &reason) {
+    std::vector<int64_t> depths;
+    if (!compute_stack_depths(program, depths, reason)) {
+        return false;
+    }
+
+    uint64_t n = program.size();
+    std::vector<bool> leader(n + 1, false);
+    leader[0] = true;
+    leader[n] = true;
+    function = SsaFunction();
+    for (uint64_t ip = 0; ip < n; ++ip) {
+        const Operation &op = program[ip];
+        if (depths[ip] < 0) {
+            continue;
+        }
+        if (!is_supported(op.op_type())) {
+            reason = "unsupported operation at "
+                + std::to_string(op.line()) + ":" + std::to_string(op.col());
+            return false;
+        }
+        StackEffect effect = stack_effect(op.op_type());
+        function.max_depth = std::max(function.max_depth,
+                depths[ip] - effect.pops + effect.pushes);
+        switch (op.op_type()) {
+            case Operations::OP_IF:
+            case Operations::OP_DO:
+            case Operations::OP_ELSE:
+                leader[ip + 1] = true;
+                leader[op.jump_loc()] = true;
+                break;
+            case Operations::OP_END:
+                if (program[op.jump_loc()].op_type() == Operations::OP_WHILE) {
+                    leader[ip + 1] = true;
+                }
+                break;
+            case Operations::OP_WHILE:
+                leader[ip] = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    std::vector<SsaBlock> &blocks = function.blocks;
+    // block starting at each leader, the header for a while
+    std::vector<uint32_t> block_at(n + 1, UINT32_MAX);
+    std::vector<uint32_t> preheader_at(n + 1, UINT32_MAX);
+    for (uint64_t ip = 0; ip <= n; ++ip) {
+        if (!leader[ip] || depths[ip] < 0) {
+            continue;
+        }
+        if (ip < n && program[ip].op_type() == Operations::OP_WHILE) {
+            preheader_at[ip] = static_cast<uint32_t>(blocks.size());
+            blocks.emplace_back();
+            blocks.back().begin = ip;
+        }
+        block_at[ip] = static_cast<uint32_t>(blocks.size());
+        blocks.emplace_back();
+        blocks.back().begin = ip;
+    }
+    // only the end of a loop jumps to its header
+    auto target = [&](uint64_t from, uint64_t to) {
+        if (to < n && program[to].op_type() == Operations::OP_WHILE &&
+                !(program[from].op_type() == Operations::OP_END && program[from].jump_loc() == to)) {
+            return preheader_at[to];
+        }
+        return block_at[to];
+    };
+
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+        SsaBlock &block = blocks[b];
+        uint64_t begin = block.begin;
+        if (preheader_at[begin] == b) {
+            block.exit = SsaExit::JUMP;
+            block.succs = {block_at[begin]};
+            function.loops.push_back({b, block_at[begin], begin, program[begin].jump_loc()});
+            continue;
+        }
+        if (begin == n) {
+            continue;
+        }
+        uint64_t last = begin;
+        while (!leader[last + 1]) {
+            ++last;
+        }
+        const Operation &op = program[last];
+        block.exit_src = static_cast<uint32_t>(last);
+        switch (op.op_type()) {
+            case Operations::OP_IF:
+            case Operations::OP_DO:
+                block.exit = SsaExit::BRANCH;
+                block.succs = {target(last, last + 1), target(last, op.jump_loc())};
+                // both ways lead to the same block
+                if (block.succs[0] == block.succs[1]) {
+                    block.exit = SsaExit::JUMP;
+                    block.succs.pop_back();
+                }
+                break;
+            case Operations::OP_ELSE:
+                block.exit = SsaExit::JUMP;
+                block.succs = {target(last, op.jump_loc())};
+                break;
+            case Operations::OP_END:
+                block.exit = SsaExit::JUMP;
+                block.succs = {program[op.jump_loc()].op_type() == Operations::OP_WHILE
+                    ? target(last, op.jump_loc()) : target(last, last + 1)};
+                break;
+            default:
+                block.exit = SsaExit::JUMP;
+                block.succs = {target(last, last + 1)};
+        }
+    }
+
+    std::vector<uint32_t> order = reverse_postorder(function);
+    for (SsaBlock &block : blocks) {
+        block.reachable = false;
+    }
+    for (uint32_t b : order) {
+        blocks[b].reachable = true;
+    }
+    for (uint32_t b : order) {
+        for (uint32_t s : blocks[b].succs) {
+            blocks[s].preds.push_back(b);
+        }
+    }
+
+    std::vector<bool> is_header(blocks.size(), false);
+    for (const SsaLoop &loop : function.loops) {
+        is_header[loop.header] = true;
+    }
+    std::vector<std::vector<SsaValue>> exit_stack(blocks.size());
+    for (uint32_t b : order) {
+        SsaBlock &block = blocks[b];
+        std::vector<SsaValue> stack;
+        if (block.preds.size() == 1 && !is_header[b]) {
+            stack = exit_stack[block.preds[0]];
+        }
+        else {
+            for (int64_t slot = 0; slot < depths[block.begin]; ++slot) {
+                block.phis.push_back({function.values, {}});
+                stack.push_back(function.values++);
+            }
+        }
+
+        uint64_t end = block.begin == n || preheader_at[block.begin] == b
+            ? block.begin : block.exit_src + 1;
+        for (uint64_t ip = block.begin; ip < end; ++ip) {
+            const Operation &op = program[ip];
+            SsaInstr in;
+            in.op = op.op_type();
+            in.src = static_cast<uint32_t>(ip);
+            switch (op.op_type()) {
+                case Operations::OP_DUP:
+                    stack.push_back(stack.back());
+                    continue;
+                case Operations::OP_SWAP:
+                    std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+                    continue;
+                case Operations::OP_OVER:
+                    stack.push_back(stack[stack.size() - 2]);
+                    continue;
+                case Operations::OP_ROT:
+                    std::rotate(stack.end() - 3, stack.end() - 2, stack.end());
+                    continue;
+                case Operations::OP_DROP:
+                    stack.pop_back();
+                    continue;
+                case Operations::OP_IF:
+                case Operations::OP_DO:
+                    if (block.exit == SsaExit::BRANCH) {
+                        block.cond = stack.back();
+                    }
+                    stack.pop_back();
+                    continue;
+                case Operations::OP_ELSE:
+                case Operations::OP_END:
+                case Operations::OP_WHILE:
+                    continue;
+                case Operations::OP_PUSH:
+                    in.imm = op.operand();
+                    break;
+                default:
+                    break;
+            }
+            StackEffect effect = stack_effect(op.op_type());
+            in.args.assign(stack.end() - effect.pops, stack.end());
+            stack.resize(stack.size() - static_cast<size_t>(effect.pops));
+            if (effect.pushes > 0) {
+                in.result = function.values;
+                for (int i = 0; i < effect.pushes; ++i) {
+                    stack.push_back(function.values++);
+                }
+            }
+            block.code.push_back(in);
+        }
+        exit_stack[b] = stack;
+    }
+
+    for (uint32_t b : order) {
+        SsaBlock &block = blocks[b];
+        for (size_t slot = 0; slot < block.phis.size(); ++slot) {
+            for (uint32_t pred : block.preds) {
+                block.phis[slot].args.push_back(exit_stack[pred][slot]);
+            }
+        }
+    }
+    return true;
+}
+
+
+// Constants defined by OP_PUSH and OP_MEM (address 0 in the simulator, a
+// link time address in compiled programs, so mem is only folded here)
+struct SsaConstants {
+    std::vector<bool> known;
+    std::vector<uint64_t> value;
+
+    explicit SsaConstants(const SsaFunction &function)
+        : known(function.values, false), value(function.values, 0) {
+        for (const SsaBlock &block : function.blocks) {
+            for (const SsaInstr &in : block.code) {
+                add(in);
+            }
+        }
+    }
+
+    void add(const SsaInstr &in) {
+        if (!in.copy && (in.op == Operations::OP_PUSH || in.op == Operations::OP_MEM)) {
+            known[in.result] = true;
+            value[in.result] = in.imm;
+        }
+    }
+
+    bool is(SsaValue v) const {
+        return known[v];
+    }
+};
+
+
+// Free of side effects and errors: constants, copies, binary ops and
+// comparisons, and divisions by a constant other than 0. Everything else
+// stays where it is and is never removed.
+static bool is_pure(const SsaInstr &in, const SsaConstants &constants) {
+    if (in.copy || in.op == Operations::OP_PUSH || in.op == Operations::OP_MEM) {
+        return true;
+    }
+    const OpInfo &info = op_info(in.op);
+    if (info.fold == nullptr) {
+        return false;
+    }
+    return !info.divides || (constants.is(in.args[1]) && constants.value[in.args[1]] != 0);
+}
+
+
+static bool is_commutative(Operations op) {
+    return op_info(op).reduces || op == Operations::OP_EQUALS;
+}
+
+
+// Rewrites every use of a value to what replace maps it to, following
+// chains of replacements
+static void replace_uses(SsaFunction &function, std::vector<SsaValue> &replace) {
+    auto resolve = [&](SsaValue v) {
+        while (replace[v] != v) {
+            v = replace[v];
+        }
+        return v;
+    };
+    for (SsaBlock &block : function.blocks) {
+        for (SsaPhi &phi : block.phis) {
+            for (SsaValue &arg : phi.args) {
+                arg = resolve(arg);
+            }
+        }
+        for (SsaInstr &in : block.code) {
+            for (SsaValue &arg : in.args) {
+                arg = resolve(arg);
+            }
+        }
+        if (block.cond != NO_VALUE) {
+            block.cond = resolve(block.cond);
+        }
+    }
+}
+
+
+static std::vector<SsaValue> identity_map(const SsaFunction &function) {
+    std::vector<SsaValue> replace(function.values);
+    for (SsaValue v = 0; v < function.values; ++v) {
+        replace[v] = v;
+    }
+    return replace;
+}
+
+
+// Copy propagation: uses of a copy, and of a phi whose arguments are all
+// the same value (or the phi itself), are replaced with that value.
+// Returns whether anything changed.
+static bool propagate_copies(SsaFunction &function, SsaStats &stats) {
+    bool changed = false;
+    for (bool again = true; again;) {
+        again = false;
+        std::vector<SsaValue> replace = identity_map(function);
+        for (SsaBlock &block : function.blocks) {
+            std::erase_if(block.code, [&](const SsaInstr &in) {
+                if (!in.copy) {
+                    return false;
+                }
+                replace[in.result] = in.args[0];
+                ++stats.copies;
+                return again = true;
+            });
+            std::erase_if(block.phis, [&](const SsaPhi &phi) {
+                SsaValue same = NO_VALUE;
+                for (SsaValue arg : phi.args) {
+                    if (arg == phi.result || arg == same) {
+                        continue;
+                    }
+                    if (same != NO_VALUE) {
+                        return false;
+                    }
+                    same = arg;
+                }
+                if (same == NO_VALUE) {
+                    return false;
+                }
+                replace[phi.result] = same;
+                ++stats.copies;
+                return again = true;
+            });
+        }
+        replace_uses(function, replace);
+        changed |= again;
+    }
+    return changed;
+}
+
+
+// Immediate dominator of every reachable block, by iterating over the
+// reverse postorder until nothing changes
+static std::vector<uint32_t> dominators(const SsaFunction &function,
+        const std::vector<uint32_t> &order) {
+    std::vector<uint32_t> index(function.blocks.size(), UINT32_MAX);
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        index[order[i]] = i;
+    }
+    std::vector<uint32_t> idom(function.blocks.size(), UINT32_MAX);
+    idom[0] = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (uint32_t b : order) {
+            if (b == 0) {
+                continue;
+            }
+            uint32_t dom = UINT32_MAX;
+            for (uint32_t pred : function.blocks[b].preds) {
+                if (idom[pred] == UINT32_MAX) {
+                    continue;
+                }
+                if (dom == UINT32_MAX) {
+                    dom = pred;
+                    continue;
+                }
+                uint32_t other = pred;
+                while (dom != other) {
+                    while (index[dom] > index[other]) {
+                        dom = idom[dom];
+                    }
+                    while (index[other] > index[dom]) {
+                        other = idom[other];
+                    }
+                }
+            }
+            if (idom[b] != dom) {
+                idom[b] = dom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+
+// Common subexpression elimination over the dominator tree: a pure
+// instruction computing what a dominating one already did becomes a copy
+// of it. Instructions on constants only are folded into a constant on the
+// way. Returns whether anything changed.
+static bool eliminate_common_subexpressions(SsaFunction &function, SsaStats &stats) {
+    std::vector<uint32_t> order = reverse_postorder(function);
+    std::vector<uint32_t> idom = dominators(function, order);
+    std::vector<std::vector<uint32_t>> children(function.blocks.size());
+    for (uint32_t b : order) {
+        if (b != 0) {
+            children[idom[b]].push_back(b);
+        }
+    }
+
+    using Key = std::tuple<Operations, uint64_t, std::vector<SsaValue>>;
+    std::map<Key, SsaValue> available;
+    // keys added by each block on the path from the entry, removed again
+    // when leaving its subtree
+    std::vector<std::vector<Key>> added;
+    SsaConstants constants(function);
+    bool changed = false;
+
+    std::vector<std::pair<uint32_t, size_t>> walk = {{0, 0}};
+    added.emplace_back();
+    auto visit = [&](uint32_t b) {
+        for (SsaInstr &in : function.blocks[b].code) {
+            const OpInfo &info = op_info(in.op);
+            if (!in.copy && info.fold != nullptr && constants.is(in.args[0]) &&
+                    constants.is(in.args[1]) &&
+                    !(info.divides && constants.value[in.args[1]] == 0)) {
+                in.imm = info.fold(constants.value[in.args[0]], constants.value[in.args[1]]);
+                in.op = Operations::OP_PUSH;
+                in.args.clear();
+                constants.add(in);
+                ++stats.folded;
+                changed = true;
+            }
+            if (in.copy || !is_pure(in, constants)) {
+                continue;
+            }
+            std::vector<SsaValue> args = in.args;
+            if (is_commutative(in.op)) {
+                std::sort(args.begin(), args.end());
+            }
+            Key key {in.op, in.imm, args};
+            auto found = available.find(key);
+            if (found != available.end()) {
+                in.copy = true;
+                in.args = {found->second};
+                ++stats.common;
+                changed = true;
+                continue;
+            }
+            available.emplace(key, in.result);
+            added.back().push_back(key);
+        }
+    };
+    visit(0);
+    while (!walk.empty()) {
+        auto &[b, next] = walk.back();
+        if (next < children[b].size()) {
+            uint32_t child = children[b][next++];
+            walk.push_back({child, 0});
+            added.emplace_back();
+            visit(child);
+            continue;
+        }
+        for (const Key &key : added.back()) {
+            available.erase(key);
+        }
+        added.pop_back();
+        walk.pop_back();
+    }
+    return changed;
+}
+
+
+// Drops the edge from pred to block along with its phi arguments
+static void remove_edge(SsaFunction &function, uint32_t pred, uint32_t b) {
+    SsaBlock &block = function.blocks[b];
+    auto it = std::find(block.preds.begin(), block.preds.end(), pred);
+    size_t k = static_cast<size_t>(it - block.preds.begin());
+    block.preds.erase(it);
+    for (SsaPhi &phi : block.phis) {
+        phi.args.erase(phi.args.begin() + static_cast<std::ptrdiff_t>(k));
+    }
+}
+
+
+// Branches on a constant become jumps, and blocks no path reaches any more
+// are dropped. Returns whether anything changed.
+static bool fold_branches(SsaFunction &function, SsaStats &stats) {
+    SsaConstants constants(function);
+    bool changed = false;
+    for (uint32_t b = 0; b < function.blocks.size(); ++b) {
+        SsaBlock &block = function.blocks[b];
+        if (!block.reachable || block.exit != SsaExit::BRANCH || !constants.is(block.cond)) {
+            continue;
+        }
+        uint32_t taken = block.succs[constants.value[block.cond] != 0 ? 0 : 1];
+        uint32_t other = block.succs[constants.value[block.cond] != 0 ? 1 : 0];
+        remove_edge(function, b, other);
+        block.exit = SsaExit::JUMP;
+        block.succs = {taken};
+        block.cond = NO_VALUE;
+        ++stats.dead;
+        changed = true;
+    }
+    if (!changed) {
+        return false;
+    }
+
+    std::vector<bool> reached(function.blocks.size(), false);
+    for (uint32_t b : reverse_postorder(function)) {
+        reached[b] = true;
+    }
+    for (uint32_t b = 0; b < function.blocks.size(); ++b) {
+        SsaBlock &block = function.blocks[b];
+        if (reached[b] || !block.reachable) {
+            continue;
+        }
+        for (uint32_t s : block.succs) {
+            if (reached[s]) {
+                remove_edge(function, b, s);
+            }
+        }
+        stats.dead += block.code.size();
+        block = SsaBlock();
+        block.reachable = false;
+    }
+    return true;
+}
+
+
+// Dead code elimination: keeps the instructions with side effects, the
+// branch conditions and whatever they depend on
+static void eliminate_dead_code(SsaFunction &function, SsaStats &stats) {
+    SsaConstants constants(function);
+    std::vector<bool> live(function.values, false);
+    // phi arguments and instruction arguments by the value they define
+    std::vector<const std::vector<SsaValue> *> uses(function.values, nullptr);
+    std::vector<SsaValue> worklist;
+    auto mark = [&](SsaValue v) {
+        if (!live[v]) {
+            live[v] = true;
+            worklist.push_back(v);
+        }
+    };
+    for (const SsaBlock &block : function.blocks) {
+        for (const SsaPhi &phi : block.phis) {
+            uses[phi.result] = &phi.args;
+        }
+        for (const SsaInstr &in : block.code) {
+            if (in.result != NO_VALUE) {
+                uses[in.result] = &in.args;
+            }
+            if (!is_pure(in, constants)) {
+                if (in.result != NO_VALUE) {
+                    mark(in.result);
+                }
+                for (SsaValue arg : in.args) {
+                    mark(arg);
+                }
+            }
+        }
+        if (block.cond != NO_VALUE) {
+            mark(block.cond);
+        }
+    }
+    while (!worklist.empty()) {
+        SsaValue v = worklist.back();
+        worklist.pop_back();
+        if (uses[v] != nullptr) {
+            for (SsaValue arg : *uses[v]) {
+                mark(arg);
+            }
+        }
+    }
+
+    for (SsaBlock &block : function.blocks) {
+        stats.dead += std::erase_if(block.phis, [&](const SsaPhi &phi) {
+            return !live[phi.result];
+        });
+        stats.dead += std::erase_if(block.code, [&](const SsaInstr &in) {
+            return in.result != NO_VALUE && !live[in.result] && is_pure(in, constants);
+        });
+    }
+}
+
+
+// Loop invariant code motion: pure instructions of a loop whose arguments
+// are all defined outside of it move to its preheader. Inner loops go
+// first, so code can move out of several loops.
+static void hoist_loop_invariants(SsaFunction &function, SsaStats &stats) {
+    std::vector<SsaLoop> loops = function.loops;
+    std::sort(loops.begin(), loops.end(), [](const SsaLoop &a, const SsaLoop &b) {
+        return a.begin > b.begin;
+    });
+    std::vector<uint32_t> order = reverse_postorder(function);
+    SsaConstants constants(function);
+
+    for (const SsaLoop &loop : loops) {
+        if (!function.blocks[loop.header].reachable) {
+            continue;
+        }
+        auto in_loop = [&](uint32_t b) {
+            const SsaBlock &block = function.blocks[b];
+            return block.reachable && b != loop.preheader &&
+                block.begin >= loop.begin && block.begin <= loop.end;
+        };
+        std::vector<bool> defined(function.values, false);
+        for (uint32_t b : order) {
+            if (!in_loop(b)) {
+                continue;
+            }
+            for (const SsaPhi &phi : function.blocks[b].phis) {
+                defined[phi.result] = true;
+            }
+            for (const SsaInstr &in : function.blocks[b].code) {
+                if (in.result != NO_VALUE) {
+                    defined[in.result] = true;
+                    if (op_info(in.op).pushes > 1) {
+                        defined[in.result + 1] = true;
+                    }
+                }
+            }
+        }
+
+        std::vector<SsaInstr> &preheader = function.blocks[loop.preheader].code;
+        for (uint32_t b : order) {
+            if (!in_loop(b)) {
+                continue;
+            }
+            std::erase_if(function.blocks[b].code, [&](const SsaInstr &in) {
+                if (!is_pure(in, constants) ||
+                        std::any_of(in.args.begin(), in.args.end(),
+                            [&](SsaValue arg) { return defined[arg]; })) {
+                    return false;
+                }
+                preheader.push_back(in);
+                defined[in.result] = false;
+                ++stats.hoisted;
+                return true;
+            });
+        }
+    }
+}
+
+
+void optimize_ssa(SsaFunction &function, SsaStats &stats) {
+    propagate_copies(function, stats);
+    for (int round = 0; round < 8; ++round) {
+        bool changed = eliminate_common_subexpressions(function, stats);
+        changed |= propagate_copies(function, stats);
+        changed |= fold_branches(function, stats);
+        changed |= propagate_copies(function, stats);
+        if (!changed) {
+            break;
+        }
+    }
+    eliminate_dead_code(function, stats);
+    hoist_loop_invariants(function, stats);
+}
+
+
+// a < b as b > a and so on
+static Operations swapped_comparison(Operations op) {
+    switch (op) {
+        case Operations::OP_LESS_THAN: return Operations::OP_GREATER_THAN;
+        case Operations::OP_LESS_THAN_EQ: return Operations::OP_GREATER_THAN_EQ;
+        case Operations::OP_GREATER_THAN: return Operations::OP_LESS_THAN;
+        case Operations::OP_GREATER_THAN_EQ: return Operations::OP_LESS_THAN_EQ;
+        default: return op;
+    }
+}
+
+
+// Register form of an instruction, a compare and branch one with branch.
+// A constant operand becomes the immediate where there is such a form,
+// imm_arg is the index of that argument or -1.
+static RegInstr select_instr(const SsaInstr &in, const SsaConstants &constants,
+        bool branch, int &imm_arg) {
+    RegInstr reg;
+    reg.src = in.src;
+    reg.d = in.result;
+    imm_arg = -1;
+    if (in.copy) {
+        reg.op = RegOp::MOV;
+        reg.a = in.args[0];
+        return reg;
+    }
+    const OpInfo &info = op_info(in.op);
+    if (info.fold != nullptr) {
+        SsaValue b = in.args[0];
+        SsaValue a = in.args[1];
+        Operations op = in.op;
+        if (constants.is(a) && !(info.divides && constants.value[a] == 0)) {
+            imm_arg = 1;
+        }
+        else if (constants.is(b) && (is_commutative(op) || info.kind == OpKind::COMPARISON)) {
+            imm_arg = 0;
+            op = swapped_comparison(op);
+            std::swap(a, b);
+        }
+        reg.op = binary_reg_op(op, imm_arg >= 0, branch);
+        reg.a = b;
+        if (imm_arg >= 0) {
+            reg.imm = constants.value[a];
+        }
+        else {
+            reg.b = a;
+        }
+        return reg;
+    }
+
+    auto arg = [&](size_t i) { return in.args[i]; };
+    switch (in.op) {
+        case Operations::OP_PUSH:
+        case Operations::OP_MEM:
+            reg.op = RegOp::MOVI;
+            reg.imm = in.imm;
+            break;
+        case Operations::OP_DUMP:
+            if (constants.is(arg(0))) {
+                reg.op = RegOp::PRINTI;
+                reg.imm = constants.value[arg(0)];
+                imm_arg = 0;
+            }
+            else {
+                reg.op = RegOp::PRINT;
+                reg.a = arg(0);
+            }
+            break;
+        case Operations::OP_LOAD8:
+        case Operations::OP_LOAD64:
+            reg.op = in.op == Operations::OP_LOAD8 ? RegOp::LOAD8 : RegOp::LOAD64;
+            reg.a = arg(0);
+            break;
+        case Operations::OP_STORE8:
+        case Operations::OP_STORE64:
+            reg.op = in.op == Operations::OP_STORE8 ? RegOp::STORE8 : RegOp::STORE64;
+            reg.a = arg(0);
+            reg.b = arg(1);
+            break;
+        case Operations::OP_MEM_FILL:
+        case Operations::OP_MEM_COPY:
+        case Operations::OP_MEM_EQ:
+            reg.op = in.op == Operations::OP_MEM_FILL ? RegOp::MEM_FILL
+                : in.op == Operations::OP_MEM_COPY ? RegOp::MEM_COPY : RegOp::MEM_EQ;
+            reg.a = arg(0);
+            reg.b = arg(1);
+            reg.c = arg(2);
+            break;
+        case Operations::OP_MEM_SUM:
+            reg.op = RegOp::MEM_SUM;
+            reg.a = arg(0);
+            reg.b = arg(1);
+            break;
+        case Operations::OP_READ_INT:
+        case Operations::OP_READ_BYTE:
+            reg.op = in.op == Operations::OP_READ_INT ? RegOp::READ_INT : RegOp::READ_BYTE;
+            break;
+        default:
+            assert(false && "not an SSA instruction");
+    }
+    return reg;
+}
+
+
+// A value only used by a phi of the block its own block jumps to can be
+// computed right into the register of the phi, saving the copy on the
+// edge, when the old value of the phi is not read after that. Leaves a
+// function that is no longer in SSA form, for lowering only.
+static void coalesce_phi_copies(SsaFunction &function) {
+    std::vector<uint32_t> uses(function.values, 0);
+    for (const SsaBlock &block : function.blocks) {
+        for (const SsaPhi &phi : block.phis) {
+            for (SsaValue arg : phi.args) {
+                ++uses[arg];
+            }
+        }
+        for (const SsaInstr &in : block.code) {
+            for (SsaValue arg : in.args) {
+                ++uses[arg];
+            }
+        }
+        if (block.cond != NO_VALUE) {
+            ++uses[block.cond];
+        }
+    }
+
+    for (uint32_t b = 0; b < function.blocks.size(); ++b) {
+        SsaBlock &block = function.blocks[b];
+        if (!block.reachable || block.exit != SsaExit::JUMP) {
+            continue;
+        }
+        SsaBlock &succ = function.blocks[block.succs[0]];
+        size_t k = static_cast<size_t>(
+                std::find(succ.preds.begin(), succ.preds.end(), b) - succ.preds.begin());
+        for (SsaPhi &phi : succ.phis) {
+            SsaValue arg = phi.args[k];
+            auto reads = [&](const SsaInstr &in) {
+                return std::find(in.args.begin(), in.args.end(), phi.result) != in.args.end();
+            };
+            auto def = std::find_if(block.code.begin(), block.code.end(),
+                    [&](const SsaInstr &in) { return in.result == arg; });
+            if (uses[arg] != 1 || def == block.code.end() ||
+                    def->op == Operations::OP_PUSH || def->op == Operations::OP_MEM ||
+                    op_info(def->op).pushes != 1 || std::any_of(def + 1, block.code.end(), reads) ||
+                    std::any_of(succ.phis.begin(), succ.phis.end(),
+                        [&](const SsaPhi &other) { return other.args[k] == phi.result; })) {
+                continue;
+            }
+            def->result = phi.result;
+            phi.args[k] = phi.result;
+        }
+    }
+}
+
+
+// Every value gets the register of its number, one more is left for
+// breaking cycles of phi copies. Blocks are laid out in reverse
+// postorder. Phis become copies on the edges into their block, in a
+// block of their own where the edge is taken by a branch. A comparison
+// right before the branch on it is fused into a compare and branch, and
+// constants only used as immediates are never loaded into a register.
+void lower_ssa_to_registers(const SsaFunction &ssa, RegProgram &reg_program) {
+    SsaFunction function = ssa;
+    coalesce_phi_copies(function);
+    const std::vector<SsaBlock> &blocks = function.blocks;
+    std::vector<uint32_t> order = reverse_postorder(function);
+    SsaConstants constants(function);
+    uint32_t scratch = function.values;
+    reg_program.registers = function.values + 1;
+
+    // comparisons fused into the branch of their block
+    std::vector<bool> fused(function.values, false);
+    std::vector<uint32_t> register_uses(function.values, 0);
+    for (const SsaBlock &block : blocks) {
+        for (const SsaInstr &in : block.code) {
+            for (SsaValue arg : in.args) {
+                ++register_uses[arg];
+            }
+        }
+        for (const SsaPhi &phi : block.phis) {
+            for (SsaValue arg : phi.args) {
+                ++register_uses[arg];
+            }
+        }
+        if (block.cond != NO_VALUE) {
+            ++register_uses[block.cond];
+        }
+    }
+    for (uint32_t b : order) {
+        const SsaBlock &block = blocks[b];
+        if (block.exit != SsaExit::BRANCH || block.code.empty()) {
+            continue;
+        }
+        const SsaInstr &last = block.code.back();
+        if (!last.copy && last.result == block.cond && register_uses[block.cond] == 1 &&
+                op_info(last.op).kind == OpKind::COMPARISON) {
+            fused[block.cond] = true;
+        }
+    }
+
+    // registers constants need, besides immediates and phi copies
+    std::vector<bool> loaded(function.values, false);
+    for (uint32_t b : order) {
+        const SsaBlock &block = blocks[b];
+        for (const SsaInstr &in : block.code) {
+            int imm_arg;
+            select_instr(in, constants, in.result != NO_VALUE && fused[in.result], imm_arg);
+            for (size_t i = 0; i < in.args.size(); ++i) {
+                if (static_cast<int>(i) != imm_arg) {
+                    loaded[in.args[i]] = true;
+                }
+            }
+        }
+        if (block.cond != NO_VALUE && !fused[block.cond]) {
+            loaded[block.cond] = true;
+        }
+    }
+
+    std::vector<RegInstr> &code = reg_program.code;
+    code.clear();
+    std::vector<uint32_t> start(blocks.size(), 0);
+    // instructions whose target is still a block number
+    std::vector<size_t> fixups;
+
+    // phi copies on the edge from block b to s, as if done all at once
+    auto emit_copies = [&](uint32_t b, uint32_t s, uint32_t src) {
+        const SsaBlock &succ = blocks[s];
+        size_t k = static_cast<size_t>(
+                std::find(succ.preds.begin(), succ.preds.end(), b) - succ.preds.begin());
+        std::vector<std::pair<SsaValue, SsaValue>> copies;
+        for (const SsaPhi &phi : succ.phis) {
+            if (phi.args[k] != phi.result) {
+                copies.push_back({phi.result, phi.args[k]});
+            }
+        }
+        while (!copies.empty()) {
+            auto ready = std::find_if(copies.begin(), copies.end(), [&](const auto &copy) {
+                return std::none_of(copies.begin(), copies.end(), [&](const auto &other) {
+                    return other.second == copy.first;
+                });
+            });
+            RegInstr in;
+            in.src = src;
+            if (ready == copies.end()) {
+                // a cycle, move one destination out of the way
+                SsaValue moved = copies.front().first;
+                in.op = RegOp::MOV;
+                in.d = scratch;
+                in.a = moved;
+                code.push_back(in);
+                for (auto &copy : copies) {
+                    if (copy.second == moved) {
+                        copy.second = scratch;
+                    }
+                }
+                continue;
+            }
+            in.d = ready->first;
+            if (ready->second != scratch && constants.is(ready->second)) {
+                in.op = RegOp::MOVI;
+                in.imm = constants.value[ready->second];
+            }
+            else {
+                in.op = RegOp::MOV;
+                in.a = ready->second;
+            }
+            code.push_back(in);
+            copies.erase(ready);
+        }
+    };
+    auto has_copies = [&](uint32_t s) {
+        return !blocks[s].phis.empty();
+    };
+    auto jump = [&](uint32_t s, uint32_t src) {
+        RegInstr in;
+        in.op = RegOp::JMP;
+        in.src = src;
+        in.target = s;
+        fixups.push_back(code.size());
+        code.push_back(in);
+    };
+
+    for (size_t i = 0; i < order.size(); ++i) {
+        uint32_t b = order[i];
+        uint32_t next = i + 1 < order.size() ? order[i + 1] : UINT32_MAX;
+        const SsaBlock &block = blocks[b];
+        start[b] = static_cast<uint32_t>(code.size());
+        for (const SsaInstr &in : block.code) {
+            if (in.result != NO_VALUE && (fused[in.result] ||
+                        (constants.is(in.result) && !loaded[in.result]))) {
+                continue;
+            }
+            int imm_arg;
+            code.push_back(select_instr(in, constants, false, imm_arg));
+        }
+
+        switch (block.exit) {
+            case SsaExit::HALT:
+                {
+                    RegInstr in;
+                    in.op = RegOp::HALT;
+                    in.src = block.exit_src;
+                    code.push_back(in);
+                }
+                break;
+
+            case SsaExit::JUMP:
+                emit_copies(b, block.succs[0], block.exit_src);
+                if (block.succs[0] != next) {
+                    jump(block.succs[0], block.exit_src);
+                }
+                break;
+
+            case SsaExit::BRANCH:
+                {
+                    uint32_t taken = block.succs[0];
+                    uint32_t other = block.succs[1];
+                    RegInstr in;
+                    if (fused[block.cond]) {
+                        int imm_arg;
+                        in = select_instr(block.code.back(), constants, true, imm_arg);
+                    }
+                    else {
+                        in.op = RegOp::JZ;
+                        in.a = block.cond;
+                    }
+                    in.src = block.exit_src;
+                    size_t branch = code.size();
+                    code.push_back(in);
+                    if (!has_copies(other)) {
+                        code[branch].target = other;
+                        fixups.push_back(branch);
+                    }
+                    emit_copies(b, taken, block.exit_src);
+                    if (taken != next || has_copies(other)) {
+                        jump(taken, block.exit_src);
+                    }
+                    if (has_copies(other)) {
+                        code[branch].target = static_cast<uint32_t>(code.size());
+                        emit_copies(b, other, block.exit_src);
+                        if (other != next) {
+                            jump(other, block.exit_src);
+                        }
+                    }
+                }
+                break;
+        }
+    }
+
+    for (size_t i : fixups) {
+        code[i].target = start[code[i].target];
+    }
+}
+
+
+// Simulates through the SSA optimizer and register bytecode, returns false
+// without running anything when the program cannot be translated.
+bool simulate_ssa_program(std::string program_file_name,
+        const std::list<Operation> &operations_list, const Options &options) {
+    // small procedures disappear when inlined, any left over are unsupported
+    std::list<Operation> inlined = operations_list;
+    inline_procedures(program_file_name, inlined);
+    std::vector<Operation> program(inlined.begin(), inlined.end());
+
+    SsaFunction function;
+    std::string reason;
+    if (!build_ssa(program, function, reason)) {
+        if (options.vm_stats) {
+            std::cerr << "SSA unavailable: " << reason << '\n';
+        }
+        return false;
+    }
+    // overflows are reported by the stack interpreter where they happen
+    if (function.max_depth > static_cast<int64_t>(options.stack_size)) {
+        if (options.vm_stats) {
+            std::cerr << "SSA unavailable: stack size exceeded\n";
+        }
+        return false;
+    }
+
+    SsaStats stats;
+    optimize_ssa(function, stats);
+    RegProgram reg_program;
+    lower_ssa_to_registers(function, reg_program);
+    if (options.vm_stats) {
+        std::cerr << "SSA: " << function.values << " values, " << stats.folded << " folded, "
+            << stats.common << " common, " << stats.copies << " copies, "
+            << stats.hoisted << " hoisted, " << stats.dead << " dead\n";
+    }
+
+    std::cout << "Simulating\n";
+    run_register_program(program_file_name, program, reg_program, options);
+    return true;
+}
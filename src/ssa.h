@@ -0,0 +1,100 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "main.h"
+#include "regvm.h"
+
+
+// SSA form of a program whose stack depths are static, see
+// compute_stack_depths(). Every value pushed gets a number and is defined
+// once: ops become instructions on values, stack shuffles only rename
+// values, and blocks where control flow joins start with a phi per stack
+// slot. optimize_ssa() works on this form, which is then lowered to
+// register bytecode with a register per value.
+using SsaValue = uint32_t;
+inline constexpr SsaValue NO_VALUE = UINT32_MAX;
+
+
+struct SsaInstr {
+    // op of the program, OP_PUSH and OP_MEM define constants
+    Operations op = Operations::OP_PUSH;
+    // result = args[0], left behind by common subexpression elimination
+    bool copy = false;
+    // values popped, deepest first
+    std::vector<SsaValue> args;
+    // first value pushed, readint and readbyte push result + 1 as well
+    SsaValue result = NO_VALUE;
+    uint64_t imm = 0;
+    // index of the Operation, for errors
+    uint32_t src = 0;
+};
+
+
+struct SsaPhi {
+    SsaValue result;
+    // one per predecessor, in the order of SsaBlock::preds
+    std::vector<SsaValue> args;
+};
+
+
+enum class SsaExit : uint8_t {
+    HALT,
+    JUMP,       // to succs[0]
+    BRANCH,     // to succs[0] when cond is nonzero, to succs[1] otherwise
+};
+
+
+struct SsaBlock {
+    std::vector<SsaPhi> phis;
+    std::vector<SsaInstr> code;
+    SsaExit exit = SsaExit::HALT;
+    SsaValue cond = NO_VALUE;
+    uint32_t exit_src = 0;
+    std::vector<uint32_t> succs;
+    std::vector<uint32_t> preds;
+    // index of the first op, a loop preheader has the one of its while
+    uint64_t begin = 0;
+    bool reachable = true;
+};
+
+
+// A while loop over ops [begin, end] of the program. It is entered
+// through the empty preheader block, where code hoisted out of it goes.
+struct SsaLoop {
+    uint32_t preheader;
+    uint32_t header;
+    uint64_t begin;
+    uint64_t end;
+};
+
+
+struct SsaFunction {
+    // blocks[0] is the entry
+    std::vector<SsaBlock> blocks;
+    std::vector<SsaLoop> loops;
+    uint32_t values = 0;
+    int64_t max_depth = 0;
+};
+
+
+// What optimize_ssa() did, for --vm-stats
+struct SsaStats {
+    uint64_t folded = 0;
+    uint64_t common = 0;
+    uint64_t copies = 0;
+    uint64_t hoisted = 0;
+    uint64_t dead = 0;
+};
+
+
+bool build_ssa(const std::vector<Operation> &program, SsaFunction &function,
+        std::string &reason);
+void optimize_ssa(SsaFunction &function, SsaStats &stats);
+void lower_ssa_to_registers(const SsaFunction &ssa, RegProgram &reg_program);
+bool simulate_ssa_program(std::string program_file_name,
+        const std::list<Operation> &operations_list, const Options &options);